@@ -17,12 +17,330 @@ library
 */
 #include<gmp.h>
 #include<cstdlib>
+#include<cstring>
+#include<ctime>
 #include<iostream>
+#include<string>
+#include<vector>
+#include<deque>
+#include<list>
+#include<memory>
+#include<unordered_map>
+#include<mutex>
+#include<thread>
+#include<atomic>
+#include<functional>
+#include<map>
+#include<climits>
+#include<cstdint>
+#include<new>
+#include<stdexcept>
+#include<condition_variable>
+#include<sys/mman.h>
+#include<sys/syscall.h>
+#include<sched.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<cerrno>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<sys/wait.h>
+#include<poll.h>
+#include<csignal>
+#include<chrono>
+#include<algorithm>
+#include"fe.h"
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_SHIFT)
+#define MAP_HUGE_SHIFT 26//as in <linux/mman.h>: MAP_HUGETLB takes log2(page size) << MAP_HUGE_SHIFT
+#endif
 
 using namespace std;
 
 class FE_inner_product_DDH;
 
+/*gmp_arena replaces malloc for the short-lived integers of a batch operation. It is installed
+through GMP's custom allocation hooks (mp_set_memory_functions). While a gmp_arena::scope is open
+on a thread, every GMP allocation of that thread is a bump of a pointer in the thread's arena and
+every free is a no-op; when the outermost scope closes, the whole arena is reset at once.
+
+Arena memory is carved from reserved address ranges, so the hooks can tell arena blocks from heap
+blocks with a few comparisons. The ranges are reserved on demand: the first is min_region bytes,
+and every further one as large as all earlier ones together, so the reservation follows the
+largest batch seen. Heap blocks keep going to realloc/free, even inside a scope, so integers that
+were allocated before a scope opened stay on the heap. If the ranges cannot grow, blocks come
+from the heap instead; those are freed when the scope closes, like the arena.
+
+An integer that is first written inside a scope lives in the arena and must not be used after
+the scope closes: batch operations size their outputs before they open the scope, and code that
+creates long-lived integers inside a scope does so under a gmp_arena::pause. Every arena block
+records the scope that allocated it, and growing a block of a closed scope or of another thread
+aborts with a message instead of copying reused memory. Built with GMP_ARENA_DEBUG, the chunks of a
+thread are also made inaccessible while no scope is open, so any later read faults.
+*/
+class gmp_arena{
+private:
+    static const size_t chunk_size=((size_t)1)<<20;//unit in which arenas grow
+    static const size_t min_region=chunk_size<<6;//smallest address range reserved at a time
+    static const unsigned int max_regions=48;
+    struct header{//in front of every arena block
+        unsigned long long scope;//id of the outermost scope that allocated the block
+        size_t size;//usable bytes of the block
+    };
+    struct chunk{
+        char* base;
+        size_t size;
+    };
+    struct region{
+        char* base;
+        size_t size;
+    };
+    struct thread_arena{
+        std::vector<chunk> chunks;//chunks owned by this thread, reused after every reset
+        size_t current;//index of the chunk that is being filled
+        char* cursor;//next free byte of the current chunk
+        char* limit;//end of the current chunk
+        header* last;//most recent block, which Reallocate may grow in place
+        unsigned int depth;//number of open scopes
+        unsigned long long scope;//id of the open outermost scope, 0 while none is open
+        std::vector<void*> fallback;//heap blocks handed out by the open scope
+        thread_arena(){
+            current=0;cursor=nullptr;limit=nullptr;last=nullptr;depth=0;scope=0;
+        }
+        ~thread_arena(){//hand the chunks over to threads that are still running
+            std::lock_guard<std::mutex> guard(chunk_lock);
+            spare.insert(spare.end(),chunks.begin(),chunks.end());
+        }
+    };
+    static region regions[max_regions];//reserved ranges that all chunks are carved from
+    static std::atomic<unsigned int> region_count;
+    static size_t region_used;//bytes of the newest range handed out as chunks
+    static std::atomic<size_t> chunk_bytes;//bytes handed out as chunks in all
+    static std::atomic<unsigned long long> next_scope;
+    static std::mutex chunk_lock;//guards regions, region_used and spare
+    static std::vector<chunk> spare;//chunks of threads that have exited
+    static thread_local thread_arena arena;
+    static bool Owns(void* ptr){
+        unsigned int n=region_count.load(std::memory_order_acquire);
+        for(unsigned int r=0;r<n;r++){
+            if((char*)ptr>=regions[r].base && (char*)ptr<regions[r].base+regions[r].size){
+                return true;
+            }
+        }
+        return false;
+    }
+    //make a chunk accessible or not; only GMP_ARENA_DEBUG builds protect chunks
+    static void Protect(const chunk& c, bool open){
+#ifdef GMP_ARENA_DEBUG
+        mprotect(c.base,c.size,open?PROT_READ|PROT_WRITE:PROT_NONE);
+#else
+        (void)c;(void)open;
+#endif
+    }
+    //get a chunk of at least size bytes, or false if no more address space can be reserved
+    static bool New_Chunk(size_t size, chunk& c){
+        size=(size+chunk_size-1)/chunk_size*chunk_size;
+        std::lock_guard<std::mutex> guard(chunk_lock);
+        for(size_t i=0;i<spare.size();i++){
+            if(spare[i].size>=size){
+                c=spare[i];
+                spare.erase(spare.begin()+i);
+                Protect(c,true);
+                return true;
+            }
+        }
+        unsigned int n=region_count.load(std::memory_order_relaxed);
+        if(n==0 || region_used+size>regions[n-1].size){
+            if(n==max_regions){
+                return false;
+            }
+            size_t total=0;
+            for(unsigned int r=0;r<n;r++){
+                total+=regions[r].size;
+            }
+            size_t want=total>min_region?total:min_region;
+            want=want>size?want:size;
+            void* base=mmap(NULL,want,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+            if(base==MAP_FAILED){
+                return false;
+            }
+            regions[n]=region{(char*)base,want};
+            region_count.store(n+1,std::memory_order_release);
+            region_used=0;
+            n++;
+        }
+        c=chunk{regions[n-1].base+region_used,size};
+        region_used+=size;
+        chunk_bytes+=size;
+        return true;
+    }
+    static void* Bump(size_t n){
+        thread_arena& a=arena;
+        size_t need=sizeof(header)+((n+15)&~((size_t)15));
+        while(a.cursor==nullptr || a.cursor+need>a.limit){
+            if(a.cursor!=nullptr){
+                a.current++;
+            }
+            while(a.current<a.chunks.size() && a.chunks[a.current].size<need){
+                a.current++;//too small for this block; it is used again after the next reset
+            }
+            if(a.current==a.chunks.size()){
+                chunk c;
+                if(!New_Chunk(need,c)){
+                    return nullptr;
+                }
+                a.chunks.push_back(c);
+            }
+            a.cursor=a.chunks[a.current].base;
+            a.limit=a.cursor+a.chunks[a.current].size;
+        }
+        a.last=(header*)a.cursor;
+        a.last->scope=a.scope;
+        a.last->size=need-sizeof(header);
+        a.cursor+=need;
+        return a.last+1;
+    }
+    static void* Heap_Allocate(size_t n){
+        void* ptr=malloc(n);
+        if(ptr==nullptr){
+            fprintf(stderr,"gmp_arena: cannot allocate %zu bytes\n",n);
+            abort();
+        }
+        return ptr;
+    }
+    static void* Allocate(size_t n){
+        thread_arena& a=arena;
+        if(a.depth>0){
+            void* ptr=Bump(n);
+            if(ptr==nullptr){//out of address space: a heap block that the scope frees when it closes
+                ptr=Heap_Allocate(n);
+                a.fallback.push_back(ptr);
+            }
+            return ptr;
+        }
+        return Heap_Allocate(n);
+    }
+    //forget a heap block of the open scope that GMP has freed or moved
+    static void Forget(void* ptr){
+        std::vector<void*>& f=arena.fallback;
+        for(size_t i=f.size();i-->0;){
+            if(f[i]==ptr){
+                f[i]=f.back();
+                f.pop_back();
+                return;
+            }
+        }
+    }
+    static void* Reallocate(void* ptr, size_t old_size, size_t new_size){
+        thread_arena& a=arena;
+        if(!Owns(ptr)){
+            void* grown=realloc(ptr,new_size);
+            if(grown==nullptr){
+                fprintf(stderr,"gmp_arena: cannot reallocate %zu bytes\n",new_size);
+                abort();
+            }
+            if(grown!=ptr && !a.fallback.empty()){
+                for(size_t i=0;i<a.fallback.size();i++){
+                    if(a.fallback[i]==ptr){
+                        a.fallback[i]=grown;
+                    }
+                }
+            }
+            return grown;
+        }
+        header* h=(header*)ptr-1;
+        if(a.depth==0 || h->scope!=a.scope){
+            fprintf(stderr,"gmp_arena: an integer of a closed or foreign arena scope is being grown; it was used after its scope closed\n");
+            abort();
+        }
+        size_t need=(new_size+15)&~((size_t)15);
+        if(h==a.last && (char*)ptr+need<=a.limit){
+            a.cursor=(char*)ptr+need;//grow the latest block in place
+            h->size=need;
+            return ptr;
+        }
+        void* moved=Allocate(new_size);
+        memcpy(moved,ptr,old_size<new_size?old_size:new_size);
+        return moved;
+    }
+    static void Free(void* ptr, size_t){
+        if(Owns(ptr)){
+            return;//arena blocks go with their scope
+        }
+        if(!arena.fallback.empty()){
+            Forget(ptr);
+        }
+        free(ptr);
+    }
+public:
+    //install the hooks. Safe to call more than once; integers allocated before stay valid.
+    static void Install(){
+        static std::once_flag installed;
+        std::call_once(installed,[]{
+            mp_set_memory_functions(Allocate,Reallocate,Free);
+        });
+    }
+    //RAII scope of a batch operation: arena allocation while it is open, reset when the outermost scope closes
+    class scope{
+    public:
+        scope(){
+            Install();
+            thread_arena& a=arena;
+            if(a.depth++==0){
+                a.scope=++next_scope;
+                for(size_t c=0;c<a.chunks.size();c++){
+                    Protect(a.chunks[c],true);
+                }
+            }
+        }
+        scope(const scope&)=delete;
+        scope& operator=(const scope&)=delete;
+        ~scope(){
+            thread_arena& a=arena;
+            if(--a.depth==0){
+                for(size_t i=0;i<a.fallback.size();i++){
+                    free(a.fallback[i]);
+                }
+                a.fallback.clear();
+                for(size_t c=0;c<a.chunks.size();c++){
+                    Protect(a.chunks[c],false);
+                }
+                a.current=0;a.last=nullptr;a.scope=0;
+                a.cursor=a.chunks.empty()?nullptr:a.chunks[0].base;
+                a.limit=a.chunks.empty()?nullptr:a.chunks[0].base+a.chunks[0].size;
+            }
+        }
+    };
+    /*RAII suspension of the open scopes of the thread, for integers that must outlive them (a
+    generator's state, a cache entry): allocations go to the heap again until the pause ends
+    */
+    class pause{
+    private:
+        unsigned int depth;
+    public:
+        pause(){
+            depth=arena.depth;
+            arena.depth=0;
+        }
+        pause(const pause&)=delete;
+        pause& operator=(const pause&)=delete;
+        ~pause(){
+            arena.depth=depth;
+        }
+    };
+    //address space handed out to arenas so far, in bytes
+    static size_t Bytes_Reserved(){
+        return chunk_bytes.load();
+    }
+};
+gmp_arena::region gmp_arena::regions[gmp_arena::max_regions];
+std::atomic<unsigned int> gmp_arena::region_count{0};
+size_t gmp_arena::region_used=0;
+std::atomic<size_t> gmp_arena::chunk_bytes{0};
+std::atomic<unsigned long long> gmp_arena::next_scope{0};
+std::mutex gmp_arena::chunk_lock;
+std::vector<gmp_arena::chunk> gmp_arena::spare;
+thread_local gmp_arena::thread_arena gmp_arena::arena;
+
 /*Inner product functional encryption is built upon public key 
 encryption scheme, the ElGamal encryption scheme
 
@@ -69,6 +387,7 @@ public:
     const unsigned int bit_length=64;//define that each number should be of 64-bit long in ElGamal
     gmp_randstate_t state;//This is for initialization of pseudo-random generator
     mpz_t p,g;//the common parameters, the prime number p, and the generator of Z_{p}, g.
+    mpz_t q;//the order of the group generated by g, q = p - 1. Exponents can be reduced modulo q.
 
     ElGamal_Param(){
         gmp_randinit_mt(state);
@@ -77,6 +396,8 @@ public:
         mpz_init(p);mpz_init(g);
         mpz_set_ui(p,73);//set prime number p
         mpz_set_ui(g,15);//set generator g
+        mpz_init(q);
+        mpz_sub_ui(q,p,1);//g generates Z_{p}^{*}, whose order is p - 1
         /*This implementation is only for demo purpose. For more practical use, we might need to generate 
         large random numbers and use prime test to probabilistically guarantee that it is a desired prime
         number p. Below is a possible version of codes to generate such large prime number p.
@@ -92,236 +413,7118 @@ public:
     }
 };
 
-class ElGamal_Client{
-    friend class FE_inner_product_DDH;
-private:
-    mpz_t x;//private key
-    /*gcdExtended receives c0, p, and computes c0 * inv + p * co_inv = gcd where gcd is the greatest common divisor
-    when gcd = 1, inv is the inverse of c0 modular p.
-    */
-    void gcdExtended(mpz_t c0, mpz_t p, mpz_t *inv, mpz_t *co_inv, mpz_t *gcd){
-        if(mpz_cmp_ui(c0,0)==0){
-            mpz_set_ui(*inv,0);
-            mpz_set_ui(*co_inv,1);
-            mpz_set(*gcd,p);
+/*huge_pages maps the storage of large, randomly probed tables (fixed-base tables, dlog tables)
+onto huge pages, so that a probe costs a cache miss but rarely a TLB miss. Blocks of at least
+1 GB try 1 GB pages first, then 2 MB pages are tried with MAP_HUGETLB; if the system has no huge
+pages reserved, the block is mapped normally and transparent huge pages are requested with
+madvise. Blocks below min_bytes are not worth a mapping and come from operator new.
+The gain is in the dlog tables, whose probes are one hash slot each: a 320 MB table answers
+about a quarter faster. A fixed-base exponentiation spends its time in the multiplications and
+shows no difference; see section 4 of README.md.
+*/
+class huge_pages{
+public:
+    enum backing{none,transparent,huge_2mb,huge_1gb};
+    static const size_t min_bytes=((size_t)1)<<20;
+    static void* Map(size_t bytes){
+        if(bytes<min_bytes){
+            return ::operator new(bytes);
+        }
+        const size_t mb2=((size_t)2)<<20;
+        void* base=MAP_FAILED;
+        size_t length=0;
+        backing kind=none;
+#ifdef MAP_HUGETLB
+        const size_t gb1=((size_t)1)<<30;
+        if(bytes>=gb1){
+            length=(bytes+gb1-1)/gb1*gb1;
+            base=mmap(NULL,length,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|(30<<MAP_HUGE_SHIFT),-1,0);
+            kind=huge_1gb;
+        }
+#endif
+#ifdef MAP_HUGETLB
+        if(base==MAP_FAILED){
+            length=(bytes+mb2-1)/mb2*mb2;
+            base=mmap(NULL,length,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|(21<<MAP_HUGE_SHIFT),-1,0);
+            kind=huge_2mb;
+        }
+#endif
+        if(base==MAP_FAILED){
+            //map 2 MB more than needed and trim, so that the block is aligned to a huge page
+            length=(bytes+mb2-1)/mb2*mb2;
+            char* raw=(char*)mmap(NULL,length+mb2,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+            if(raw==MAP_FAILED){
+                throw std::bad_alloc();
+            }
+            char* aligned=(char*)(((uintptr_t)raw+mb2-1)/mb2*mb2);
+            if(aligned>raw){
+                munmap(raw,aligned-raw);
+            }
+            if(aligned+length<raw+length+mb2){
+                munmap(aligned+length,raw+length+mb2-(aligned+length));
+            }
+            base=aligned;
+            kind=none;
+#ifdef MADV_HUGEPAGE
+            if(madvise(base,length,MADV_HUGEPAGE)==0){
+                kind=transparent;
+            }
+#endif
+        }
+        std::lock_guard<std::mutex> guard(lock());
+        mappings()[base]=std::make_pair(length,kind);
+        return base;
+    }
+    static void Unmap(void* ptr, size_t bytes){
+        if(bytes<min_bytes){
+            ::operator delete(ptr);
             return;
         }
-        mpz_t t1,t2,r,tmp;
-        mpz_init(t1);mpz_init(t2);mpz_init(r);mpz_init(tmp);
-        mpz_mod(r,p,c0);
-        gcdExtended(r,c0,&t1,&t2,gcd);
-        mpz_fdiv_q(tmp,p,c0);
-        mpz_mul(tmp,tmp,t1);
-        mpz_sub(*inv,t2,tmp);
-        mpz_set(*co_inv,t1);
-        return;
+        size_t length;
+        {
+            std::lock_guard<std::mutex> guard(lock());
+            auto it=mappings().find(ptr);
+            length=it->second.first;
+            mappings().erase(it);
+        }
+        munmap(ptr,length);
     }
-public:
-    mpz_t h;//public key
-    static ElGamal_Param param;//this static member provides seed and state for pseudo-random generator. It also provides common knowledge of p and g.
-    ElGamal_Client(){
-        mpz_init(x);mpz_init(h);
-        mpz_urandomb(x,param.state,param.bit_length);
-        mpz_mod(x,x,param.p);//randomly choose a private key in Z_{p}
-        mpz_powm(h,param.g,x,param.p);//compute the corresponding public key
+    //how the block at ptr is backed, for blocks returned by Map
+    static backing Backing(const void* ptr){
+        std::lock_guard<std::mutex> guard(lock());
+        auto it=mappings().find((void*)ptr);
+        return it==mappings().end()?none:it->second.second;
     }
-    commitment Get_Commitment(){//commitment C(r). Please refer to the original paper, Section 4 - structure, and Section 4.1 construction - encryption
-        mpz_t y;
-        mpz_init(y);
-        mpz_urandomb(y,param.state,param.bit_length);
-        mpz_mod(y,y,param.p);//randomly choose y in Z_{p}
-        commitment ret;
-        mpz_set(ret.rand,y);//use y as the commitment
-        return ret;
+private:
+    static std::mutex& lock(){
+        static std::mutex m;
+        return m;
     }
-    /*ElGamal encryption of message msg with randomness (commitment) y and receiver rcvr's public key*/
-    cipher_text Encrypt(mpz_t& msg, commitment& y, ElGamal_Client& rcvr){
-        mpz_t c0,c1;
-        mpz_init(c0);mpz_init(c1);
-        mpz_powm(c0,param.g,y.rand,param.p);// c0 = g^Y (mod p)
-        mpz_powm(c1,rcvr.h,y.rand,param.p);
-        mpz_mul(c1,c1,msg);
-        mpz_mod(c1,c1,param.p);// c1 = h^Y * msg (mod p) (h = g^X)
-        cipher_text c;
-        mpz_set(c.c0,c0);
-        mpz_set(c.c1,c1);
-        return c;
+    static std::map<void*,std::pair<size_t,backing>>& mappings(){
+        static std::map<void*,std::pair<size_t,backing>> m;
+        return m;
     }
-    /*ElGamal Decryption: decrypt cipher text: c with externally provided public key: key*/
-    plain_text Decrypt(cipher_text& c,mpz_t& key){
-        mpz_t c0,c1;
-        mpz_init(c0);mpz_init(c1);
-        mpz_set(c0,c.c0);
-        mpz_set(c1,c.c1);
-        mpz_powm(c0,c0,key,param.p);//compute h^X = g^(XY)
-        mpz_t t1,t2,t3;
-        mpz_init(t1);mpz_init(t2);mpz_init(t3);
-        gcdExtended(c0,param.p,&t1,&t2,&t3);//compute the inverse of g^(XY): t1 = (g^(XY))^(-1)
-        mpz_mod(t1,t1,param.p);
-        plain_text pt;
-        mpz_mul(pt.msg,c1,t1);
-        /*recover the message:
-        c1 = msg * g^(XY). t1 = (g^(XY))^(-1). c1 * t1 = msg
-        */
-        mpz_mod(pt.msg,pt.msg,param.p);
-        return pt;
+};
+
+//allocator that lets standard containers keep their elements in huge_pages
+template<class T>
+class huge_page_allocator{
+public:
+    typedef T value_type;
+    huge_page_allocator(){}
+    template<class U>
+    huge_page_allocator(const huge_page_allocator<U>&){}
+    T* allocate(size_t n){
+        return (T*)huge_pages::Map(n*sizeof(T));
     }
-    /*ElGamal Decryption: decrypt cipher text: c with the client's own public key*/
-    plain_text Decrypt(cipher_text& c){
-        plain_text pt=Decrypt(c,x);
-        return pt;
+    void deallocate(T* ptr, size_t n){
+        huge_pages::Unmap(ptr,n*sizeof(T));
+    }
+    template<class U>
+    bool operator==(const huge_page_allocator<U>&) const{
+        return true;
+    }
+    template<class U>
+    bool operator!=(const huge_page_allocator<U>&) const{
+        return false;
     }
 };
-/*cipher text for Functional Encryption*/
-class cipher_text_FE{
+
+/*Exponent_Digit returns the w-bit digit of the non-negative exponent e that starts at bit
+position pos, i.e. (e >> pos) mod 2^w. w must be smaller than the number of bits in a limb.
+*/
+inline unsigned long Exponent_Digit(const mpz_t e, unsigned long pos, unsigned int w){
+    size_t idx=pos/GMP_NUMB_BITS;
+    unsigned int shift=pos%GMP_NUMB_BITS;
+    mp_limb_t d=mpz_getlimbn(e,idx)>>shift;
+    if(shift+w>GMP_NUMB_BITS){
+        d|=mpz_getlimbn(e,idx+1)<<(GMP_NUMB_BITS-shift);
+    }
+    return (unsigned long)(d&((((mp_limb_t)1)<<w)-1));
+}
+
+/*fixed_base_table precomputes base^(d * 2^(window*j)) (mod p) for every window position j and
+every w-bit digit d. base^e (mod p) is then the product of one table entry per window of e,
+without any squarings. The entries are stored as fixed-width limb arrays in one contiguous,
+huge-page backed block.
+*/
+class fixed_base_table{
 public:
-    mpz_t c0;//Ct_{0}
-    mpz_t* c1;//Ct_{1}
-    cipher_text_FE(unsigned int len){
-        mpz_init(c0);
-        c1=(mpz_t *) malloc(len * sizeof(mpz_t));
-        for(int i=0;i<len;i++){
-            mpz_init(c1[i]);
+    unsigned int window;//number of exponent bits consumed per row of the table
+    unsigned int rows;//number of windows needed to cover an exponent of exp_bits bits
+    size_t limbs;//number of limbs of every stored entry (the size of p)
+    std::vector<mp_limb_t,huge_page_allocator<mp_limb_t>> entries;//rows * 2^window entries of limbs limbs each
+    fixed_base_table(){
+        window=0;rows=0;limbs=0;
+    }
+    //bytes taken by the table of an exponent of exp_bits bits modulo p
+    static size_t Bytes(const mpz_t p, unsigned int exp_bits, unsigned int w){
+        return (size_t)((exp_bits+w-1)/w)*(((size_t)1)<<w)*mpz_size(p)*sizeof(mp_limb_t);
+    }
+    void Build(const mpz_t base, const mpz_t p, unsigned int exp_bits, unsigned int w){
+        window=w;
+        rows=(exp_bits+w-1)/w;
+        limbs=mpz_size(p);
+        size_t digits=((size_t)1)<<w;
+        entries.assign(rows*digits*limbs,0);
+        mpz_t row_base,e;
+        mpz_init(row_base);mpz_init(e);
+        mpz_mod(row_base,base,p);//row_base = base^(2^(window*j)) for the current row j
+        for(unsigned int j=0;j<rows;j++){
+            mpz_set_ui(e,1);
+            for(size_t d=0;d<digits;d++){
+                mpz_export(&entries[(j*digits+d)*limbs],NULL,-1,sizeof(mp_limb_t),0,GMP_NAIL_BITS,e);
+                mpz_mul(e,e,row_base);
+                mpz_mod(e,e,p);
+            }
+            mpz_set(row_base,e);//row_base^(2^window) is the base of the next row
+        }
+        mpz_clear(row_base);mpz_clear(e);
+    }
+    //compute rop = base^e (mod p) for 0 <= e < 2^(window*rows)
+    void Power(mpz_t rop, const mpz_t e, const mpz_t p) const{
+        size_t digits=((size_t)1)<<window;
+        mpz_t acc,entry;
+        mpz_init_set_ui(acc,1);
+        for(unsigned int j=0;j<rows;j++){
+            unsigned long d=Exponent_Digit(e,(unsigned long)j*window,window);
+            if(d==0){
+                continue;//base^0 = 1 contributes nothing
+            }
+            mpz_mul(acc,acc,mpz_roinit_n(entry,&entries[(j*digits+d)*limbs],limbs));
+            mpz_mod(acc,acc,p);
         }
+        mpz_swap(rop,acc);
+        mpz_clear(acc);
+    }
+    size_t Bytes() const{
+        return entries.size()*sizeof(mp_limb_t);
     }
 };
-/*Secret key for Functional Encryption*/
-class secret_key_FE{
+
+/*joint_base_table precomputes g^(a * 2^(window*j)) * h^(b * 2^(window*j)) (mod p) for every window
+position j and every pair of w-bit digits (a, b). g^e1 * h^e2 (mod p) is then one table entry per
+window: both exponents are walked together, at the cost of a single fixed-base exponentiation.
+A row holds 2^(2*window) entries, so the table is 2^window / 2 times the size of the two
+fixed_base_tables of g and h together.
+*/
+class joint_base_table{
 public:
-    mpz_t sk_y;
-    secret_key_FE(){
-        mpz_init(sk_y);
+    unsigned int window;
+    unsigned int rows;
+    size_t limbs;
+    std::vector<mp_limb_t,huge_page_allocator<mp_limb_t>> entries;//rows * 2^(2*window) entries of limbs limbs each, indexed by (j, a, b)
+    joint_base_table(){
+        window=0;rows=0;limbs=0;
+    }
+    //bytes taken by the table of an exponent of exp_bits bits modulo p
+    static size_t Bytes(const mpz_t p, unsigned int exp_bits, unsigned int w){
+        return (size_t)((exp_bits+w-1)/w)*(((size_t)1)<<(2*w))*mpz_size(p)*sizeof(mp_limb_t);
+    }
+    void Build(const mpz_t g, const mpz_t h, const mpz_t p, unsigned int exp_bits, unsigned int w){
+        window=w;
+        rows=(exp_bits+w-1)/w;
+        limbs=mpz_size(p);
+        size_t digits=((size_t)1)<<w;
+        entries.assign(rows*digits*digits*limbs,0);
+        mpz_t* g_row=(mpz_t *) malloc(digits * sizeof(mpz_t));//g_j^a for the current row j
+        mpz_t* h_row=(mpz_t *) malloc(digits * sizeof(mpz_t));//h_j^b
+        for(size_t d=0;d<digits;d++){
+            mpz_init(g_row[d]);mpz_init(h_row[d]);
+        }
+        mpz_t g_base,h_base,e;
+        mpz_init(g_base);mpz_init(h_base);mpz_init(e);
+        mpz_mod(g_base,g,p);
+        mpz_mod(h_base,h,p);
+        for(unsigned int j=0;j<rows;j++){
+            mpz_set_ui(g_row[0],1);
+            mpz_set_ui(h_row[0],1);
+            for(size_t d=1;d<digits;d++){
+                mpz_mul(g_row[d],g_row[d-1],g_base);
+                mpz_mod(g_row[d],g_row[d],p);
+                mpz_mul(h_row[d],h_row[d-1],h_base);
+                mpz_mod(h_row[d],h_row[d],p);
+            }
+            for(size_t a=0;a<digits;a++){
+                for(size_t b=0;b<digits;b++){
+                    mpz_mul(e,g_row[a],h_row[b]);
+                    mpz_mod(e,e,p);
+                    mpz_export(&entries[((j*digits+a)*digits+b)*limbs],NULL,-1,sizeof(mp_limb_t),0,GMP_NAIL_BITS,e);
+                }
+            }
+            mpz_mul(g_base,g_row[digits-1],g_base);//g_j^(2^window) is the base of the next row
+            mpz_mod(g_base,g_base,p);
+            mpz_mul(h_base,h_row[digits-1],h_base);
+            mpz_mod(h_base,h_base,p);
+        }
+        for(size_t d=0;d<digits;d++){
+            mpz_clear(g_row[d]);mpz_clear(h_row[d]);
+        }
+        free(g_row);free(h_row);
+        mpz_clear(g_base);mpz_clear(h_base);mpz_clear(e);
+    }
+    //compute rop = g^e1 * h^e2 (mod p) for 0 <= e1, e2 < 2^(window*rows)
+    void Power(mpz_t rop, const mpz_t e1, const mpz_t e2, const mpz_t p) const{
+        size_t digits=((size_t)1)<<window;
+        mpz_t acc,entry;
+        mpz_init_set_ui(acc,1);
+        for(unsigned int j=0;j<rows;j++){
+            unsigned long a=Exponent_Digit(e1,(unsigned long)j*window,window);
+            unsigned long b=Exponent_Digit(e2,(unsigned long)j*window,window);
+            if(a==0 && b==0){
+                continue;
+            }
+            mpz_mul(acc,acc,mpz_roinit_n(entry,&entries[((j*digits+a)*digits+b)*limbs],limbs));
+            mpz_mod(acc,acc,p);
+        }
+        mpz_swap(rop,acc);
+        mpz_clear(acc);
+    }
+    size_t Bytes() const{
+        return entries.size()*sizeof(mp_limb_t);
     }
 };
 
-/*Inner Product - DDH functional encryption is built on top of ElGamal (or other Public Key Encryption (PKE) schemes)
-the class member, PKE_functionality provides common configurations (p, g) and general PKE (ElGamal) functionalities (commitment, PKE encryption and PKE decryption)
-the class member, key_gen, creates a number of ElGamal clients, so that they can generate independent (secret key, public key) pairs
+/*blocked_bloom is a split-block Bloom filter: the high half of a 64-bit hash selects one 32-byte
+block, and the low half sets one bit in each of the block's eight 32-bit words. A query reads a
+single cache line, and the whole filter is kept small enough for L2/L3 (max_bytes), so that it
+answers most questions of the form "is this element in the table?" without touching DRAM.
 */
-
-class FE_inner_product_DDH{
+class blocked_bloom{
 private:
-    unsigned int vec_len=6;//this is l in the original paper. It specifies the number of (sk,pk) pairs and the number of msg blocks
-    ElGamal_Client PKE_functionality;//provide ElGamal configuration and functionalities
-    secret_key_FE sk;//store the secret key sk_{y} derived from master secret key msk
-    void g_x(mpz_t* x, mpz_t* gx){//according to the paper, messages: msg are encoded as g^(msg). This function converts an array of msg to the form of g^(msg)
-        for(int i=0;i<vec_len;i++){
-            mpz_powm(gx[i],PKE_functionality.param.g,x[i],PKE_functionality.param.p);
-        }
+    std::vector<uint32_t> words;//8 words per block
+    size_t block_mask;
+    static uint32_t Bit(uint64_t h, int i){
+        static const uint32_t salt[8]={0x47b6137bU,0x44974d91U,0x8824ad5bU,0xa2b7289dU,0x705495c7U,0x2df1424bU,0x9efc4947U,0x5c6bfb31U};
+        return ((uint32_t)1)<<(((uint32_t)h*salt[i])>>27);
     }
 public:
-    ElGamal_Client* key_gen;//a number of ElGamal clients to be initialized
-    mpz_t *y;//the vector y used in KeyDer (Key Derivation)
-    //initialization with default vec_len=6
-    FE_inner_product_DDH(){
-        /*create ElGamal Clients. Each client generates its (sk,pk) pair.
-        The key generation process is implemented in the constructor of ElGamal_Client,
-        so that we don't have to do anything explicitly here for Setup. 
-        */
-        key_gen=new ElGamal_Client[vec_len];
-        //initialize the vector y so that it is ready to be used in KeyDer.
-        y=(mpz_t *) malloc(vec_len * sizeof(mpz_t));
-        for(int i=0;i<vec_len;i++){
-            mpz_init(y[i]);
-        }
-    }
-    //initialization with customer defined vec_len=len
-    FE_inner_product_DDH(unsigned int len){
-        vec_len=len;
-        key_gen=new ElGamal_Client[vec_len];
-        y=(mpz_t *) malloc(vec_len * sizeof(mpz_t));
-        for(int i=0;i<vec_len;i++){
-            mpz_init(y[i]);
-        }
+    static const size_t bits_per_key=12;
+    static const size_t min_bits_per_key=8;//below this most queries pass, and the filter only adds a load
+    blocked_bloom(){
+        block_mask=0;
     }
-    /*This is the implementation of KeyDer in the paper
-    input: vector y output:sk_{y}
+    /*size the filter for keys keys, in at most max_bytes bytes. If that leaves fewer than
+    min_bits_per_key bits per key the filter stays empty, and Contains answers true to everything.
     */
-    void Key_Derivation(mpz_t* vec){
-        for(int i=0;i<vec_len;i++){//copy vec to y
-            mpz_set(y[i],vec[i]);
+    void Build(size_t keys, size_t max_bytes){
+        size_t blocks=1;
+        while(blocks*256<keys*bits_per_key && blocks*64<=max_bytes){
+            blocks*=2;
         }
-        mpz_set_ui(sk.sk_y,0);//clear the secret key sk_{y}
-        mpz_t tmp;//store the intermediate result of Sum (y_{i} * sk_{i})
-        mpz_init(tmp);
-        for(int i=0;i<vec_len;i++){
-            mpz_mul(tmp,y[i],key_gen[i].x);//y_{i} * sk_{i}. sk_{i} is the i-th ElGamal client's secret key sk
-            mpz_add(sk.sk_y,sk.sk_y,tmp);//compute the partial sum
+        block_mask=blocks-1;
+        words.clear();
+        if(blocks*256>=keys*min_bits_per_key){
+            words.assign(blocks*8,0);
         }
-        //obtain secret key sk_{y} and finish KeyDer
-        gmp_printf("key derivation: %Zd\n", sk.sk_y);
     }
-    //functional encryption's encryption functionality
-    cipher_text_FE Encrypt(mpz_t* msg){
-        //use PKE to get commitment C(r)
-        commitment y=PKE_functionality.Get_Commitment();
-        gmp_printf("Commitment Y:= %Zd\n",y.rand);
-        //create the cipher text Ct=(Ct_{0}, Ct_{1}) where Ct_{1} has vec_len components
-        cipher_text_FE ct(vec_len);
-        mpz_t c0;
-        mpz_init(c0);
-        mpz_powm(c0,PKE_functionality.param.g,y.rand,PKE_functionality.param.p);//Ct_{0} = g^Y
-        mpz_set(ct.c0,c0);
-        mpz_t* g_msg=(mpz_t*)malloc(vec_len*sizeof(mpz_t));
-        for(int i=0;i<vec_len;i++){
-            mpz_init(g_msg[i]);
+    bool Empty() const{
+        return words.empty();
+    }
+    const uint32_t* Block(uint64_t h) const{
+        return &words[((h>>32)&block_mask)*8];
+    }
+    void Insert(uint64_t h){
+        if(words.empty()){
+            return;
         }
-        g_x(msg,g_msg);//convert msg to the form of g^(msg)
-        for(int i=0;i<vec_len;i++){
-            gmp_printf("g^x%d: %Zd\n",i+1,g_msg[i]);
-            /*use commitment y, and each client key_gen[i]'s public key to encrypt g^{msg[i]}
-            and obtain the i-th component of Ct_{1}
-            */
-            cipher_text c=PKE_functionality.Encrypt(g_msg[i],y,key_gen[i]);
-            mpz_set(ct.c1[i],c.c1);
+        uint32_t* b=&words[((h>>32)&block_mask)*8];
+        for(int i=0;i<8;i++){
+            b[i]|=Bit(h,i);
         }
-        return ct;
     }
-    //functional encryption's decryption functionality
-    plain_text Decrypt(cipher_text_FE& ct,secret_key_FE& sk){
-        mpz_t c1;
-        mpz_init(c1);
-        mpz_set_ui(c1,1);
-        mpz_t tmp;
-        mpz_init(tmp);
-        for(int i=0;i<vec_len;i++){
-            //raise each Ct_{i} to the power of y_{i} and compute the product of (Ct_{i})^(y_{i})
-            mpz_powm(tmp,ct.c1[i],y[i],PKE_functionality.param.p);
-            mpz_mul(c1,c1,tmp);
-            mpz_mod(c1,c1,PKE_functionality.param.p);
+    bool Contains(uint64_t h) const{
+        if(words.empty()){
+            return true;
         }
-        cipher_text ct_pke;
-        mpz_set(ct_pke.c0,ct.c0);
-        mpz_set(ct_pke.c1,c1);
-        gmp_printf("Decryption: c0: %Zd\n",ct_pke.c0);
-        gmp_printf("Decryption: c1: %Zd\n",ct_pke.c1);
-        gmp_printf("Decryption: sk_y: %Zd\n",sk.sk_y);
-        //Functional encryption's decryption is to use ElGamal to decrypt (Ct_{0}, Product of (Ct_{i})^(y_{i})) with the key sk_{y}
-        plain_text pt=PKE_functionality.Decrypt(ct_pke,sk.sk_y);
+        const uint32_t* b=Block(h);
+        bool in=true;
+        for(int i=0;i<8;i++){
+            in&=(b[i]&Bit(h,i))!=0;
+        }
+        return in;
+    }
+    size_t Bytes() const{
+        return words.size()*sizeof(uint32_t);
+    }
+};
+
+/*dlog_table solves g^k = h (mod p) for 0 <= k < baby*giant with baby-step giant-step.
+The baby steps g^j, j < baby, are kept in an open-addressing hash table with linear probing.
+Every slot is one limb holding j + 1 (0 marks an empty slot) followed by the limbs of g^j, and
+all slots live in one huge-page backed block. A lookup multiplies h by g^(-baby) at most giant
+times until it lands on a baby step.
+*/
+class dlog_table{
+public:
+    unsigned long baby;//number of baby steps stored in the table
+    unsigned long giant;//number of giant steps tried by Lookup
+    size_t limbs;//number of limbs of a stored element (the size of p)
+    size_t mask;//number of slots - 1; the number of slots is a power of two
+    std::vector<mp_limb_t,huge_page_allocator<mp_limb_t>> slots;
+    blocked_bloom filter;//of the baby steps, consulted before the slots
+    mpz_t giant_step;//g^(-baby) (mod p)
+    mpz_t p;
+    static const size_t filter_bytes=((size_t)8)<<20;
+    static const size_t batch_group=16;//elements whose probes Lookup_Batch prefetches together
+    dlog_table(){
+        baby=0;giant=0;limbs=0;mask=0;
+        mpz_init(giant_step);mpz_init(p);
+    }
+    dlog_table(const dlog_table&)=delete;
+    dlog_table& operator=(const dlog_table&)=delete;
+    ~dlog_table(){
+        mpz_clear(giant_step);mpz_clear(p);
+    }
+    static unsigned long long Hash(const mp_limb_t* e, size_t n){
+        unsigned long long h=0x9e3779b97f4a7c15ULL;
+        for(size_t i=0;i<n;i++){
+            h^=(unsigned long long)e[i];
+            h*=0xbf58476d1ce4e5b9ULL;
+            h^=h>>31;
+        }
+        return h;
+    }
+    //copy the limbs of e (0 <= e < p) into buf, padded with zeros to limbs limbs
+    void Pad(const mpz_t e, mp_limb_t* buf) const{
+        size_t n=mpz_size(e);
+        memcpy(buf,mpz_limbs_read(e),n*sizeof(mp_limb_t));
+        memset(buf+n,0,(limbs-n)*sizeof(mp_limb_t));
+    }
+    void Build(const mpz_t g, const mpz_t modulus, unsigned long baby_steps, unsigned long giant_steps){
+        baby=baby_steps;giant=giant_steps;
+        mpz_set(p,modulus);
+        limbs=mpz_size(p);
+        size_t n=1;
+        while(n<2*baby){
+            n*=2;//keep the load factor at or below 1/2
+        }
+        mask=n-1;
+        slots.assign(n*(limbs+1),0);
+        filter.Build(baby,filter_bytes);
+        std::vector<mp_limb_t> buf(limbs);
+        mpz_t e;
+        mpz_init_set_ui(e,1);
+        for(unsigned long j=0;j<baby;j++){
+            Pad(e,buf.data());
+            unsigned long long h=Hash(buf.data(),limbs);
+            filter.Insert(h);
+            size_t s=h&mask;
+            bool seen=false;
+            while(slots[s*(limbs+1)]!=0 && !seen){
+                seen=memcmp(&slots[s*(limbs+1)+1],buf.data(),limbs*sizeof(mp_limb_t))==0;
+                s=(s+1)&mask;
+            }
+            if(!seen){//keep the smallest j if the order of g is below baby
+                slots[s*(limbs+1)]=j+1;
+                memcpy(&slots[s*(limbs+1)+1],buf.data(),limbs*sizeof(mp_limb_t));
+            }
+            mpz_mul(e,e,g);
+            mpz_mod(e,e,p);
+        }
+        mpz_invert(giant_step,e,p);//e = g^baby
+        mpz_clear(e);
+    }
+    //make this table a copy of other, e.g. a replica on another NUMA node
+    void Copy(const dlog_table& other){
+        baby=other.baby;giant=other.giant;limbs=other.limbs;mask=other.mask;
+        slots=other.slots;
+        filter=other.filter;
+        mpz_set(giant_step,other.giant_step);
+        mpz_set(p,other.p);
+    }
+    //the baby step j with g^j = e, or -1 if e is not a baby step. buf holds the padded limbs of e.
+    long Find(const mp_limb_t* buf) const{
+        unsigned long long h=Hash(buf,limbs);
+        if(!filter.Contains(h)){
+            return -1;
+        }
+        return Probe(buf,h);
+    }
+    //the same, past the filter: walk the slots from the home slot of the hash h of buf
+    long Probe(const mp_limb_t* buf, unsigned long long h) const{
+        size_t s=h&mask;
+        while(slots[s*(limbs+1)]!=0){
+            if(memcmp(&slots[s*(limbs+1)+1],buf,limbs*sizeof(mp_limb_t))==0){
+                return (long)slots[s*(limbs+1)]-1;
+            }
+            s=(s+1)&mask;
+        }
+        return -1;
+    }
+    //find k with g^k = h (mod p) and 0 <= k < baby*giant. Returns false if there is none.
+    bool Lookup(mpz_t k, const mpz_t h) const{
+        std::vector<mp_limb_t> buf(limbs);
+        mpz_t e;
+        mpz_init(e);
+        mpz_mod(e,h,p);
+        for(unsigned long i=0;i<giant;i++){
+            Pad(e,buf.data());
+            long j=Find(buf.data());
+            if(j>=0){
+                mpz_set_ui(k,i);
+                mpz_mul_ui(k,k,baby);
+                mpz_add_ui(k,k,(unsigned long)j);
+                mpz_clear(e);
+                return true;
+            }
+            mpz_mul(e,e,giant_step);
+            mpz_mod(e,e,p);
+        }
+        mpz_clear(e);
+        return false;
+    }
+    /*Lookup for count elements: found[a] tells whether k[a] was set. The elements walk their giant
+    steps in lockstep, batch_group at a time. In every step the filter blocks of the whole group
+    are prefetched before any is tested, and the home slots of the elements that pass are
+    prefetched before any is probed, so the misses of a group overlap instead of queueing.
+    */
+    void Lookup_Batch(mpz_t* k, mpz_t* h, size_t count, bool* found) const{
+        std::vector<mp_limb_t> buf(batch_group*limbs);
+        unsigned long long hash[batch_group];
+        bool pending[batch_group],pass[batch_group];
+        mpz_t e[batch_group];
+        for(size_t a=0;a<batch_group;a++){
+            mpz_init(e[a]);
+        }
+        for(size_t base=0;base<count;base+=batch_group){
+            size_t m=count-base<batch_group?count-base:batch_group;
+            size_t left=m;
+            for(size_t a=0;a<m;a++){
+                mpz_mod(e[a],h[base+a],p);
+                pending[a]=true;
+                found[base+a]=false;
+            }
+            for(unsigned long i=0;i<giant && left>0;i++){
+                for(size_t a=0;a<m;a++){
+                    if(pending[a]){
+                        Pad(e[a],&buf[a*limbs]);
+                        hash[a]=Hash(&buf[a*limbs],limbs);
+                        if(!filter.Empty()){
+                            __builtin_prefetch(filter.Block(hash[a]));
+                        }
+                    }
+                }
+                for(size_t a=0;a<m;a++){
+                    pass[a]=pending[a] && filter.Contains(hash[a]);
+                    if(pass[a]){
+                        __builtin_prefetch(&slots[(hash[a]&mask)*(limbs+1)]);
+                    }
+                }
+                for(size_t a=0;a<m;a++){
+                    long j=pass[a]?Probe(&buf[a*limbs],hash[a]):-1;
+                    if(j>=0){
+                        mpz_set_ui(k[base+a],i);
+                        mpz_mul_ui(k[base+a],k[base+a],baby);
+                        mpz_add_ui(k[base+a],k[base+a],(unsigned long)j);
+                        found[base+a]=true;
+                        pending[a]=false;
+                        left--;
+                    }else if(pending[a]){
+                        mpz_mul(e[a],e[a],giant_step);
+                        mpz_mod(e[a],e[a],p);
+                    }
+                }
+            }
+        }
+        for(size_t a=0;a<batch_group;a++){
+            mpz_clear(e[a]);
+        }
+    }
+    size_t Bytes() const{
+        return slots.size()*sizeof(mp_limb_t)+filter.Bytes();
+    }
+};
+
+/*tiered_dlog puts a small table in front of a dlog_table for results that cluster in a hot range
+[first, first + capacity). The small table has the slot layout of dlog_table (exponent + 1, then
+the padded element) and is sized to stay in the core's L2 cache, so a hot result costs one or
+two probes of cached memory; everything else falls back to the full table and its giant steps.
+The hot range is either configured, or learned: every result is sampled, and when more than a
+quarter of the lookups of a learn_interval missed, the table is rebuilt around the densest range
+of the samples. A tiered_dlog is not thread safe; give every thread its own, in front of one
+shared dlog_table, which also keeps each hot table in its own core's cache.
+*/
+class tiered_dlog{
+private:
+    const dlog_table& full;
+    mpz_t g;
+    size_t limbs,mask;
+    std::vector<mp_limb_t> slots;
+    std::vector<mp_limb_t> buf;
+    std::vector<unsigned long> samples;//recent results, used as a ring
+    size_t sampled,interval_lookups,interval_misses;
+public:
+    static const size_t hot_bytes=((size_t)256)<<10;
+    static const size_t learn_interval=4096;
+    size_t capacity;//number of exponents in the hot range
+    unsigned long first;
+    bool learning;
+    unsigned long long hits,misses;
+    tiered_dlog(const dlog_table& table, const mpz_t generator, size_t bytes=hot_bytes):full(table){
+        mpz_init_set(g,generator);
+        limbs=full.limbs;
+        size_t n=1;
+        while(2*n*(limbs+1)*sizeof(mp_limb_t)<=bytes){
+            n*=2;
+        }
+        mask=n-1;
+        capacity=n/2;//load factor 1/2
+        buf.resize(limbs);
+        samples.assign(learn_interval,0);
+        sampled=0;interval_lookups=0;interval_misses=0;
+        hits=0;misses=0;
+        learning=true;
+        Configure(0);
+    }
+    tiered_dlog(const tiered_dlog&)=delete;
+    tiered_dlog& operator=(const tiered_dlog&)=delete;
+    ~tiered_dlog(){
+        mpz_clear(g);
+    }
+    //make [start, start + capacity) the hot range, clipped to the range of the full table
+    void Configure(unsigned long start){
+        first=start;
+        slots.assign((mask+1)*(limbs+1),0);
+        unsigned long end=full.baby*full.giant;
+        size_t count=start>=end?0:(end-start<capacity?end-start:capacity);
+        mpz_t e;
+        mpz_init(e);
+        mpz_powm_ui(e,g,start,full.p);
+        for(size_t j=0;j<count;j++){
+            full.Pad(e,buf.data());
+            size_t s=dlog_table::Hash(buf.data(),limbs)&mask;
+            bool seen=false;
+            while(slots[s*(limbs+1)]!=0 && !seen){
+                seen=memcmp(&slots[s*(limbs+1)+1],buf.data(),limbs*sizeof(mp_limb_t))==0;
+                s=(s+1)&mask;
+            }
+            if(!seen){
+                slots[s*(limbs+1)]=start+j+1;
+                memcpy(&slots[s*(limbs+1)+1],buf.data(),limbs*sizeof(mp_limb_t));
+            }
+            mpz_mul(e,e,g);
+            mpz_mod(e,e,full.p);
+        }
+        mpz_clear(e);
+    }
+    //rebuild the hot range around the densest stretch of the sampled results
+    void Learn(){
+        size_t n=sampled<samples.size()?sampled:samples.size();
+        if(n==0){
+            return;
+        }
+        std::vector<unsigned long> sorted(samples.begin(),samples.begin()+n);
+        std::sort(sorted.begin(),sorted.end());
+        size_t best=0,best_count=0;
+        for(size_t a=0,b=0;a<n;a++){
+            while(b<n && sorted[b]-sorted[a]<capacity){
+                b++;
+            }
+            if(b-a>best_count){
+                best_count=b-a;
+                best=a;
+            }
+        }
+        if(sorted[best]!=first){
+            Configure(sorted[best]);
+        }
+    }
+    //k with g^k = h (mod p), 0 <= h < p. Returns false if h is outside the range of the full table.
+    bool Lookup(mpz_t k, const mpz_t h){
+        full.Pad(h,buf.data());
+        size_t s=dlog_table::Hash(buf.data(),limbs)&mask;
+        while(slots[s*(limbs+1)]!=0){
+            if(memcmp(&slots[s*(limbs+1)+1],buf.data(),limbs*sizeof(mp_limb_t))==0){
+                hits++;
+                unsigned long r=(unsigned long)slots[s*(limbs+1)]-1;
+                mpz_set_ui(k,r);
+                Sample(r,false);
+                return true;
+            }
+            s=(s+1)&mask;
+        }
+        misses++;
+        bool found=full.Lookup(k,h);
+        if(found && mpz_fits_ulong_p(k)){
+            Sample(mpz_get_ui(k),true);
+        }
+        return found;
+    }
+private:
+    void Sample(unsigned long r, bool missed){
+        if(!learning){
+            return;
+        }
+        samples[sampled++%samples.size()]=r;
+        interval_misses+=missed;
+        if(++interval_lookups==learn_interval){
+            if(interval_misses*4>learn_interval){
+                Learn();
+            }
+            interval_lookups=0;interval_misses=0;
+        }
+    }
+};
+
+/*sorted_dlog_table is a baby-step giant-step table built without a hash map. Threads compute
+g^j for blocks of j, each starting from its own g^(j0), and store for every j one 64-bit key:
+the high bits of the element's hash followed by j in the low index_bits bits. The keys are
+radix-sorted in parallel and stored in Eytzinger (breadth-first) order, so a lookup is a
+branchless descent whose next cache lines are prefetched. Hashes are truncated, so every key
+has the padded element g^j stored at the same position of a second array, and a candidate is
+confirmed by comparing limbs, without an exponentiation.
+*/
+class sorted_dlog_table{
+private:
+    static const unsigned int radix_bits=11;
+    //sort keys in place with a stable LSD radix sort, every pass split over threads
+    static void Radix_Sort(std::vector<uint64_t>& keys, unsigned int threads){
+        size_t n=keys.size();
+        size_t buckets=((size_t)1)<<radix_bits;
+        std::vector<uint64_t> other(n);
+        std::vector<size_t> counts(threads*buckets);
+        for(unsigned int shift=0;shift<64;shift+=radix_bits){
+            std::vector<std::thread> pool;
+            for(unsigned int t=0;t<threads;t++){
+                pool.emplace_back([&,t]{
+                    size_t* c=&counts[t*buckets];
+                    std::fill(c,c+buckets,0);
+                    for(size_t i=n*t/threads;i<n*(t+1)/threads;i++){
+                        c[(keys[i]>>shift)&(buckets-1)]++;
+                    }
+                });
+            }
+            for(size_t t=0;t<pool.size();t++){
+                pool[t].join();
+            }
+            pool.clear();
+            size_t sum=0;//exclusive prefix sums by (bucket, thread) keep the sort stable
+            for(size_t b=0;b<buckets;b++){
+                for(unsigned int t=0;t<threads;t++){
+                    size_t c=counts[t*buckets+b];
+                    counts[t*buckets+b]=sum;
+                    sum+=c;
+                }
+            }
+            for(unsigned int t=0;t<threads;t++){
+                pool.emplace_back([&,t]{
+                    size_t* c=&counts[t*buckets];
+                    for(size_t i=n*t/threads;i<n*(t+1)/threads;i++){
+                        other[c[(keys[i]>>shift)&(buckets-1)]++]=keys[i];
+                    }
+                });
+            }
+            for(size_t t=0;t<pool.size();t++){
+                pool[t].join();
+            }
+            keys.swap(other);
+        }
+    }
+    //the in-order successor of node k of the implicit tree, or 0 after the last node
+    size_t Next(size_t k) const{
+        size_t n=tree.size()-1;
+        if(2*k+1<=n){
+            k=2*k+1;
+            while(2*k<=n){
+                k=2*k;
+            }
+            return k;
+        }
+        while(k&1){
+            k>>=1;
+        }
+        return k>>1;
+    }
+public:
+    unsigned long baby,giant;
+    unsigned int index_bits;//low bits of a key that hold j
+    size_t limbs;
+    std::vector<uint64_t,huge_page_allocator<uint64_t>> tree;//tree[1..baby] in Eytzinger order; tree[0] is unused
+    std::vector<mp_limb_t,huge_page_allocator<mp_limb_t>> elements;//limbs limbs of g^j for the key at every position of tree
+    mpz_t g,p;
+    mpz_t giant_step;//g^(-baby) (mod p)
+    sorted_dlog_table(){
+        baby=0;giant=0;index_bits=0;limbs=0;
+        mpz_init(g);mpz_init(p);mpz_init(giant_step);
+    }
+    sorted_dlog_table(const sorted_dlog_table&)=delete;
+    sorted_dlog_table& operator=(const sorted_dlog_table&)=delete;
+    ~sorted_dlog_table(){
+        mpz_clear(g);mpz_clear(p);mpz_clear(giant_step);
+    }
+    void Build(const mpz_t generator, const mpz_t modulus, unsigned long baby_steps, unsigned long giant_steps, unsigned int threads=0){
+        baby=baby_steps;giant=giant_steps;
+        mpz_set(g,generator);
+        mpz_set(p,modulus);
+        limbs=mpz_size(p);
+        index_bits=1;
+        while(index_bits<63 && (((uint64_t)1)<<index_bits)<baby){
+            index_bits++;
+        }
+        if(threads==0){
+            threads=std::thread::hardware_concurrency();
+        }
+        if(threads==0){
+            threads=1;
+        }
+        std::vector<uint64_t> keys(baby);
+        std::vector<mp_limb_t> by_step(baby*limbs);//g^j at j*limbs, until the keys are sorted
+        std::vector<std::thread> pool;
+        for(unsigned int t=0;t<threads;t++){
+            pool.emplace_back([&,t]{
+                unsigned long begin=baby*t/threads,end=baby*(t+1)/threads;
+                mpz_t e;
+                mpz_init(e);
+                mpz_powm_ui(e,g,begin,p);//this thread's starting point g^(j0)
+                for(unsigned long j=begin;j<end;j++){
+                    keys[j]=Key(e,&by_step[j*limbs])|j;
+                    mpz_mul(e,e,g);
+                    mpz_mod(e,e,p);
+                }
+                mpz_clear(e);
+            });
+        }
+        for(size_t t=0;t<pool.size();t++){
+            pool[t].join();
+        }
+        Radix_Sort(keys,threads);
+        tree.assign(baby+1,0);
+        elements.assign((baby+1)*limbs,0);
+        uint64_t step_mask=(((uint64_t)1)<<index_bits)-1;
+        size_t next=0;
+        for(size_t k=Next(0);k!=0;k=Next(k)){//in-order walk of the implicit tree fills it with the sorted keys
+            tree[k]=keys[next++];
+            memcpy(&elements[k*limbs],&by_step[(tree[k]&step_mask)*limbs],limbs*sizeof(mp_limb_t));
+        }
+        mpz_powm_ui(giant_step,g,baby,p);
+        mpz_invert(giant_step,giant_step,p);
+    }
+    //the hash part of the key of e (0 <= e < p); buf has room for limbs limbs
+    uint64_t Key(const mpz_t e, mp_limb_t* buf) const{
+        size_t n=mpz_size(e);
+        memcpy(buf,mpz_limbs_read(e),n*sizeof(mp_limb_t));
+        memset(buf+n,0,(limbs-n)*sizeof(mp_limb_t));
+        return (uint64_t)dlog_table::Hash(buf,limbs)>>index_bits<<index_bits;
+    }
+    //the baby step j with g^j = e, or -1
+    long Find(const mpz_t e, mp_limb_t* buf) const{
+        uint64_t key=Key(e,buf);
+        size_t n=tree.size()-1;
+        size_t k=1;
+        while(k<=n){//branchless lower bound; the 16 descendants four levels down fill two cache lines
+            size_t ahead=(k<<4)+8<=n?(k<<4):0;
+            __builtin_prefetch(tree.data()+ahead);
+            __builtin_prefetch(tree.data()+ahead+8);
+            k=2*k+(tree[k]<key);
+        }
+        k>>=__builtin_ffsll(~(long long)k);
+        for(;k!=0 && (tree[k]>>index_bits<<index_bits)==key;k=Next(k)){
+            if(memcmp(&elements[k*limbs],buf,limbs*sizeof(mp_limb_t))==0){
+                return (long)(tree[k]&((((uint64_t)1)<<index_bits)-1));
+            }
+        }
+        return -1;
+    }
+    //k with g^k = h (mod p) for 0 <= k < baby*giant. Returns false if there is none.
+    bool Lookup(mpz_t k, const mpz_t h) const{
+        std::vector<mp_limb_t> buf(limbs);
+        mpz_t e;
+        mpz_init(e);
+        mpz_mod(e,h,p);
+        bool found=false;
+        for(unsigned long i=0;i<giant && !found;i++){
+            long j=Find(e,buf.data());
+            if(j>=0){
+                mpz_set_ui(k,i);
+                mpz_mul_ui(k,k,baby);
+                mpz_add_ui(k,k,(unsigned long)j);
+                found=true;
+            }
+            mpz_mul(e,e,giant_step);
+            mpz_mod(e,e,p);
+        }
+        mpz_clear(e);
+        return found;
+    }
+    size_t Bytes() const{
+        return tree.size()*sizeof(uint64_t)+elements.size()*sizeof(mp_limb_t);
+    }
+};
+
+/*adaptive_precomputation decides lazily which bases deserve a fixed_base_table.
+Every exponentiation routed through Power counts one use of its base, so only bases that recur
+(g and the public keys h_{i}) are routed here; the components of cipher texts are not. Once a base has been used
+hot_threshold times, a table for it is built by a background thread, and later exponentiations
+of that base are served from the table. Bases that are used only once or twice never pay for a
+table, and a base whose table alone would exceed memory_budget never gets one. The tables
+together stay below memory_budget bytes: when a new table pushes the total over the budget, the
+least recently used tables are dropped and their bases have to become hot again.
+
+The tables are published as an immutable snapshot behind a shared_ptr, replaced whole by the
+builder. A base that has a table is served from the snapshot without taking the lock; only its
+recency is recorded, in an atomic. Counting the uses of bases without a table takes the lock.
+*/
+class adaptive_precomputation{
+private:
+    struct base_usage{
+        unsigned long uses;//uses since the base was first seen (halved when the tracker ages)
+        unsigned long last_use;//logical time of the latest use, for least-recently-used eviction
+        bool pending;//a table for this base is queued or being built
+        bool tabled;//the base has a table in the published snapshot
+    };
+    struct hot_table{
+        std::shared_ptr<const fixed_base_table> table;
+        std::atomic<unsigned long> last_use;//logical time of the latest use, updated without the lock
+    };
+    typedef std::unordered_map<std::string,std::shared_ptr<hot_table>> table_map;
+    const ElGamal_Param& param;
+    std::unordered_map<std::string,base_usage> usage;//keyed by the limbs of the base (mod p)
+    std::shared_ptr<const table_map> tables;//published snapshot; read with std::atomic_load, replaced under lock
+    std::deque<std::string> build_queue;//hot bases waiting for their tables
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread builder;
+    bool stop;
+    std::atomic<unsigned long> clock;
+    size_t table_bytes;//memory held by all tables in the snapshot
+    static std::string Key(const mpz_t base){
+        return std::string((const char*)mpz_limbs_read(base),mpz_size(base)*sizeof(mp_limb_t));
+    }
+    /*forget bases that are rarely used, so that a stream of one-off bases cannot grow usage without
+    bound. One sweep halves every count; if that frees nothing, the least recently used bases
+    without a table are dropped. Bases with a table or a pending build are kept, so usage may stay
+    at max_tracked if all of them have one.
+    */
+    void Age(){
+        for(auto it=usage.begin();it!=usage.end();){
+            it->second.uses/=2;
+            if(it->second.uses==0 && !it->second.tabled && !it->second.pending){
+                it=usage.erase(it);
+            }else{
+                ++it;
+            }
+        }
+        while(usage.size()>=max_tracked){
+            auto coldest=usage.end();
+            for(auto it=usage.begin();it!=usage.end();++it){
+                if(!it->second.tabled && !it->second.pending && (coldest==usage.end() || it->second.last_use<coldest->second.last_use)){
+                    coldest=it;
+                }
+            }
+            if(coldest==usage.end()){
+                return;
+            }
+            usage.erase(coldest);
+        }
+    }
+    //drop the least recently used tables of next until the tables fit in memory_budget again
+    void Evict(table_map& next){
+        while(table_bytes>memory_budget){
+            auto coldest=next.end();
+            for(auto it=next.begin();it!=next.end();++it){
+                if(coldest==next.end() || it->second->last_use.load(std::memory_order_relaxed)<coldest->second->last_use.load(std::memory_order_relaxed)){
+                    coldest=it;
+                }
+            }
+            if(coldest==next.end()){
+                return;
+            }
+            table_bytes-=coldest->second->table->Bytes();
+            auto it=usage.find(coldest->first);
+            if(it!=usage.end()){
+                it->second.tabled=false;
+                it->second.uses=0;
+            }
+            next.erase(coldest);//threads still exponentiating with the table keep it alive
+        }
+    }
+    //count one use of the base and return its table if it has one
+    std::shared_ptr<const fixed_base_table> Touch(const std::string& key){
+        std::shared_ptr<const table_map> snapshot=std::atomic_load(&tables);
+        auto hit=snapshot->find(key);
+        if(hit!=snapshot->end()){
+            hit->second->last_use.store(clock.fetch_add(1,std::memory_order_relaxed)+1,std::memory_order_relaxed);
+            return hit->second->table;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        auto it=usage.find(key);
+        if(it==usage.end()){
+            if(usage.size()>=max_tracked){
+                Age();
+            }
+            it=usage.emplace(key,base_usage{0,0,false,false}).first;
+        }
+        base_usage& u=it->second;
+        u.uses++;
+        u.last_use=clock.fetch_add(1,std::memory_order_relaxed)+1;
+        if(!u.tabled && !u.pending && u.uses>=hot_threshold && fixed_base_table::Bytes(param.p,(unsigned int)mpz_sizeinbase(param.q,2),window)<=memory_budget){
+            u.pending=true;
+            build_queue.push_back(key);
+            if(!builder.joinable()){
+                builder=std::thread(&adaptive_precomputation::Build_Loop,this);
+            }
+            wake.notify_one();
+        }
+        return nullptr;//a table published since the snapshot is used from the next call on
+    }
+    void Build_Loop(){
+        std::unique_lock<std::mutex> guard(lock);
+        while(true){
+            wake.wait(guard,[this]{return stop || !build_queue.empty();});
+            if(stop){
+                return;
+            }
+            std::string key=build_queue.front();
+            build_queue.pop_front();
+            guard.unlock();
+            std::shared_ptr<fixed_base_table> table=std::make_shared<fixed_base_table>();
+            mpz_t base;
+            mpz_roinit_n(base,(const mp_limb_t*)key.data(),key.size()/sizeof(mp_limb_t));
+            table->Build(base,param.p,mpz_sizeinbase(param.q,2),window);
+            guard.lock();
+            auto it=usage.find(key);
+            if(it!=usage.end()){
+                it->second.pending=false;
+                it->second.tabled=true;
+                std::shared_ptr<table_map> next=std::make_shared<table_map>(*tables);
+                std::shared_ptr<hot_table> entry=std::make_shared<hot_table>();
+                entry->table=table;
+                entry->last_use.store(clock.fetch_add(1,std::memory_order_relaxed)+1,std::memory_order_relaxed);
+                (*next)[key]=entry;
+                table_bytes+=table->Bytes();
+                Evict(*next);
+                std::atomic_store(&tables,std::shared_ptr<const table_map>(next));
+            }
+        }
+    }
+public:
+    unsigned long hot_threshold=8;//number of uses after which a base gets a table
+    size_t memory_budget=((size_t)64)<<20;//upper bound on the total size of all tables, in bytes
+    size_t max_tracked=((size_t)1)<<16;//upper bound on the number of bases whose uses are counted
+    unsigned int window=4;//window width of the fixed-base tables
+    adaptive_precomputation(const ElGamal_Param& prm):param(prm),tables(std::make_shared<const table_map>()),clock(0){
+        stop=false;table_bytes=0;
+    }
+    ~adaptive_precomputation(){
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop=true;
+        }
+        wake.notify_all();
+        if(builder.joinable()){
+            builder.join();
+        }
+    }
+    /*compute rop = base^e (mod p). The exponent is reduced modulo q first, so e may be negative or
+    larger than q. A base that is 0 (mod p) has no inverse and is left to mpz_powm.
+    */
+    void Power(mpz_t rop, const mpz_t base, const mpz_t e){
+        mpz_t b,exp;
+        mpz_init(b);mpz_init(exp);
+        mpz_mod(b,base,param.p);
+        if(mpz_sgn(b)==0){
+            mpz_powm(rop,b,e,param.p);
+            mpz_clear(b);mpz_clear(exp);
+            return;
+        }
+        mpz_mod(exp,e,param.q);
+        std::shared_ptr<const fixed_base_table> table=Touch(Key(b));
+        if(table){
+            table->Power(rop,exp,param.p);
+        }else{
+            mpz_powm(rop,b,exp,param.p);
+        }
+        mpz_clear(b);mpz_clear(exp);
+    }
+    //memory currently held by fixed-base tables, in bytes
+    size_t Table_Bytes(){
+        std::lock_guard<std::mutex> guard(lock);
+        return table_bytes;
+    }
+};
+
+class ElGamal_Client{
+    friend class FE_inner_product_DDH;
+private:
+    mpz_t x;//private key
+    /*gcdExtended receives c0, p, and computes c0 * inv + p * co_inv = gcd where gcd is the greatest common divisor
+    when gcd = 1, inv is the inverse of c0 modular p.
+    */
+    void gcdExtended(mpz_t c0, mpz_t p, mpz_t *inv, mpz_t *co_inv, mpz_t *gcd){
+        if(mpz_cmp_ui(c0,0)==0){
+            mpz_set_ui(*inv,0);
+            mpz_set_ui(*co_inv,1);
+            mpz_set(*gcd,p);
+            return;
+        }
+        mpz_t t1,t2,r,tmp;
+        mpz_init(t1);mpz_init(t2);mpz_init(r);mpz_init(tmp);
+        mpz_mod(r,p,c0);
+        gcdExtended(r,c0,&t1,&t2,gcd);
+        mpz_fdiv_q(tmp,p,c0);
+        mpz_mul(tmp,tmp,t1);
+        mpz_sub(*inv,t2,tmp);
+        mpz_set(*co_inv,t1);
+        return;
+    }
+public:
+    mpz_t h;//public key
+    static ElGamal_Param param;//this static member provides seed and state for pseudo-random generator. It also provides common knowledge of p and g.
+    static adaptive_precomputation precomp;//counts the uses of the fixed bases (g, h_{i}) and serves hot ones from fixed-base tables
+    /*rop = base^e (mod p) for a base that comes with one cipher text and is never seen again. Such
+    a base can never become hot, so it is not counted in precomp and goes straight to mpz_powm.
+    */
+    static void Power_Once(mpz_t rop, const mpz_t base, const mpz_t e){
+        mpz_t exp;
+        mpz_init(exp);
+        mpz_mod(exp,e,param.q);
+        mpz_powm(rop,base,exp,param.p);
+        mpz_clear(exp);
+    }
+    ElGamal_Client(){
+        mpz_init(x);mpz_init(h);
+        mpz_urandomb(x,param.state,param.bit_length);
+        mpz_mod(x,x,param.p);//randomly choose a private key in Z_{p}
+        mpz_powm(h,param.g,x,param.p);//compute the corresponding public key
+    }
+    ~ElGamal_Client(){
+        mpz_clear(x);mpz_clear(h);
+    }
+    commitment Get_Commitment(){//commitment C(r). Please refer to the original paper, Section 4 - structure, and Section 4.1 construction - encryption
+        return Get_Commitment(param.state);
+    }
+    //commitment drawn from the caller's pseudo-random generator, for threads that must not share param.state
+    static commitment Get_Commitment(gmp_randstate_t state){
+        mpz_t y;
+        mpz_init(y);
+        mpz_urandomb(y,state,param.bit_length);
+        mpz_mod(y,y,param.p);//randomly choose y in Z_{p}
+        commitment ret;
+        mpz_set(ret.rand,y);//use y as the commitment
+        mpz_clear(y);
+        return ret;
+    }
+    /*ElGamal encryption of message msg with randomness (commitment) y and receiver rcvr's public key*/
+    cipher_text Encrypt(mpz_t& msg, commitment& y, ElGamal_Client& rcvr){
+        mpz_t c0,c1;
+        mpz_init(c0);mpz_init(c1);
+        precomp.Power(c0,param.g,y.rand);// c0 = g^Y (mod p)
+        precomp.Power(c1,rcvr.h,y.rand);
+        mpz_mul(c1,c1,msg);
+        mpz_mod(c1,c1,param.p);// c1 = h^Y * msg (mod p) (h = g^X)
+        cipher_text c;
+        mpz_set(c.c0,c0);
+        mpz_set(c.c1,c1);
+        return c;
+    }
+    /*ElGamal Decryption: decrypt cipher text: c with externally provided public key: key*/
+    plain_text Decrypt(cipher_text& c,const mpz_t key){
+        mpz_t c0,c1;
+        mpz_init(c0);mpz_init(c1);
+        mpz_set(c0,c.c0);
+        mpz_set(c1,c.c1);
+        Power_Once(c0,c0,key);//compute h^X = g^(XY)
+        mpz_t t1,t2,t3;
+        mpz_init(t1);mpz_init(t2);mpz_init(t3);
+        gcdExtended(c0,param.p,&t1,&t2,&t3);//compute the inverse of g^(XY): t1 = (g^(XY))^(-1)
+        mpz_mod(t1,t1,param.p);
+        plain_text pt;
+        mpz_mul(pt.msg,c1,t1);
+        /*recover the message:
+        c1 = msg * g^(XY). t1 = (g^(XY))^(-1). c1 * t1 = msg
+        */
+        mpz_mod(pt.msg,pt.msg,param.p);
         return pt;
     }
-    //if secret key is not specified, decryption with its own secret key sk_{y}
-    plain_text Decrypt(cipher_text_FE& ct){
-        plain_text pt=Decrypt(ct,sk);
+    /*ElGamal Decryption: decrypt cipher text: c with the client's own public key*/
+    plain_text Decrypt(cipher_text& c){
+        plain_text pt=Decrypt(c,x);
         return pt;
     }
-    //For each i, display (pk_{i}, sk_{i})
-    void Info(){
-        for(int i=0;i<vec_len;i++){
-            gmp_printf("client %d \'s public key: %Zd\n",i+1,key_gen[i].h);
-            gmp_printf("client %d \'s private key: %Zd\n",i+1,key_gen[i].x);
-            mpz_t t;mpz_init(t);
-            mpz_powm(t,key_gen[i].param.g,key_gen[i].x,key_gen[i].param.p);
-            //gmp_printf("testing public key: %Zd\n",t);
-            if(mpz_cmp(t,key_gen[i].h)!=0){
-                printf("Error: %d\n",i+1);
-            }
+};
+/*cipher text for Functional Encryption*/
+class cipher_text_FE{
+public:
+    mpz_t c0;//Ct_{0}
+    mpz_t* c1;//Ct_{1}
+    //an empty cipher text, to be assigned a real one later
+    cipher_text_FE(){
+        mpz_init(c0);
+        c1=NULL;
+    }
+    cipher_text_FE(unsigned int len){
+        mpz_init(c0);
+        c1=(mpz_t *) malloc(len * sizeof(mpz_t));
+        for(int i=0;i<len;i++){
+            mpz_init(c1[i]);
         }
     }
 };
+/*Secret key for Functional Encryption*/
+class secret_key_FE{
+public:
+    mpz_t sk_y;
+    secret_key_FE(){
+        mpz_init(sk_y);
+    }
+};
 
-//generate p, g for ElGamal before everything else
-ElGamal_Param ElGamal_Client::param;
+/*decrypt_plan is everything Decrypt needs for one functional key y: a copy of y reduced
+modulo q, the derived key sk_{y}, and the recoding of every y_{i} into window-bit digits.
+The digits are independent of the cipher text, so one plan serves any number of decryptions.
+*/
+class decrypt_plan{
+public:
+    unsigned int len;//number of components of y
+    unsigned int window;//width of the digits in bits
+    unsigned int rows;//number of digits per component
+    mpz_t* y;//the vector y, reduced modulo q
+    secret_key_FE sk;//sk_{y}, reduced modulo q
+    std::vector<unsigned int> active;//components with y_{i} != 0; the others do not take part in Decrypt
+    std::vector<unsigned short> digits;//rows digits per active component, least significant digit first
+    std::vector<int> slot;//slot[i] is the position of component i in active, or -1
+    unsigned long version;//number of in-place updates, so that copies of the plan elsewhere can tell they are stale
+    decrypt_plan(unsigned int l, unsigned int w){
+        len=l;window=w;rows=0;version=0;
+        y=(mpz_t *) malloc(len * sizeof(mpz_t));
+        for(unsigned int i=0;i<len;i++){
+            mpz_init(y[i]);
+        }
+    }
+    decrypt_plan(const decrypt_plan&)=delete;
+    decrypt_plan& operator=(const decrypt_plan&)=delete;
+    ~decrypt_plan(){
+        for(unsigned int i=0;i<len;i++){
+            mpz_clear(y[i]);
+        }
+        free(y);
+        mpz_clear(sk.sk_y);
+    }
+    //recode the components of y into digits, for exponents of at most exp_bits bits
+    void Recode(unsigned int exp_bits){
+        rows=(exp_bits+window-1)/window;
+        active.clear();
+        digits.clear();
+        slot.assign(len,-1);
+        for(unsigned int i=0;i<len;i++){
+            if(mpz_sgn(y[i])==0){
+                continue;
+            }
+            slot[i]=(int)active.size();
+            active.push_back(i);
+            for(unsigned int j=0;j<rows;j++){
+                digits.push_back((unsigned short)Exponent_Digit(y[i],(unsigned long)j*window,window));
+            }
+        }
+    }
+    /*set y_{i} = value (already reduced modulo q) and recode that component alone. The order of
+    active does not matter to Product, so a component that becomes active is appended and one that
+    becomes 0 is replaced by the last active component: O(rows) work either way.
+    */
+    void Set_Component(unsigned int i, const mpz_t value){
+        mpz_set(y[i],value);
+        int k=slot[i];
+        if(mpz_sgn(value)==0){
+            if(k<0){
+                return;
+            }
+            size_t last=active.size()-1;
+            active[k]=active[last];
+            slot[active[k]]=k;
+            std::copy(digits.begin()+last*rows,digits.begin()+(last+1)*rows,digits.begin()+(size_t)k*rows);
+            active.pop_back();
+            digits.resize(last*rows);
+            slot[i]=-1;
+            return;
+        }
+        if(k<0){
+            k=(int)active.size();
+            slot[i]=k;
+            active.push_back(i);
+            digits.resize(active.size()*rows);
+        }
+        for(unsigned int j=0;j<rows;j++){
+            digits[(size_t)k*rows+j]=(unsigned short)Exponent_Digit(y[i],(unsigned long)j*window,window);
+        }
+    }
+    /*compute rop = Product of (c1_{i})^(y_{i}) (mod p) as one multi-exponentiation: every active
+    c1_{i} gets a small table of its powers c1_{i}^d, and all components share the squarings of a
+    single walk over the digits.
+    */
+    void Product(mpz_t rop, mpz_t* c1, const mpz_t p) const{
+        size_t n=active.size();
+        size_t d_count=((size_t)1)<<window;
+        mpz_t* powers=(mpz_t *) malloc(n * d_count * sizeof(mpz_t));//powers[k*d_count+d] = c1_{active[k]}^d
+        for(size_t k=0;k<n;k++){
+            mpz_t* row=powers+k*d_count;
+            mpz_init_set_ui(row[0],1);
+            for(size_t d=1;d<d_count;d++){
+                mpz_init(row[d]);
+                mpz_mul(row[d],row[d-1],c1[active[k]]);
+                mpz_mod(row[d],row[d],p);
+            }
+        }
+        mpz_t acc;
+        mpz_init_set_ui(acc,1);
+        for(int j=(int)rows-1;j>=0;j--){
+            for(unsigned int s=0;s<window;s++){
+                mpz_mul(acc,acc,acc);
+                mpz_mod(acc,acc,p);
+            }
+            for(size_t k=0;k<n;k++){
+                unsigned short d=digits[k*rows+j];
+                if(d!=0){
+                    mpz_mul(acc,acc,powers[k*d_count+d]);
+                    mpz_mod(acc,acc,p);
+                }
+            }
+        }
+        for(size_t i=0;i<n*d_count;i++){
+            mpz_clear(powers[i]);
+        }
+        free(powers);
+        mpz_set(rop,acc);
+        mpz_clear(acc);
+    }
+    //approximate memory held by the plan, in bytes
+    size_t Bytes() const{
+        size_t bytes=sizeof(decrypt_plan)+len*sizeof(mpz_t)+mpz_size(sk.sk_y)*sizeof(mp_limb_t);
+        for(unsigned int i=0;i<len;i++){
+            bytes+=mpz_size(y[i])*sizeof(mp_limb_t);
+        }
+        return bytes+active.size()*sizeof(unsigned int)+digits.size()*sizeof(unsigned short);
+    }
+};
+
+/*Inner Product - DDH functional encryption is built on top of ElGamal (or other Public Key Encryption (PKE) schemes)
+the class member, PKE_functionality provides common configurations (p, g) and general PKE (ElGamal) functionalities (commitment, PKE encryption and PKE decryption)
+the class member, key_gen, creates a number of ElGamal clients, so that they can generate independent (secret key, public key) pairs
+*/
+
+class FE_inner_product_DDH{
+private:
+    unsigned int vec_len=6;//this is l in the original paper. It specifies the number of (sk,pk) pairs and the number of msg blocks
+    ElGamal_Client PKE_functionality;//provide ElGamal configuration and functionalities
+    secret_key_FE sk;//store the secret key sk_{y} derived from master secret key msk
+    void g_x(mpz_t* x, mpz_t* gx){//according to the paper, messages: msg are encoded as g^(msg). This function converts an array of msg to the form of g^(msg)
+        for(int i=0;i<vec_len;i++){
+            PKE_functionality.precomp.Power(gx[i],PKE_functionality.param.g,x[i]);
+        }
+    }
+    //compute sk_{y} = Sum (y_{i} * sk_{i}) without touching the member y or printing anything
+    void Derive_Key(mpz_t* vec, mpz_t sk_y){
+        mpz_set_ui(sk_y,0);
+        mpz_t tmp;
+        mpz_init(tmp);
+        for(int i=0;i<vec_len;i++){
+            mpz_mul(tmp,vec[i],key_gen[i].x);
+            mpz_add(sk_y,sk_y,tmp);
+        }
+        mpz_clear(tmp);
+    }
+    /*encrypt msg into ct with commitment r, without printing anything. The components of ct are
+    only ever assigned with mpz_set, so storage reserved for them beforehand is kept.
+    */
+    void Encrypt_Into(mpz_t* msg, commitment& r, cipher_text_FE& ct){
+        mpz_t gx;
+        mpz_init(gx);
+        PKE_functionality.precomp.Power(gx,PKE_functionality.param.g,r.rand);
+        mpz_set(ct.c0,gx);//Ct_{0} = g^r
+        for(int i=0;i<vec_len;i++){
+            PKE_functionality.precomp.Power(gx,PKE_functionality.param.g,msg[i]);
+            cipher_text c=PKE_functionality.Encrypt(gx,r,key_gen[i]);
+            mpz_set(ct.c1[i],c.c1);
+            mpz_clear(c.c0);mpz_clear(c.c1);
+        }
+        mpz_clear(gx);
+    }
+    //give every component of ct room for an element of Z_{p}, so that filling it never reallocates
+    void Reserve(cipher_text_FE& ct){
+        mp_bitcnt_t bits=mpz_sizeinbase(PKE_functionality.param.p,2);
+        mpz_realloc2(ct.c0,bits);
+        for(int i=0;i<vec_len;i++){
+            mpz_realloc2(ct.c1[i],bits);
+        }
+    }
+public:
+    ElGamal_Client* key_gen;//a number of ElGamal clients to be initialized
+    mpz_t *y;//the vector y used in KeyDer (Key Derivation)
+    //initialization with default vec_len=6
+    FE_inner_product_DDH(){
+        /*create ElGamal Clients. Each client generates its (sk,pk) pair.
+        The key generation process is implemented in the constructor of ElGamal_Client,
+        so that we don't have to do anything explicitly here for Setup. 
+        */
+        key_gen=new ElGamal_Client[vec_len];
+        //initialize the vector y so that it is ready to be used in KeyDer.
+        y=(mpz_t *) malloc(vec_len * sizeof(mpz_t));
+        for(int i=0;i<vec_len;i++){
+            mpz_init(y[i]);
+        }
+    }
+    //initialization with customer defined vec_len=len
+    FE_inner_product_DDH(unsigned int len){
+        vec_len=len;
+        key_gen=new ElGamal_Client[vec_len];
+        y=(mpz_t *) malloc(vec_len * sizeof(mpz_t));
+        for(int i=0;i<vec_len;i++){
+            mpz_init(y[i]);
+        }
+    }
+    FE_inner_product_DDH(const FE_inner_product_DDH&)=delete;//the master key is owned by exactly one instance
+    FE_inner_product_DDH& operator=(const FE_inner_product_DDH&)=delete;
+    ~FE_inner_product_DDH(){
+        delete[] key_gen;
+        for(int i=0;i<vec_len;i++){
+            mpz_clear(y[i]);
+        }
+        free(y);
+        mpz_clear(sk.sk_y);
+    }
+    /*This is the implementation of KeyDer in the paper
+    input: vector y output:sk_{y}
+    */
+    void Key_Derivation(mpz_t* vec){
+        for(int i=0;i<vec_len;i++){//copy vec to y
+            mpz_set(y[i],vec[i]);
+        }
+        Derive_Key(y,sk.sk_y);//sk_{y} = Sum (y_{i} * sk_{i}). sk_{i} is the i-th ElGamal client's secret key sk
+        //obtain secret key sk_{y} and finish KeyDer
+        gmp_printf("key derivation: %Zd\n", sk.sk_y);
+    }
+    //functional encryption's encryption functionality
+    cipher_text_FE Encrypt(mpz_t* msg){
+        //use PKE to get commitment C(r)
+        commitment y=PKE_functionality.Get_Commitment();
+        gmp_printf("Commitment Y:= %Zd\n",y.rand);
+        //create the cipher text Ct=(Ct_{0}, Ct_{1}) where Ct_{1} has vec_len components
+        cipher_text_FE ct(vec_len);
+        mpz_t c0;
+        mpz_init(c0);
+        PKE_functionality.precomp.Power(c0,PKE_functionality.param.g,y.rand);//Ct_{0} = g^Y
+        mpz_set(ct.c0,c0);
+        mpz_t* g_msg=(mpz_t*)malloc(vec_len*sizeof(mpz_t));
+        for(int i=0;i<vec_len;i++){
+            mpz_init(g_msg[i]);
+        }
+        g_x(msg,g_msg);//convert msg to the form of g^(msg)
+        for(int i=0;i<vec_len;i++){
+            gmp_printf("g^x%d: %Zd\n",i+1,g_msg[i]);
+            /*use commitment y, and each client key_gen[i]'s public key to encrypt g^{msg[i]}
+            and obtain the i-th component of Ct_{1}
+            */
+            cipher_text c=PKE_functionality.Encrypt(g_msg[i],y,key_gen[i]);
+            mpz_set(ct.c1[i],c.c1);
+        }
+        return ct;
+    }
+    /*functional encryption's encryption with precomputed tables: g_table for the generator g and
+    h_tables[i] for the public key of the i-th client. No printing, so it can run on hot paths.
+    */
+    cipher_text_FE Encrypt(mpz_t* msg, const fixed_base_table& g_table, const std::vector<fixed_base_table>& h_tables){
+        return Encrypt(msg,g_table,h_tables,PKE_functionality.param.state);
+    }
+    /*the same, with the commitment drawn from the caller's pseudo-random generator. Only the public
+    tables are used, so encryptors that hold no master key (e.g. remote workers) can call it too.
+    */
+    static cipher_text_FE Encrypt(mpz_t* msg, const fixed_base_table& g_table, const std::vector<fixed_base_table>& h_tables, gmp_randstate_t state){
+        mpz_t& p=ElGamal_Client::param.p;
+        mpz_t& q=ElGamal_Client::param.q;
+        commitment r=ElGamal_Client::Get_Commitment(state);
+        cipher_text_FE ct((unsigned int)h_tables.size());
+        mpz_mod(r.rand,r.rand,q);
+        g_table.Power(ct.c0,r.rand,p);//Ct_{0} = g^r
+        mpz_t gx,e;
+        mpz_init(gx);mpz_init(e);
+        for(size_t i=0;i<h_tables.size();i++){
+            mpz_mod(e,msg[i],q);
+            g_table.Power(gx,e,p);
+            h_tables[i].Power(ct.c1[i],r.rand,p);
+            mpz_mul(ct.c1[i],ct.c1[i],gx);
+            mpz_mod(ct.c1[i],ct.c1[i],p);//Ct_{i} = h_{i}^r * g^(x_{i})
+        }
+        mpz_clear(gx);mpz_clear(e);mpz_clear(r.rand);
+        return ct;
+    }
+    /*the same with joint tables: gh_tables[i] covers the pair (g, h_{i}), so every Ct_{i} is a single
+    walk over x_{i} and r
+    */
+    static cipher_text_FE Encrypt(mpz_t* msg, const fixed_base_table& g_table, const std::vector<joint_base_table>& gh_tables, gmp_randstate_t state){
+        mpz_t& p=ElGamal_Client::param.p;
+        mpz_t& q=ElGamal_Client::param.q;
+        commitment r=ElGamal_Client::Get_Commitment(state);
+        cipher_text_FE ct((unsigned int)gh_tables.size());
+        mpz_mod(r.rand,r.rand,q);
+        g_table.Power(ct.c0,r.rand,p);//Ct_{0} = g^r
+        mpz_t e;
+        mpz_init(e);
+        for(size_t i=0;i<gh_tables.size();i++){
+            mpz_mod(e,msg[i],q);
+            gh_tables[i].Power(ct.c1[i],e,r.rand,p);//Ct_{i} = g^(x_{i}) * h_{i}^r
+        }
+        mpz_clear(e);mpz_clear(r.rand);
+        return ct;
+    }
+    //functional encryption's decryption functionality
+    plain_text Decrypt(cipher_text_FE& ct,secret_key_FE& sk){
+        mpz_t c1;
+        mpz_init(c1);
+        mpz_set_ui(c1,1);
+        mpz_t tmp;
+        mpz_init(tmp);
+        for(int i=0;i<vec_len;i++){
+            //raise each Ct_{i} to the power of y_{i} and compute the product of (Ct_{i})^(y_{i})
+            ElGamal_Client::Power_Once(tmp,ct.c1[i],y[i]);
+            mpz_mul(c1,c1,tmp);
+            mpz_mod(c1,c1,PKE_functionality.param.p);
+        }
+        cipher_text ct_pke;
+        mpz_set(ct_pke.c0,ct.c0);
+        mpz_set(ct_pke.c1,c1);
+        gmp_printf("Decryption: c0: %Zd\n",ct_pke.c0);
+        gmp_printf("Decryption: c1: %Zd\n",ct_pke.c1);
+        gmp_printf("Decryption: sk_y: %Zd\n",sk.sk_y);
+        //Functional encryption's decryption is to use ElGamal to decrypt (Ct_{0}, Product of (Ct_{i})^(y_{i})) with the key sk_{y}
+        plain_text pt=PKE_functionality.Decrypt(ct_pke,sk.sk_y);
+        return pt;
+    }
+    /*Build a decrypt plan for the vector vec: derive sk_{y} and recode y into window-bit digits.
+    Unlike Key_Derivation, the member y and the instance's own sk_{y} are left unchanged.
+    */
+    std::shared_ptr<decrypt_plan> Plan(mpz_t* vec, unsigned int window=4){
+        std::shared_ptr<decrypt_plan> plan=std::make_shared<decrypt_plan>(vec_len,window);
+        for(int i=0;i<vec_len;i++){
+            mpz_mod(plan->y[i],vec[i],PKE_functionality.param.q);//c1_{i} lies in a group of order q
+        }
+        Derive_Key(plan->y,plan->sk.sk_y);
+        mpz_mod(plan->sk.sk_y,plan->sk.sk_y,PKE_functionality.param.q);
+        plan->Recode(mpz_sizeinbase(PKE_functionality.param.q,2));
+        return plan;
+    }
+    /*apply the sparse update y_{index[k]} += delta[k], k < count, to a plan built by Plan, in place.
+    sk_{y} moves by Sum delta[k] * sk_{index[k]} (mod q) and only the changed components are recoded,
+    so re-keying costs O(count) group operations. Returns false, leaving the plan untouched, if an
+    index is not below the length. The plan must not be read while it is patched: a plan that is
+    decrypted with concurrently is kept in a versioned_plan, which patches a copy nobody reads.
+    Plans handed out as shared_ptr<const decrypt_plan> (functional_key_cache, key_registry) are
+    never patched. Every update bumps plan.version.
+    */
+    bool Update_Plan(decrypt_plan& plan, const unsigned int* index, mpz_t* delta, size_t count){
+        for(size_t k=0;k<count;k++){
+            if(index[k]>=plan.len){
+                return false;
+            }
+        }
+        mpz_t& q=PKE_functionality.param.q;
+        mpz_t value;
+        mpz_init(value);
+        for(size_t k=0;k<count;k++){
+            unsigned int i=index[k];
+            mpz_addmul(plan.sk.sk_y,delta[k],key_gen[i].x);
+            mpz_add(value,plan.y[i],delta[k]);
+            mpz_mod(value,value,q);
+            plan.Set_Component(i,value);
+        }
+        mpz_mod(plan.sk.sk_y,plan.sk.sk_y,q);
+        mpz_clear(value);
+        plan.version++;
+        return true;
+    }
+    //functional encryption's decryption with a decrypt plan
+    plain_text Decrypt(cipher_text_FE& ct, const decrypt_plan& plan){
+        mpz_t product;
+        mpz_init(product);
+        plan.Product(product,ct.c1,PKE_functionality.param.p);
+        plain_text pt=Decrypt_Product(ct.c0,product,plan);
+        mpz_clear(product);
+        return pt;
+    }
+    //the last step of Decrypt: recover g^(<x,y>) from Ct_{0} and the product of (Ct_{i})^(y_{i})
+    plain_text Decrypt_Product(const mpz_t c0, const mpz_t product, const decrypt_plan& plan){
+        cipher_text ct_pke;
+        mpz_set(ct_pke.c0,c0);
+        mpz_set(ct_pke.c1,product);
+        plain_text pt=PKE_functionality.Decrypt(ct_pke,plan.sk.sk_y);
+        mpz_clear(ct_pke.c0);mpz_clear(ct_pke.c1);
+        return pt;
+    }
+    /*encrypt count messages; msgs[k] holds the vec_len components of the k-th message.
+    All temporaries of the batch come from the calling thread's gmp_arena and are released
+    together at the end. The cipher texts are sized before the arena opens, so they outlive it.
+    */
+    std::vector<cipher_text_FE> Encrypt_Batch(mpz_t** msgs, size_t count){
+        std::vector<cipher_text_FE> cts;
+        cts.reserve(count);
+        for(size_t k=0;k<count;k++){
+            cts.emplace_back(vec_len);
+            Reserve(cts.back());
+        }
+        gmp_arena::scope batch;
+        for(size_t k=0;k<count;k++){
+            commitment r=PKE_functionality.Get_Commitment();
+            Encrypt_Into(msgs[k],r,cts[k]);
+        }
+        return cts;
+    }
+    //decrypt every cipher text of cts with plan; the temporaries live in the calling thread's gmp_arena
+    std::vector<plain_text> Decrypt_Batch(std::vector<cipher_text_FE>& cts, const decrypt_plan& plan){
+        std::vector<plain_text> pts(cts.size());
+        for(size_t k=0;k<pts.size();k++){
+            mpz_realloc2(pts[k].msg,mpz_sizeinbase(PKE_functionality.param.p,2));
+        }
+        gmp_arena::scope batch;
+        for(size_t k=0;k<cts.size();k++){
+            plain_text pt=Decrypt(cts[k],plan);
+            mpz_set(pts[k].msg,pt.msg);
+        }
+        return pts;
+    }
+    //if secret key is not specified, decryption with its own secret key sk_{y}
+    plain_text Decrypt(cipher_text_FE& ct){
+        plain_text pt=Decrypt(ct,sk);
+        return pt;
+    }
+    unsigned int Length(){
+        return vec_len;
+    }
+    //For each i, display (pk_{i}, sk_{i})
+    void Info(){
+        for(int i=0;i<vec_len;i++){
+            gmp_printf("client %d \'s public key: %Zd\n",i+1,key_gen[i].h);
+            gmp_printf("client %d \'s private key: %Zd\n",i+1,key_gen[i].x);
+            mpz_t t;mpz_init(t);
+            mpz_powm(t,key_gen[i].param.g,key_gen[i].x,key_gen[i].param.p);
+            //gmp_printf("testing public key: %Zd\n",t);
+            if(mpz_cmp(t,key_gen[i].h)!=0){
+                printf("Error: %d\n",i+1);
+            }
+        }
+    }
+};
+
+/*functional_key_cache serves the decrypt plans of a long-tailed stream of functional keys.
+Plans are looked up by a hash of y (the stored y is compared on a hit, so colliding vectors
+are never confused) and the least recently used plans are evicted once the plans together
+exceed memory_budget bytes.
+*/
+class functional_key_cache{
+private:
+    struct entry{
+        unsigned long long hash;
+        std::shared_ptr<const decrypt_plan> plan;
+        size_t bytes;
+    };
+    FE_inner_product_DDH& fe;
+    std::list<entry> lru;//most recently used plan first
+    std::unordered_map<unsigned long long,std::list<entry>::iterator> index;
+    std::mutex lock;
+    size_t bytes;
+    /*FNV-1a over the limbs of y reduced modulo q, so that vectors which Matches treats as equal
+    (e.g. y and y + q) share one entry
+    */
+    static unsigned long long Hash(mpz_t* vec, unsigned int len){
+        unsigned long long h=14695981039346656037ULL;
+        mpz_t r;
+        mpz_init(r);
+        for(unsigned int i=0;i<len;i++){
+            mpz_mod(r,vec[i],ElGamal_Client::param.q);
+            const mp_limb_t* limbs=mpz_limbs_read(r);
+            for(size_t k=0;k<mpz_size(r);k++){
+                h=(h^(unsigned long long)limbs[k])*1099511628211ULL;
+            }
+            h=(h^0xffULL)*1099511628211ULL;//separate the components
+        }
+        mpz_clear(r);
+        return h;
+    }
+    //a cached plan matches vec if vec reduces to the plan's y modulo q
+    bool Matches(const decrypt_plan& plan, mpz_t* vec){
+        mpz_t r;
+        mpz_init(r);
+        bool same=true;
+        for(unsigned int i=0;i<plan.len && same;i++){
+            mpz_mod(r,vec[i],ElGamal_Client::param.q);
+            same=(mpz_cmp(r,plan.y[i])==0);
+        }
+        mpz_clear(r);
+        return same;
+    }
+    void Evict(){
+        while(bytes>memory_budget && !lru.empty()){
+            bytes-=lru.back().bytes;
+            index.erase(lru.back().hash);
+            lru.pop_back();
+            evictions++;
+        }
+    }
+public:
+    size_t memory_budget;//upper bound on the memory held by cached plans, in bytes
+    unsigned long hits,misses,evictions;
+    functional_key_cache(FE_inner_product_DDH& scheme, size_t budget=((size_t)16)<<20):fe(scheme){
+        memory_budget=budget;bytes=0;
+        hits=0;misses=0;evictions=0;
+    }
+    //return the decrypt plan of vec, deriving and caching it on a miss
+    std::shared_ptr<const decrypt_plan> Get(mpz_t* vec){
+        unsigned long long h=Hash(vec,fe.Length());
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it=index.find(h);
+            if(it!=index.end() && Matches(*it->second->plan,vec)){
+                lru.splice(lru.begin(),lru,it->second);//move to the front
+                hits++;
+                return it->second->plan;
+            }
+            misses++;
+        }
+        //derive outside the lock so that hits of other threads are not held up
+        std::shared_ptr<const decrypt_plan> plan=fe.Plan(vec);
+        std::lock_guard<std::mutex> guard(lock);
+        auto it=index.find(h);
+        if(it!=index.end()){//replace a colliding plan, or one derived concurrently
+            bytes-=it->second->bytes;
+            lru.erase(it->second);
+            index.erase(it);
+        }
+        lru.push_front(entry{h,plan,plan->Bytes()});
+        index[h]=lru.begin();
+        bytes+=plan->Bytes();
+        Evict();
+        return plan;
+    }
+    //drop all cached plans, e.g. after the master key has changed
+    void Clear(){
+        std::lock_guard<std::mutex> guard(lock);
+        lru.clear();
+        index.clear();
+        bytes=0;
+    }
+    size_t Bytes(){
+        std::lock_guard<std::mutex> guard(lock);
+        return bytes;
+    }
+    //display the hit/miss metrics of the cache
+    void Info(){
+        std::lock_guard<std::mutex> guard(lock);
+        printf("key cache: %lu hits, %lu misses, %lu evictions, %zu plans, %zu bytes\n",hits,misses,evictions,lru.size(),bytes);
+    }
+};
+
+/*epoch_reclaimer implements epoch-based reclamation for read-mostly data. A reader announces
+the current global epoch in one of the reader slots before it dereferences shared data, and
+clears the slot when it is done. A writer that unpublishes an object retires it with the epoch
+at which it was unpublished; the object is destroyed only once every announced epoch is newer,
+i.e. once no reader can still hold a pointer to it. Readers never block and never take a lock.
+*/
+class epoch_reclaimer{
+private:
+    static const unsigned int max_readers=256;//number of concurrently active readers supported
+    struct alignas(64) reader_slot{//one cache line per slot, so readers do not contend
+        std::atomic<bool> used{false};
+        std::atomic<unsigned long> epoch{0};//0 while the slot's reader holds nothing
+    };
+    reader_slot slots[max_readers];
+    std::atomic<unsigned long> global_epoch{1};
+    std::mutex retire_lock;
+    std::vector<std::pair<unsigned long,std::function<void()>>> retired;//(retire epoch, destructor)
+public:
+    //claim a reader slot and announce the current epoch. Returns the slot index for Exit.
+    unsigned int Enter(){
+        unsigned int s=(unsigned int)(std::hash<std::thread::id>()(std::this_thread::get_id())%max_readers);
+        while(true){
+            bool expected=false;
+            if(!slots[s].used.load(std::memory_order_relaxed) && slots[s].used.compare_exchange_weak(expected,true)){
+                break;
+            }
+            s=(s+1)%max_readers;
+        }
+        slots[s].epoch.store(global_epoch.load());
+        return s;
+    }
+    void Exit(unsigned int s){
+        slots[s].epoch.store(0);
+        slots[s].used.store(false,std::memory_order_release);
+    }
+    //hand over an object that has just been unpublished; destroy runs once no reader can see it
+    void Retire(std::function<void()> destroy){
+        std::lock_guard<std::mutex> guard(retire_lock);
+        retired.emplace_back(global_epoch.fetch_add(1),std::move(destroy));
+        Collect();
+    }
+    //wait until every reader that entered before the call has exited; readers that enter later are not waited for
+    void Synchronize(){
+        unsigned long e=global_epoch.fetch_add(1);
+        for(unsigned int s=0;s<max_readers;s++){
+            unsigned long seen;
+            while((seen=slots[s].epoch.load())!=0 && seen<=e){
+                std::this_thread::yield();
+            }
+        }
+    }
+    //destroy every retired object that is older than the oldest announced epoch
+    void Collect(){
+        unsigned long oldest=ULONG_MAX;
+        for(unsigned int s=0;s<max_readers;s++){
+            unsigned long e=slots[s].epoch.load();
+            if(e!=0 && e<oldest){
+                oldest=e;
+            }
+        }
+        size_t kept=0;
+        for(size_t i=0;i<retired.size();i++){
+            if(retired[i].first<oldest){
+                retired[i].second();
+            }else{
+                retired[kept++]=std::move(retired[i]);
+            }
+        }
+        retired.resize(kept);
+    }
+    ~epoch_reclaimer(){
+        for(size_t i=0;i<retired.size();i++){
+            retired[i].second();
+        }
+    }
+};
+
+/*key_registry holds the FE_inner_product_DDH instances and the functional keys of a decrypt
+service. Every state of the registry is an immutable version. Readers take a snapshot, which
+costs two atomic stores and a load, and decrypt against it while writers build the next version
+on the side and publish it with one atomic exchange. Rotating a master key therefore never stalls
+an in-flight decrypt; the replaced version is reclaimed through epoch_reclaimer once the last
+reader that could see it has finished.
+*/
+class key_registry{
+public:
+    struct functional_key{
+        std::string instance;//name of the instance whose master key derived this key
+        std::shared_ptr<const decrypt_plan> plan;
+    };
+    struct version{
+        unsigned long number;
+        std::map<std::string,std::shared_ptr<FE_inner_product_DDH>> instances;
+        std::map<std::string,functional_key> keys;
+    };
+    //a reader's view of one version. The version stays alive as long as the snapshot exists.
+    class snapshot{
+        friend class key_registry;
+    private:
+        epoch_reclaimer* reclaimer;
+        unsigned int slot;
+        const version* current;
+        snapshot(epoch_reclaimer& r, const std::atomic<const version*>& published):reclaimer(&r){
+            slot=reclaimer->Enter();
+            current=published.load();
+        }
+    public:
+        snapshot(const snapshot&)=delete;
+        snapshot& operator=(const snapshot&)=delete;
+        ~snapshot(){
+            reclaimer->Exit(slot);
+        }
+        const version* operator->() const{
+            return current;
+        }
+        FE_inner_product_DDH* Find_Instance(const std::string& name) const{
+            auto it=current->instances.find(name);
+            return it==current->instances.end()?nullptr:it->second.get();
+        }
+        const functional_key* Find_Key(const std::string& name) const{
+            auto it=current->keys.find(name);
+            return it==current->keys.end()?nullptr:&it->second;
+        }
+    };
+private:
+    epoch_reclaimer reclaimer;
+    std::atomic<const version*> published;
+    std::mutex write_lock;//writers are serialized; readers never take it
+    //publish next in place of the current version, and retire the current one
+    void Publish(version* next){
+        const version* old=published.load();
+        next->number=old->number+1;
+        published.store(next);
+        reclaimer.Retire([old]{delete old;});
+    }
+public:
+    key_registry(){
+        version* empty=new version();
+        empty->number=0;
+        published.store(empty);
+    }
+    ~key_registry(){
+        delete published.load();
+    }
+    snapshot Read(){
+        return snapshot(reclaimer,published);
+    }
+    /*add an instance, or rotate the master key of an existing one by replacing it. Functional keys
+    derived from the replaced instance are dropped in the same version, since they no longer match.
+    */
+    void Publish_Instance(const std::string& name, std::shared_ptr<FE_inner_product_DDH> instance){
+        std::lock_guard<std::mutex> guard(write_lock);
+        version* next=new version(*published.load());
+        next->instances[name]=instance;
+        for(auto it=next->keys.begin();it!=next->keys.end();){
+            if(it->second.instance==name){
+                it=next->keys.erase(it);
+            }else{
+                ++it;
+            }
+        }
+        Publish(next);
+    }
+    //derive the functional key for vec from the named instance and publish it as key. Returns false if there is no such instance.
+    bool Publish_Key(const std::string& key, const std::string& instance, mpz_t* vec){
+        std::lock_guard<std::mutex> guard(write_lock);
+        auto it=published.load()->instances.find(instance);
+        if(it==published.load()->instances.end()){
+            return false;
+        }
+        version* next=new version(*published.load());
+        next->keys[key]=functional_key{instance,it->second->Plan(vec)};
+        Publish(next);
+        return true;
+    }
+    void Remove_Key(const std::string& key){
+        std::lock_guard<std::mutex> guard(write_lock);
+        version* next=new version(*published.load());
+        next->keys.erase(key);
+        Publish(next);
+    }
+    //decrypt ct with the named functional key. Returns false if the key is not registered.
+    bool Decrypt(const std::string& key, cipher_text_FE& ct, plain_text& pt){
+        snapshot s=Read();
+        const functional_key* k=s.Find_Key(key);
+        if(k==nullptr){
+            return false;
+        }
+        pt=s.Find_Instance(k->instance)->Decrypt(ct,*k->plan);
+        return true;
+    }
+};
+
+/*versioned_plan is a functional key that is updated while other threads decrypt with it. It keeps
+two copies of the plan (left-right): readers use the front copy, and Update patches the back copy
+in place with Update_Plan, swaps the two with one atomic store, waits through epoch_reclaimer until
+no reader can still be on the old front, and patches that one as well. An update therefore costs
+two O(changed) patches and no copy of the plan, and readers never block and never see a plan
+halfway through an update. Updates are serialized.
+*/
+class versioned_plan{
+private:
+    FE_inner_product_DDH& fe;
+    std::shared_ptr<decrypt_plan> plans[2];
+    std::atomic<unsigned int> front;
+    epoch_reclaimer readers;
+    std::mutex write_lock;
+public:
+    //a reader's view of the current plan, valid as long as the reader exists
+    class reader{
+        friend class versioned_plan;
+    private:
+        epoch_reclaimer* reclaimer;
+        unsigned int slot;
+        const decrypt_plan* current;
+        reader(versioned_plan& v):reclaimer(&v.readers){
+            slot=reclaimer->Enter();
+            current=v.plans[v.front.load()].get();
+        }
+    public:
+        reader(const reader&)=delete;
+        reader& operator=(const reader&)=delete;
+        ~reader(){
+            reclaimer->Exit(slot);
+        }
+        const decrypt_plan& operator*() const{
+            return *current;
+        }
+        const decrypt_plan* operator->() const{
+            return current;
+        }
+    };
+    versioned_plan(FE_inner_product_DDH& scheme, mpz_t* vec, unsigned int window=4):fe(scheme){
+        plans[0]=fe.Plan(vec,window);
+        plans[1]=fe.Plan(vec,window);
+        front.store(0);
+    }
+    reader Read(){
+        return reader(*this);
+    }
+    //apply y_{index[k]} += delta[k], k < count. Returns false, changing nothing, if an index is not below the length.
+    bool Update(const unsigned int* index, mpz_t* delta, size_t count){
+        std::lock_guard<std::mutex> guard(write_lock);
+        unsigned int old=front.load();
+        if(!fe.Update_Plan(*plans[1-old],index,delta,count)){
+            return false;
+        }
+        front.store(1-old);
+        readers.Synchronize();
+        fe.Update_Plan(*plans[old],index,delta,count);
+        return true;
+    }
+    //number of updates applied so far
+    unsigned long Version(){
+        return plans[front.load()]->version;
+    }
+};
+
+/*group_precomputation holds everything derived from the group parameters (p, g) alone: the
+fixed-base table of the generator g and the discrete-log table that turns g^(<x,y>) into <x,y>.
+It is built once and shared read-only by every tenant of a tenant_registry.
+*/
+class group_precomputation{
+public:
+    fixed_base_table g_table;
+    dlog_table dlog;
+    group_precomputation(const ElGamal_Param& param, unsigned long dlog_bound, unsigned int window){
+        g_table.Build(param.g,param.p,mpz_sizeinbase(param.q,2),window);
+        unsigned long baby=1;
+        while(baby*baby<dlog_bound){
+            baby++;
+        }
+        dlog.Build(param.g,param.p,baby,(dlog_bound+baby-1)/baby);
+    }
+    size_t Bytes() const{
+        return g_table.Bytes()+dlog.Bytes();
+    }
+};
+
+/*record_packer puts the coordinates of k records into the components of one message,
+x_{i} = x_{i}^(1) + B * x_{i}^(2) + ... + B^(k-1) * x_{i}^(k), so that one Encrypt, one Decrypt and one
+(larger) discrete log serve k records: <x,y> = Sum B^(j-1) * <x^(j),y>, and since every record's
+inner product is below B, its base-B digits are the k inner products. Coordinates and weights
+must be non-negative and within the bounds given to the constructor. B is one more than the
+largest possible inner product, and k is the largest count with B^k within both the dlog range
+and the group order; k = 0 means that not even one record fits.
+*/
+class record_packer{
+public:
+    unsigned int vec_len;
+    unsigned int k;//records per cipher text
+    mpz_t base;//B
+    //x_bound, y_bound: largest coordinate and weight; dlog_bound: inner products in [0, dlog_bound) can be decoded
+    record_packer(unsigned int len, unsigned long x_bound, unsigned long y_bound, unsigned long dlog_bound){
+        vec_len=len;
+        mpz_init_set_ui(base,x_bound);
+        mpz_mul_ui(base,base,y_bound);
+        mpz_mul_ui(base,base,len);
+        mpz_add_ui(base,base,1);
+        mpz_t limit,span;
+        mpz_init_set_ui(limit,dlog_bound);
+        if(mpz_cmp(limit,ElGamal_Client::param.q)>0){
+            mpz_set(limit,ElGamal_Client::param.q);//exponents wrap around modulo q
+        }
+        mpz_init_set(span,base);
+        for(k=0;mpz_cmp(span,limit)<=0;k++){
+            mpz_mul(span,span,base);//span = B^(k+1)
+        }
+        mpz_clear(limit);mpz_clear(span);
+    }
+    record_packer(const record_packer&)=delete;
+    record_packer& operator=(const record_packer&)=delete;
+    ~record_packer(){
+        mpz_clear(base);
+    }
+    //number of cipher texts that hold count records
+    size_t Ciphertexts(size_t count) const{
+        return k==0?0:(count+k-1)/k;
+    }
+    //packed = the components of records[0], ..., records[count-1], count <= k
+    void Pack(mpz_t* packed, mpz_t** records, size_t count) const{
+        for(unsigned int i=0;i<vec_len;i++){
+            mpz_set_ui(packed[i],0);
+            for(size_t j=count;j-->0;){//Horner's rule from the last record down
+                mpz_mul(packed[i],packed[i],base);
+                mpz_add(packed[i],packed[i],records[j][i]);
+            }
+        }
+    }
+    //split a decrypted inner product into the count inner products of the packed records
+    void Unpack(mpz_t* values, const mpz_t ip, size_t count) const{
+        mpz_t rest;
+        mpz_init_set(rest,ip);
+        for(size_t j=0;j<count;j++){
+            mpz_fdiv_qr(rest,values[j],rest,base);
+        }
+        mpz_clear(rest);
+    }
+};
+
+/*window_aggregator keeps the componentwise product of the last W cipher texts of a stream. The
+product of cipher texts is a cipher text of the sum of their messages, so a windowed weighted sum
+costs one Decrypt of Aggregate instead of W. Arrivals are multiplied into a numerator and
+expired cipher texts into a denominator; nothing is inverted until Aggregate is asked for, and
+then the l+1 components of the denominator share a single modular inversion (Montgomery's
+trick). Any number of expirations between two results therefore cost one inversion.
+*/
+class window_aggregator{
+private:
+    unsigned int vec_len;
+    size_t window;
+    mpz_t p;
+    mpz_t* ring;//window slots of vec_len+1 components: Ct_{0}, Ct_{1}, ..., Ct_{l}
+    size_t head,count;//oldest slot and number of cipher texts in the window
+    mpz_t* numerator;//product of arrivals since the last rebase
+    mpz_t* denominator;//product of expirations since the last rebase
+    mpz_t* prefix;//scratch for the batched inversion
+    void Multiply(mpz_t* acc, mpz_t* c){
+        for(unsigned int i=0;i<=vec_len;i++){
+            mpz_mul(acc[i],acc[i],c[i]);
+            mpz_mod(acc[i],acc[i],p);
+        }
+    }
+public:
+    window_aggregator(unsigned int len, size_t w, const mpz_t modulus){
+        if(w==0){
+            throw std::invalid_argument("window_aggregator: the window must hold at least one cipher text");
+        }
+        vec_len=len;window=w;head=0;count=0;
+        mpz_init_set(p,modulus);
+        ring=(mpz_t *) malloc(window*(vec_len+1) * sizeof(mpz_t));
+        for(size_t k=0;k<window*(vec_len+1);k++){
+            mpz_init(ring[k]);
+        }
+        numerator=(mpz_t *) malloc((vec_len+1) * sizeof(mpz_t));
+        denominator=(mpz_t *) malloc((vec_len+1) * sizeof(mpz_t));
+        prefix=(mpz_t *) malloc((vec_len+1) * sizeof(mpz_t));
+        for(unsigned int i=0;i<=vec_len;i++){
+            mpz_init_set_ui(numerator[i],1);
+            mpz_init_set_ui(denominator[i],1);
+            mpz_init(prefix[i]);
+        }
+    }
+    window_aggregator(const window_aggregator&)=delete;
+    window_aggregator& operator=(const window_aggregator&)=delete;
+    ~window_aggregator(){
+        for(size_t k=0;k<window*(vec_len+1);k++){
+            mpz_clear(ring[k]);
+        }
+        for(unsigned int i=0;i<=vec_len;i++){
+            mpz_clear(numerator[i]);mpz_clear(denominator[i]);mpz_clear(prefix[i]);
+        }
+        free(ring);free(numerator);free(denominator);free(prefix);
+        mpz_clear(p);
+    }
+    size_t Size() const{
+        return count;
+    }
+    //add ct to the window; once the window is full, the oldest cipher text expires
+    void Push(const cipher_text_FE& ct){
+        if(count==window){
+            Multiply(denominator,ring+head*(vec_len+1));
+            head=(head+1)%window;
+            count--;
+        }
+        mpz_t* slot=ring+((head+count)%window)*(vec_len+1);
+        mpz_set(slot[0],ct.c0);
+        for(unsigned int i=0;i<vec_len;i++){
+            mpz_set(slot[i+1],ct.c1[i]);
+        }
+        Multiply(numerator,slot);
+        count++;
+    }
+    /*out = the product of the cipher texts in the window; out must have vec_len components. The
+    pending expirations are divided out here, and the numerator is rebased on the result.
+    */
+    void Aggregate(cipher_text_FE& out){
+        mpz_set_ui(prefix[0],1);
+        for(unsigned int i=0;i<vec_len;i++){
+            mpz_mul(prefix[i+1],prefix[i],denominator[i]);
+            mpz_mod(prefix[i+1],prefix[i+1],p);
+        }
+        mpz_t inv,t;
+        mpz_init(inv);mpz_init(t);
+        mpz_mul(inv,prefix[vec_len],denominator[vec_len]);
+        mpz_mod(inv,inv,p);
+        mpz_invert(inv,inv,p);//1 / (denominator_{0} * ... * denominator_{l})
+        for(unsigned int i=vec_len+1;i-->0;){
+            mpz_mul(t,inv,prefix[i]);//1 / denominator_{i}
+            mpz_mod(t,t,p);
+            mpz_mul(inv,inv,denominator[i]);
+            mpz_mod(inv,inv,p);
+            mpz_mul(numerator[i],numerator[i],t);
+            mpz_mod(numerator[i],numerator[i],p);
+            mpz_set_ui(denominator[i],1);
+        }
+        mpz_clear(inv);mpz_clear(t);
+        mpz_set(out.c0,numerator[0]);
+        for(unsigned int i=0;i<vec_len;i++){
+            mpz_set(out.c1[i],numerator[i+1]);
+        }
+    }
+};
+
+/*evaluation_kernel decrypts K cipher-text-by-key pairs at a time: out[k*N+n] is the dlog of the
+decryption of the n-th of N cipher texts with the k-th of K plans, or -1 if it is out of range.
+Every cipher text gets a table of the powers c^d, d < 2^window, of each of its l+1 components,
+built once and shared by all K keys; Ct_{0} is raised to q - sk_{y} in the same digit walk as
+the Ct_{i}, so a pair costs one multi-exponentiation and no inversion. The cipher texts are
+taken in blocks whose tables fit in cache_bytes, and each block is swept by all keys, key_block
+keys at a time, before the next block is touched. The plans must all come from one scheme, so
+that they share the window and the number of digits.
+*/
+class evaluation_kernel{
+private:
+    mpz_t p,q;
+    //evaluate the cipher texts [begin, end) of cts against all keys
+    size_t Evaluate_Range(const std::vector<std::shared_ptr<const decrypt_plan>>& keys, const std::vector<unsigned short>& sk_digits, std::vector<cipher_text_FE>& cts, size_t begin, size_t end, const dlog_table& dlog, int64_t* out) const{
+        const decrypt_plan& first=*keys[0];
+        unsigned int len=first.len,window=first.window,rows=first.rows;
+        size_t n_keys=keys.size(),n_cts=cts.size(),missed=0;
+        size_t limbs=mpz_size(p),d_count=((size_t)1)<<window;
+        size_t stride=(len+1)*d_count*limbs;//table of one cipher text: Ct_{1}, ..., Ct_{l}, then Ct_{0}
+        size_t block=cache_bytes/(stride*sizeof(mp_limb_t));
+        block=block==0?1:block;
+        std::vector<mp_limb_t> tables(block*stride);
+        mpz_t* h=(mpz_t *) malloc(key_block*block * sizeof(mpz_t));
+        mpz_t* result=(mpz_t *) malloc(key_block*block * sizeof(mpz_t));
+        bool* found=(bool *) malloc(key_block*block * sizeof(bool));
+        for(size_t t=0;t<key_block*block;t++){
+            mpz_init(h[t]);mpz_init(result[t]);
+        }
+        mpz_t e,acc,entry;
+        mpz_init(e);mpz_init(acc);
+        for(size_t n0=begin;n0<end;n0+=block){
+            size_t nb=end-n0<block?end-n0:block;
+            for(size_t c=0;c<nb;c++){
+                cipher_text_FE& ct=cts[n0+c];
+                for(unsigned int i=0;i<=len;i++){
+                    mp_limb_t* row=&tables[c*stride+i*d_count*limbs];
+                    mpz_set_ui(e,1);
+                    for(size_t d=0;d<d_count;d++){
+                        std::fill(row+d*limbs,row+(d+1)*limbs,0);
+                        mpz_export(row+d*limbs,NULL,-1,sizeof(mp_limb_t),0,GMP_NAIL_BITS,e);
+                        mpz_mul(e,e,i<len?ct.c1[i]:ct.c0);
+                        mpz_mod(e,e,p);
+                    }
+                }
+            }
+            for(size_t k0=0;k0<n_keys;k0+=key_block){
+                size_t kb=n_keys-k0<key_block?n_keys-k0:key_block;
+                for(size_t k=0;k<kb;k++){
+                    const decrypt_plan& plan=*keys[k0+k];
+                    const unsigned short* sk=&sk_digits[(k0+k)*rows];
+                    size_t n=plan.active.size();
+                    for(size_t c=0;c<nb;c++){
+                        const mp_limb_t* table=&tables[c*stride];
+                        mpz_set_ui(acc,1);
+                        for(int j=(int)rows-1;j>=0;j--){
+                            for(unsigned int s=0;s<window;s++){
+                                mpz_mul(acc,acc,acc);
+                                mpz_mod(acc,acc,p);
+                            }
+                            for(size_t a=0;a<n;a++){
+                                unsigned short d=plan.digits[a*rows+j];
+                                if(d!=0){
+                                    mpz_mul(acc,acc,mpz_roinit_n(entry,table+(plan.active[a]*d_count+d)*limbs,limbs));
+                                    mpz_mod(acc,acc,p);
+                                }
+                            }
+                            if(sk[j]!=0){
+                                mpz_mul(acc,acc,mpz_roinit_n(entry,table+(len*d_count+sk[j])*limbs,limbs));
+                                mpz_mod(acc,acc,p);
+                            }
+                        }
+                        mpz_swap(h[k*nb+c],acc);
+                    }
+                }
+                dlog.Lookup_Batch(result,h,kb*nb,found);
+                for(size_t k=0;k<kb;k++){
+                    for(size_t c=0;c<nb;c++){
+                        int64_t& value=out[(k0+k)*n_cts+n0+c];
+                        if(found[k*nb+c]){
+                            value=(int64_t)mpz_get_si(result[k*nb+c]);
+                        }else{
+                            value=-1;
+                            missed++;
+                        }
+                    }
+                }
+            }
+        }
+        for(size_t t=0;t<key_block*block;t++){
+            mpz_clear(h[t]);mpz_clear(result[t]);
+        }
+        free(h);free(result);free(found);
+        mpz_clear(e);mpz_clear(acc);
+        return missed;
+    }
+public:
+    size_t cache_bytes;//budget for the tables of one block of cipher texts
+    size_t key_block;//keys that sweep a block of cipher texts together
+    evaluation_kernel(const mpz_t modulus, const mpz_t order, size_t cache=((size_t)1)<<20, size_t keys=64){
+        mpz_init_set(p,modulus);mpz_init_set(q,order);
+        cache_bytes=cache;key_block=keys;
+    }
+    evaluation_kernel(const evaluation_kernel&)=delete;
+    evaluation_kernel& operator=(const evaluation_kernel&)=delete;
+    ~evaluation_kernel(){
+        mpz_clear(p);mpz_clear(q);
+    }
+    /*fill the K x N matrix out, row k holding the results of keys[k], and return the number of
+    results out of the range of dlog. The cipher texts are split over threads threads.
+    */
+    size_t Evaluate(const std::vector<std::shared_ptr<const decrypt_plan>>& keys, std::vector<cipher_text_FE>& cts, const dlog_table& dlog, int64_t* out, unsigned int threads=1) const{
+        if(keys.empty() || cts.empty()){
+            return 0;
+        }
+        unsigned int rows=keys[0]->rows,window=keys[0]->window;
+        std::vector<unsigned short> sk_digits(keys.size()*rows);//digits of q - sk_{y}, the exponent of Ct_{0}
+        mpz_t e;
+        mpz_init(e);
+        for(size_t k=0;k<keys.size();k++){
+            mpz_sub(e,q,keys[k]->sk.sk_y);
+            mpz_mod(e,e,q);
+            for(unsigned int j=0;j<rows;j++){
+                sk_digits[k*rows+j]=(unsigned short)Exponent_Digit(e,(unsigned long)j*window,window);
+            }
+        }
+        mpz_clear(e);
+        threads=threads==0?1:threads;
+        size_t share=(cts.size()+threads-1)/threads;
+        std::vector<size_t> missed(threads,0);
+        std::vector<std::thread> pool;
+        for(unsigned int t=1;t<threads && t*share<cts.size();t++){
+            size_t end=(t+1)*share<cts.size()?(t+1)*share:cts.size();
+            pool.emplace_back([&,t,end](){
+                missed[t]=Evaluate_Range(keys,sk_digits,cts,t*share,end,dlog,out);
+            });
+        }
+        missed[0]=Evaluate_Range(keys,sk_digits,cts,0,share<cts.size()?share:cts.size(),dlog,out);
+        for(size_t t=0;t<pool.size();t++){
+            pool[t].join();
+        }
+        size_t total=0;
+        for(unsigned int t=0;t<threads;t++){
+            total+=missed[t];
+        }
+        return total;
+    }
+};
+
+/*lane_kernel is the batch path for short vectors (l <= max_len) over a modulus of at most 63
+bits, such as main's l=2. With few components, a per-record loop spends its time on GMP call
+overhead and on loops over a handful of components. Here records are laid across lanes instead:
+lanes records are encrypted or decrypted in lockstep, every element is a single word in
+Montgomery form, and the data are stored lane-minor (structure of arrays), so every inner loop
+runs over the lanes with the same table row or digit in all of them. The code is scalar: a
+Montgomery product needs a 64x64->128-bit multiplication, which the compiler does not vectorize
+(-fopt-info-vec reports every lane loop as missed). The gain is instruction-level parallelism:
+the lanes are independent, so an out-of-order core overlaps their multiplication chains instead
+of waiting on one. Most of the speedup over the per-record path comes from single-word
+arithmetic without GMP; the 8 lanes add about 15-25% over 1 (README, Performance notes).
+
+Encryption walks the window digits of r and x_{i} through word copies of the group's fixed-base
+tables; decryption shares the digits of the plan (and of q - sk_{y} for Ct_{0}) across the lanes,
+each lane with small power tables of its own cipher text. Elements cross the interface as words
+in normal form, Ct_{0} first, then Ct_{1}, ..., Ct_{l}.
+*/
+class lane_kernel{
+public:
+    static const unsigned int lanes=8;
+    static const unsigned int max_len=8;
+private:
+    typedef unsigned __int128 wide;
+    uint64_t p,q,pinv,r2;//pinv = -p^(-1) mod 2^64, r2 = 2^128 mod p
+    unsigned int len,window,rows;
+    size_t d_count;
+    std::vector<uint64_t> g_words;//rows * 2^window entries of the table of g, in Montgomery form
+    std::vector<uint64_t> h_words;//len such tables, one per h_{i}
+    uint64_t Mul(uint64_t a, uint64_t b) const{
+        wide t=(wide)a*b;
+        uint64_t m=(uint64_t)t*pinv;
+        uint64_t u=(uint64_t)((t+(wide)m*p)>>64);
+        return u>=p?u-p:u;
+    }
+    void Words(std::vector<uint64_t>& out, const fixed_base_table& table) const{
+        out.resize(table.entries.size());
+        for(size_t k=0;k<out.size();k++){
+            out[k]=Mul(table.entries[k],r2);
+        }
+    }
+    uint64_t Digit(uint64_t e, unsigned int j) const{
+        return j*window<64?(e>>(j*window))&(d_count-1):0;
+    }
+public:
+    //whether the kernel covers vectors of length l modulo p
+    static bool Fits(size_t l, const mpz_t modulus){
+        return l>0 && l<=max_len && mpz_sizeinbase(modulus,2)<=63 && mpz_odd_p(modulus);
+    }
+    /*copy the fixed-base tables of g and the h_{i}, which must share one window and cover exponents
+    modulo order, into word form; tables of different shapes throw std::invalid_argument.
+    Fits(h_tables.size(), modulus) must hold.
+    */
+    lane_kernel(const fixed_base_table& g_table, const std::vector<fixed_base_table>& h_tables, const mpz_t modulus, const mpz_t order){
+        p=mpz_get_ui(modulus);q=mpz_get_ui(order);
+        len=(unsigned int)h_tables.size();
+        window=g_table.window;rows=g_table.rows;
+        for(unsigned int i=0;i<len;i++){
+            if(h_tables[i].window!=window || h_tables[i].rows!=rows){
+                throw std::invalid_argument("lane_kernel: the tables of g and of every h_i must share window and rows");
+            }
+        }
+        d_count=((size_t)1)<<window;
+        uint64_t inv=1;
+        for(int k=0;k<6;k++){
+            inv*=2-p*inv;//Newton iteration: doubles the number of correct low bits, from 1 to 64
+        }
+        pinv=0-inv;
+        r2=(uint64_t)(((wide)1<<64)%p);
+        r2=(uint64_t)(((wide)r2*r2)%p);
+        Words(g_words,g_table);
+        h_words.clear();
+        for(unsigned int i=0;i<len;i++){
+            std::vector<uint64_t> w;
+            Words(w,h_tables[i]);
+            h_words.insert(h_words.end(),w.begin(),w.end());
+        }
+    }
+    /*encrypt the count messages of x (count * l values, row after row) into out, (l+1) words per
+    cipher text, with commitments drawn from state
+    */
+    void Encrypt(const int64_t* x, size_t count, uint64_t* out, gmp_randstate_t state) const{
+        size_t stride=len+1;
+        uint64_t r[lanes],e[lanes],acc[lanes];
+        for(size_t k0=0;k0<count;k0+=lanes){
+            size_t m=count-k0<lanes?count-k0:lanes;
+            for(size_t a=0;a<lanes;a++){
+                r[a]=a<m?gmp_urandomm_ui(state,q):0;
+                acc[a]=Mul(1,r2);
+            }
+            for(unsigned int j=0;j<rows;j++){//Ct_{0} = g^r
+                const uint64_t* row=&g_words[j*d_count];
+                for(size_t a=0;a<lanes;a++){
+                    acc[a]=Mul(acc[a],row[Digit(r[a],j)]);
+                }
+            }
+            for(size_t a=0;a<m;a++){
+                out[(k0+a)*stride]=Mul(acc[a],1);
+            }
+            for(unsigned int i=0;i<len;i++){//Ct_{i} = h_{i}^r * g^(x_{i})
+                for(size_t a=0;a<lanes;a++){
+                    int64_t v=a<m?x[(k0+a)*len+i]%(int64_t)q:0;
+                    e[a]=v<0?(uint64_t)(v+(int64_t)q):(uint64_t)v;
+                    acc[a]=Mul(1,r2);
+                }
+                const uint64_t* h=&h_words[(size_t)i*rows*d_count];
+                for(unsigned int j=0;j<rows;j++){
+                    const uint64_t* h_row=h+j*d_count;
+                    const uint64_t* g_row=&g_words[j*d_count];
+                    for(size_t a=0;a<lanes;a++){
+                        acc[a]=Mul(acc[a],Mul(h_row[Digit(r[a],j)],g_row[Digit(e[a],j)]));
+                    }
+                }
+                for(size_t a=0;a<m;a++){
+                    out[(k0+a)*stride+i+1]=Mul(acc[a],1);
+                }
+            }
+        }
+    }
+    /*decrypt the count cipher texts of cts ((l+1) words each) with plan into out: out[k] is the
+    element g^(<x,y>), ready for the dlog.
+    */
+    void Decrypt(const decrypt_plan& plan, const uint64_t* cts, size_t count, uint64_t* out) const{
+        size_t stride=len+1,n=plan.active.size();
+        unsigned int w=plan.window,r_count=plan.rows;
+        size_t digits=((size_t)1)<<w;
+        std::vector<uint64_t> sk(r_count);//digits of q - sk_{y}, the exponent of Ct_{0}
+        uint64_t neg=(q-mpz_fdiv_ui(plan.sk.sk_y,q))%q;
+        for(unsigned int j=0;j<r_count;j++){
+            sk[j]=j*w<64?(neg>>(j*w))&(digits-1):0;
+        }
+        std::vector<uint64_t> powers((n+1)*digits*lanes);//powers[(b*digits+d)*lanes+a] = (base b of lane a)^d
+        uint64_t acc[lanes];
+        for(size_t k0=0;k0<count;k0+=lanes){
+            size_t m=count-k0<lanes?count-k0:lanes;
+            for(size_t b=0;b<=n;b++){
+                uint64_t* pw=&powers[b*digits*lanes];
+                for(size_t a=0;a<lanes;a++){
+                    uint64_t base=a<m?cts[(k0+a)*stride+(b<n?plan.active[b]+1:0)]:1;
+                    pw[a]=Mul(1,r2);
+                    pw[lanes+a]=Mul(base,r2);
+                }
+                for(size_t d=2;d<digits;d++){
+                    for(size_t a=0;a<lanes;a++){
+                        pw[d*lanes+a]=Mul(pw[(d-1)*lanes+a],pw[lanes+a]);
+                    }
+                }
+            }
+            for(size_t a=0;a<lanes;a++){
+                acc[a]=Mul(1,r2);
+            }
+            for(int j=(int)r_count-1;j>=0;j--){
+                for(unsigned int s=0;s<w;s++){
+                    for(size_t a=0;a<lanes;a++){
+                        acc[a]=Mul(acc[a],acc[a]);
+                    }
+                }
+                for(size_t b=0;b<=n;b++){
+                    size_t d=b<n?plan.digits[b*r_count+j]:sk[j];
+                    if(d==0){
+                        continue;
+                    }
+                    const uint64_t* pw=&powers[(b*digits+d)*lanes];
+                    for(size_t a=0;a<lanes;a++){
+                        acc[a]=Mul(acc[a],pw[a]);
+                    }
+                }
+            }
+            for(size_t a=0;a<m;a++){
+                out[k0+a]=Mul(acc[a],1);
+            }
+        }
+    }
+};
+
+/*thread_generators gives every thread that encrypts for one owner (a tenant) a Mersenne Twister of
+its own, since a gmp_randstate_t must not be shared between threads. The generators are seeded
+from a master generator when a thread first asks, and again after a fork, so that a child does
+not repeat the commitments of its parent. Seeding a Mersenne Twister takes a few hundred
+microseconds, longer than a whole block of short records takes to encrypt, so it is not done per
+call or per block. The generators are freed with the owner.
+*/
+class thread_generators{
+private:
+    struct generator{
+        gmp_randstate_t state;
+        pid_t pid;//process the generator was seeded in
+    };
+    std::mutex lock;//guards master, seeded_pid and generators
+    gmp_randstate_t master;//draws the seeds of the threads' generators
+    pid_t seeded_pid;//process that master was last seeded in
+    std::unordered_map<std::thread::id,generator*> generators;
+    //draw a seed; lock must be held
+    unsigned long Seed(){
+        if(seeded_pid!=getpid()){
+            gmp_randseed_ui(master,gmp_urandomb_ui(master,sizeof(unsigned long)*CHAR_BIT)^(unsigned long)getpid());
+            seeded_pid=getpid();
+        }
+        return gmp_urandomb_ui(master,sizeof(unsigned long)*CHAR_BIT);
+    }
+public:
+    thread_generators(unsigned long seed){
+        gmp_randinit_mt(master);
+        gmp_randseed_ui(master,seed);
+        seeded_pid=getpid();
+    }
+    thread_generators(const thread_generators&)=delete;
+    thread_generators& operator=(const thread_generators&)=delete;
+    ~thread_generators(){
+        for(auto& entry: generators){
+            gmp_randclear(entry.second->state);
+            delete entry.second;
+        }
+        gmp_randclear(master);
+    }
+    //the calling thread's generator
+    gmp_randstate_t& Local(){
+        std::lock_guard<std::mutex> guard(lock);
+        gmp_arena::pause heap;//the generators outlive a batch scope that Local may be called in
+        generator*& g=generators[std::this_thread::get_id()];
+        if(g==nullptr){
+            g=new generator;
+            gmp_randinit_mt(g->state);
+            g->pid=0;
+        }
+        if(g->pid!=getpid()){
+            gmp_randseed_ui(g->state,Seed());
+            g->pid=getpid();
+        }
+        return g->state;
+    }
+};
+
+/*A tenant owns its master key (an FE_inner_product_DDH instance) and the fixed-base tables of its
+own public keys h_{i}. Everything that depends only on the group is borrowed from the shared
+group_precomputation. If they fit in joint_budget, the tenant also builds the joint tables of
+the pairs (g, h_{i}), and encryption uses those.
+*/
+class tenant{
+public:
+    static const size_t joint_budget=((size_t)256)<<20;//bytes that the joint tables of one tenant may take
+    std::shared_ptr<const group_precomputation> group;
+    std::unique_ptr<FE_inner_product_DDH> scheme;
+    std::vector<fixed_base_table> h_tables;
+    std::vector<joint_base_table> gh_tables;//empty if they do not fit in joint_budget
+    thread_generators random;//the commitments of this tenant's cipher texts
+    tenant(std::shared_ptr<const group_precomputation> shared, unsigned int len, unsigned int window):group(shared),random(gmp_urandomb_ui(ElGamal_Client::param.state,sizeof(unsigned long)*CHAR_BIT)){
+        scheme.reset(new FE_inner_product_DDH(len));
+        unsigned int exp_bits=(unsigned int)mpz_sizeinbase(ElGamal_Client::param.q,2);
+        h_tables.resize(len);
+        for(unsigned int i=0;i<len;i++){
+            h_tables[i].Build(scheme->key_gen[i].h,ElGamal_Client::param.p,exp_bits,window);
+        }
+        if(len*joint_base_table::Bytes(ElGamal_Client::param.p,exp_bits,window)<=joint_budget){
+            gh_tables.resize(len);
+            for(unsigned int i=0;i<len;i++){
+                gh_tables[i].Build(ElGamal_Client::param.g,scheme->key_gen[i].h,ElGamal_Client::param.p,exp_bits,window);
+            }
+        }
+    }
+    //encrypt msg with the calling thread's generator, so that tenants and threads may encrypt concurrently
+    cipher_text_FE Encrypt(mpz_t* msg){
+        if(!gh_tables.empty()){
+            return FE_inner_product_DDH::Encrypt(msg,group->g_table,gh_tables,random.Local());
+        }
+        return FE_inner_product_DDH::Encrypt(msg,group->g_table,h_tables,random.Local());
+    }
+    //decrypt ct with plan and take the discrete log: result = <x,y> (mod q). Returns false if <x,y> is out of the dlog range.
+    bool Decrypt(mpz_t result, cipher_text_FE& ct, const decrypt_plan& plan){
+        plain_text pt=scheme->Decrypt(ct,plan);
+        bool found=group->dlog.Lookup(result,pt.msg);
+        mpz_clear(pt.msg);
+        return found;
+    }
+    /*encrypt count records k at a time with the packing of packer, which must have been made with
+    this tenant's length and the registry's dlog_bound. Returns packer.Ciphertexts(count) cipher texts;
+    none if packer.k = 0.
+    */
+    std::vector<cipher_text_FE> Encrypt_Packed(const record_packer& packer, mpz_t** records, size_t count){
+        std::vector<cipher_text_FE> cts;
+        if(packer.k==0){
+            return cts;
+        }
+        mpz_t* packed=(mpz_t *) malloc(packer.vec_len * sizeof(mpz_t));
+        for(unsigned int i=0;i<packer.vec_len;i++){
+            mpz_init(packed[i]);
+        }
+        for(size_t first=0;first<count;first+=packer.k){
+            packer.Pack(packed,records+first,count-first<packer.k?count-first:packer.k);
+            cts.push_back(Encrypt(packed));
+        }
+        for(unsigned int i=0;i<packer.vec_len;i++){
+            mpz_clear(packed[i]);
+        }
+        free(packed);
+        return cts;
+    }
+    //the count inner products of the records packed into ct (count <= k). Returns false if the packed inner product is out of the dlog range.
+    bool Decrypt_Packed(mpz_t* values, cipher_text_FE& ct, const decrypt_plan& plan, const record_packer& packer, size_t count){
+        mpz_t ip;
+        mpz_init(ip);
+        bool found=Decrypt(ip,ct,plan);
+        if(found){
+            packer.Unpack(values,ip,count);
+        }
+        mpz_clear(ip);
+        return found;
+    }
+    //memory owned by this tenant alone, in bytes
+    size_t Bytes() const{
+        size_t bytes=0;
+        for(size_t i=0;i<h_tables.size();i++){
+            bytes+=h_tables[i].Bytes();
+        }
+        for(size_t i=0;i<gh_tables.size();i++){
+            bytes+=gh_tables[i].Bytes();
+        }
+        return bytes;
+    }
+};
+
+/*tenant_registry hosts many tenants that share the group parameters ElGamal_Client::param. The
+generator table and the dlog table are built once, when the registry is created, instead of once
+per tenant; adding a tenant only generates its master key and the tables of its public keys.
+*/
+class tenant_registry{
+private:
+    std::shared_ptr<const group_precomputation> group;
+    std::map<std::string,std::shared_ptr<tenant>> tenants;
+    std::mutex lock;
+    unsigned int window;
+public:
+    //dlog_bound: inner products <x,y> in [0, dlog_bound) can be decoded
+    tenant_registry(unsigned long dlog_bound, unsigned int w=4){
+        window=w;
+        group=std::make_shared<const group_precomputation>(ElGamal_Client::param,dlog_bound,window);
+    }
+    //create a tenant with a fresh master key for vectors of length len, replacing any tenant of the same name
+    std::shared_ptr<tenant> Add(const std::string& name, unsigned int len){
+        std::shared_ptr<tenant> t=std::make_shared<tenant>(group,len,window);
+        std::lock_guard<std::mutex> guard(lock);
+        tenants[name]=t;
+        return t;
+    }
+    std::shared_ptr<tenant> Find(const std::string& name){
+        std::lock_guard<std::mutex> guard(lock);
+        auto it=tenants.find(name);
+        return it==tenants.end()?nullptr:it->second;
+    }
+    void Remove(const std::string& name){
+        std::lock_guard<std::mutex> guard(lock);
+        tenants.erase(name);
+    }
+    //display the memory shared by all tenants and the memory owned by each of them
+    void Info(){
+        std::lock_guard<std::mutex> guard(lock);
+        printf("shared group tables: %zu bytes\n",group->Bytes());
+        for(auto& t:tenants){
+            printf("tenant %s: %zu bytes\n",t.first.c_str(),t.second->Bytes());
+        }
+    }
+};
+
+/*numa_topology lists the NUMA nodes of the machine and the CPUs of each node that this process
+may run on, as found in /sys/devices/system/node. Without that directory (or without NUMA),
+all allowed CPUs form a single node.
+*/
+class numa_topology{
+public:
+    std::vector<std::vector<int>> cpus;//cpus[n] lists the CPUs of node n
+    std::vector<int> node_ids;//the kernel's number of node n
+    numa_topology(){
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if(sched_getaffinity(0,sizeof(allowed),&allowed)!=0){
+            for(int c=0;c<CPU_SETSIZE && c<(int)std::thread::hardware_concurrency();c++){
+                CPU_SET(c,&allowed);
+            }
+        }
+        for(int node=0;node<1024;node++){
+            char path[64];
+            snprintf(path,sizeof(path),"/sys/devices/system/node/node%d/cpulist",node);
+            FILE* f=fopen(path,"r");
+            if(f==NULL){
+                continue;
+            }
+            char list[4096];
+            std::vector<int> node_cpus;
+            if(fgets(list,sizeof(list),f)!=NULL){
+                node_cpus=Parse_Cpu_List(list,allowed);
+            }
+            fclose(f);
+            if(!node_cpus.empty()){
+                cpus.push_back(node_cpus);
+                node_ids.push_back(node);
+            }
+        }
+        if(cpus.empty()){
+            cpus.push_back(Parse_Cpu_List("",allowed));
+            node_ids.push_back(0);
+        }
+    }
+    //parse a sysfs cpu list such as "0-3,8-11", keeping the CPUs in allowed. An empty list means all allowed CPUs.
+    static std::vector<int> Parse_Cpu_List(const char* list, const cpu_set_t& allowed){
+        std::vector<int> result;
+        if(list[0]=='\0'){
+            for(int c=0;c<CPU_SETSIZE;c++){
+                if(CPU_ISSET(c,&allowed)){
+                    result.push_back(c);
+                }
+            }
+            return result;
+        }
+        const char* s=list;
+        while(*s>='0' && *s<='9'){
+            char* end;
+            int first=(int)strtol(s,&end,10),last=first;
+            if(*end=='-'){
+                last=(int)strtol(end+1,&end,10);
+            }
+            for(int c=first;c<=last && c<CPU_SETSIZE;c++){
+                if(CPU_ISSET(c,&allowed)){
+                    result.push_back(c);
+                }
+            }
+            s=(*end==',')?end+1:end;
+        }
+        return result;
+    }
+    unsigned int Nodes() const{
+        return (unsigned int)cpus.size();
+    }
+};
+
+/*batch_engine runs batch operations on a pool of worker threads, one pinned to every allowed CPU
+(or max_workers per node). A batch of count records is split into one contiguous slice per NUMA
+node, in proportion to the node's workers, and a slice is only ever processed by the workers of
+its node; within a node, workers take blocks of block records from a shared counter. Whatever a
+worker allocates for its records is therefore first touched, and placed, on the node that reads
+it again. Read-only tables are either replicated per node (On_Node builds a replica from a worker
+of the node) or, when replication would cost too much memory, interleaved across the nodes.
+*/
+class batch_engine{
+public:
+    typedef std::function<void(unsigned int node, size_t begin, size_t end)> job;
+    size_t block=64;//number of records a worker takes at a time
+    size_t replication_limit=((size_t)1)<<30;//extra memory that replicas may take, in bytes
+    batch_engine(unsigned int max_workers=0){
+        generation=0;pending=0;stop=false;task_done=false;
+        current=nullptr;
+        for(unsigned int n=0;n<topology.Nodes();n++){
+            unsigned int count=(unsigned int)topology.cpus[n].size();
+            if(max_workers!=0 && count>max_workers){
+                count=max_workers;
+            }
+            node_workers.push_back(count);
+            for(unsigned int w=0;w<count;w++){
+                workers.emplace_back(&batch_engine::Work,this,n,topology.cpus[n][w]);
+            }
+        }
+        next.reset(new std::atomic<size_t>[topology.Nodes()]);
+        slice_begin.resize(topology.Nodes());
+        slice_end.resize(topology.Nodes());
+        tasks.assign(topology.Nodes(),nullptr);
+    }
+    batch_engine(const batch_engine&)=delete;
+    batch_engine& operator=(const batch_engine&)=delete;
+    ~batch_engine(){
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop=true;
+        }
+        wake.notify_all();
+        for(size_t w=0;w<workers.size();w++){
+            workers[w].join();
+        }
+    }
+    unsigned int Nodes() const{
+        return topology.Nodes();
+    }
+    unsigned int Workers() const{
+        return (unsigned int)workers.size();
+    }
+    /*run fn over the records [0, count), blocks of a node's slice going to that node's workers. Returns when
+    all records are done. Calls from several threads are serialized: a second Run (or On_Node) waits until the
+    first has returned. fn must not call Run or On_Node itself.
+    */
+    void Run(size_t count, const job& fn){
+        std::lock_guard<std::mutex> serial(run_lock);
+        std::unique_lock<std::mutex> guard(lock);
+        size_t begin=0;
+        for(unsigned int n=0;n<Nodes();n++){
+            size_t share=count*node_workers[n]/workers.size()/block*block;//slices start on a block boundary
+            slice_begin[n]=begin;
+            slice_end[n]=(n+1==Nodes())?count:begin+share;
+            next[n].store(slice_begin[n]);
+            begin=slice_end[n];
+        }
+        current=&fn;
+        pending=(unsigned int)workers.size();
+        generation++;
+        wake.notify_all();
+        done.wait(guard,[this]{return pending==0;});
+        current=nullptr;
+    }
+    /*run fn once on a worker of the given node, e.g. to build a replica whose pages the node touches
+    first. fn goes to the node's task slot, where the first of its workers to wake claims it.
+    */
+    void On_Node(unsigned int node, const std::function<void()>& fn){
+        std::lock_guard<std::mutex> serial(run_lock);
+        std::unique_lock<std::mutex> guard(lock);
+        tasks[node]=&fn;
+        task_done=false;
+        wake.notify_all();
+        done.wait(guard,[this]{return task_done;});
+    }
+    //replicating tables of table_bytes bytes to every node fits in replication_limit
+    bool Replicate(size_t table_bytes) const{
+        return Nodes()>1 && table_bytes*(Nodes()-1)<=replication_limit;
+    }
+    //spread the pages of a table over all nodes; only whole pages inside [ptr, ptr + bytes) are moved
+    void Interleave(const void* ptr, size_t bytes) const{
+        if(Nodes()<2){
+            return;
+        }
+        uintptr_t page=(uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t first=((uintptr_t)ptr+page-1)/page*page,last=((uintptr_t)ptr+bytes)/page*page;
+        if(last<=first){
+            return;
+        }
+        unsigned long mask[16]={0};
+        for(unsigned int n=0;n<Nodes();n++){
+            int id=topology.node_ids[n];
+            if(id<16*64){
+                mask[id/64]|=1UL<<(id%64);
+            }
+        }
+        //mbind(MPOL_INTERLEAVE, MPOL_MF_MOVE) without a dependency on libnuma; a failure leaves the pages where they are
+        syscall(SYS_mbind,(void*)first,(unsigned long)(last-first),3,mask,(unsigned long)(16*64),2);
+    }
+private:
+    numa_topology topology;
+    std::vector<std::thread> workers;
+    std::vector<unsigned int> node_workers;
+    std::unique_ptr<std::atomic<size_t>[]> next;//next unclaimed record of every node's slice
+    std::vector<size_t> slice_begin,slice_end;
+    std::mutex run_lock;//held for the whole of a Run or On_Node, which share the slice and task state
+    std::mutex lock;
+    std::condition_variable wake,done;
+    unsigned long generation;
+    unsigned int pending;//workers that have not finished the current job
+    bool stop;
+    const job* current;
+    std::vector<const std::function<void()>*> tasks;//tasks[n] is waiting for a worker of node n
+    bool task_done;
+    void Work(unsigned int node, int cpu){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu,&set);
+        pthread_setaffinity_np(pthread_self(),sizeof(set),&set);//pin, so that first touch lands on this node
+        unsigned long seen=0;
+        std::unique_lock<std::mutex> guard(lock);
+        while(true){
+            wake.wait(guard,[&]{return stop || generation!=seen || tasks[node]!=nullptr;});
+            if(stop){
+                return;
+            }
+            if(tasks[node]!=nullptr){
+                const std::function<void()>& task=*tasks[node];
+                tasks[node]=nullptr;
+                guard.unlock();
+                task();
+                guard.lock();
+                task_done=true;
+                done.notify_all();
+                continue;
+            }
+            seen=generation;
+            const job& fn=*current;
+            guard.unlock();
+            while(true){
+                size_t begin=next[node].fetch_add(block);
+                if(begin>=slice_end[node]){
+                    break;
+                }
+                size_t end=begin+block<slice_end[node]?begin+block:slice_end[node];
+                fn(node,begin,end);
+            }
+            guard.lock();
+            if(--pending==0){
+                done.notify_all();
+            }
+        }
+    }
+};
+
+/*The read-only tables a tenant needs for batch encryption and decryption, as one unit that can
+be copied to a NUMA node.
+*/
+class tenant_replica{
+public:
+    fixed_base_table g_table;
+    std::vector<fixed_base_table> h_tables;
+    std::vector<joint_base_table> gh_tables;
+    dlog_table dlog;
+    tenant_replica(const tenant& t){
+        g_table=t.group->g_table;
+        h_tables=t.h_tables;
+        gh_tables=t.gh_tables;
+        dlog.Copy(t.group->dlog);
+    }
+    size_t Bytes() const{
+        size_t bytes=g_table.Bytes()+dlog.Bytes();
+        for(size_t i=0;i<h_tables.size();i++){
+            bytes+=h_tables[i].Bytes();
+        }
+        for(size_t i=0;i<gh_tables.size();i++){
+            bytes+=gh_tables[i].Bytes();
+        }
+        return bytes;
+    }
+};
+
+/*tenant_batch runs the batch operations of one tenant on a batch_engine. Every node reads the
+tenant's tables from a replica on its own memory, or from a single interleaved replica when
+replicas for all nodes would exceed the engine's replication_limit.
+*/
+class tenant_batch{
+private:
+    batch_engine& engine;
+    std::shared_ptr<tenant> owner;
+    std::vector<std::shared_ptr<const tenant_replica>> replicas;//replicas[n] serves node n
+public:
+    tenant_batch(batch_engine& e, std::shared_ptr<tenant> t):engine(e),owner(t){
+        std::shared_ptr<const tenant_replica> first=std::make_shared<const tenant_replica>(*owner);
+        replicas.assign(engine.Nodes(),first);
+        if(engine.Replicate(first->Bytes())){
+            for(unsigned int n=0;n<engine.Nodes();n++){
+                engine.On_Node(n,[&]{replicas[n]=std::make_shared<const tenant_replica>(*owner);});
+            }
+        }else{
+            engine.Interleave(first->g_table.entries.data(),first->g_table.Bytes());
+            engine.Interleave(first->dlog.slots.data(),first->dlog.Bytes());
+            for(size_t i=0;i<first->h_tables.size();i++){
+                engine.Interleave(first->h_tables[i].entries.data(),first->h_tables[i].Bytes());
+            }
+            for(size_t i=0;i<first->gh_tables.size();i++){
+                engine.Interleave(first->gh_tables[i].entries.data(),first->gh_tables[i].Bytes());
+            }
+        }
+    }
+    //encrypt count messages; msgs[k] holds the components of the k-th message
+    std::vector<cipher_text_FE> Encrypt(mpz_t** msgs, size_t count){
+        std::vector<cipher_text_FE> cts(count);
+        engine.Run(count,[&](unsigned int node, size_t begin, size_t end){
+            gmp_randstate_t& state=owner->random.Local();//the worker's generator for this tenant
+            const tenant_replica& r=*replicas[node];
+            for(size_t k=begin;k<end;k++){
+                if(!r.gh_tables.empty()){//allocated by this node's worker
+                    cts[k]=FE_inner_product_DDH::Encrypt(msgs[k],r.g_table,r.gh_tables,state);
+                }else{
+                    cts[k]=owner->scheme->Encrypt(msgs[k],r.g_table,r.h_tables,state);
+                }
+            }
+        });
+        return cts;
+    }
+    /*decrypt every cipher text of cts with plan and take the discrete log. The k-th result is
+    <x,y> (mod q), or -1 if it is outside the range of the dlog table. The logs of a range are
+    taken together with Lookup_Batch, so that their table probes overlap.
+    */
+    std::vector<plain_text> Decrypt(std::vector<cipher_text_FE>& cts, const decrypt_plan& plan){
+        std::vector<plain_text> pts(cts.size());
+        engine.Run(cts.size(),[&](unsigned int node, size_t begin, size_t end){
+            const tenant_replica& r=*replicas[node];
+            size_t count=end-begin;
+            mpz_t* h=(mpz_t *) malloc(count * sizeof(mpz_t));
+            mpz_t* k=(mpz_t *) malloc(count * sizeof(mpz_t));
+            bool* found=(bool *) malloc(count * sizeof(bool));
+            for(size_t a=0;a<count;a++){
+                plain_text pt=owner->scheme->Decrypt(cts[begin+a],plan);
+                mpz_init(h[a]);
+                mpz_swap(h[a],pt.msg);
+                mpz_clear(pt.msg);
+                mpz_init(k[a]);
+            }
+            r.dlog.Lookup_Batch(k,h,count,found);
+            for(size_t a=0;a<count;a++){
+                if(found[a]){
+                    mpz_swap(pts[begin+a].msg,k[a]);
+                }else{
+                    mpz_set_si(pts[begin+a].msg,-1);
+                }
+                mpz_clear(h[a]);mpz_clear(k[a]);
+            }
+            free(h);free(k);free(found);
+        });
+        return pts;
+    }
+};
+
+/*socket_channel frames the messages exchanged between a coordinator and its worker processes
+over a stream socket (a Unix socket today, TCP later). Words are sent as 8 little-endian bytes;
+a big integer is a word holding its byte count and sign followed by its magnitude, most
+significant byte first. Writes are buffered until Flush.
+*/
+class socket_channel{
+private:
+    int fd;
+    std::vector<unsigned char> out;
+    std::vector<unsigned char> in;
+    size_t in_pos;
+    bool Fill(size_t need){//make sure need unread bytes are buffered
+        if(in.size()-in_pos>=need){
+            return true;
+        }
+        in.erase(in.begin(),in.begin()+in_pos);
+        in_pos=0;
+        unsigned char buf[1<<16];
+        while(in.size()<need){
+            ssize_t got=recv(fd,buf,sizeof(buf),0);
+            if(got<=0){
+                if(got<0 && errno==EINTR){
+                    continue;
+                }
+                return false;
+            }
+            in.insert(in.end(),buf,buf+got);
+        }
+        return true;
+    }
+public:
+    socket_channel(int f){
+        fd=f;in_pos=0;
+    }
+    int Fd() const{
+        return fd;
+    }
+    //whether a read would find data without blocking: unread bytes are buffered or waiting on the socket
+    bool Readable(){
+        if(in.size()>in_pos){
+            return true;
+        }
+        pollfd p={fd,POLLIN,0};
+        return poll(&p,1,0)>0;
+    }
+    void Put_Word(uint64_t v){
+        for(int i=0;i<8;i++){
+            out.push_back((unsigned char)(v>>(8*i)));
+        }
+    }
+    void Put_Mpz(const mpz_t v){
+        size_t bytes=(mpz_sizeinbase(v,2)+7)/8;
+        Put_Word((uint64_t)bytes<<1|(mpz_sgn(v)<0?1:0));
+        size_t at=out.size();
+        out.resize(at+bytes);
+        if(bytes>0){
+            mpz_export(&out[at],NULL,1,1,1,0,v);
+        }
+    }
+    bool Flush(){
+        size_t sent=0;
+        while(sent<out.size()){
+            ssize_t n=send(fd,&out[sent],out.size()-sent,MSG_NOSIGNAL);//a dead peer is an error, not a SIGPIPE
+            if(n<0){
+                if(errno==EINTR){
+                    continue;
+                }
+                return false;
+            }
+            sent+=n;
+        }
+        out.clear();
+        return true;
+    }
+    bool Get_Word(uint64_t& v){
+        if(!Fill(8)){
+            return false;
+        }
+        v=0;
+        for(int i=0;i<8;i++){
+            v|=(uint64_t)in[in_pos+i]<<(8*i);
+        }
+        in_pos+=8;
+        return true;
+    }
+    bool Get_Mpz(mpz_t v){
+        uint64_t header;
+        if(!Get_Word(header) || !Fill(header>>1)){
+            return false;
+        }
+        size_t bytes=header>>1;
+        mpz_import(v,bytes,1,1,1,0,bytes>0?&in[in_pos]:NULL);
+        if(header&1){
+            mpz_neg(v,v);
+        }
+        in_pos+=bytes;
+        return true;
+    }
+    void Put_String(const std::string& s){
+        Put_Word(s.size());
+        out.insert(out.end(),s.begin(),s.end());
+    }
+    bool Get_String(std::string& s){
+        uint64_t n;
+        if(!Get_Word(n) || !Fill(n)){
+            return false;
+        }
+        s.assign((const char*)&in[in_pos],n);
+        in_pos+=n;
+        return true;
+    }
+    void Close(){
+        if(fd>=0){
+            close(fd);
+            fd=-1;
+        }
+    }
+    //connect to a worker that listens on the Unix socket at path; returns -1 on failure
+    static int Connect(const char* path){
+        int fd=socket(AF_UNIX,SOCK_STREAM,0);
+        sockaddr_un addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sun_family=AF_UNIX;
+        strncpy(addr.sun_path,path,sizeof(addr.sun_path)-1);
+        if(fd>=0 && connect(fd,(sockaddr*)&addr,sizeof(addr))!=0){
+            close(fd);
+            fd=-1;
+        }
+        return fd;
+    }
+    //serve the connections to the Unix socket at path one after the other. Returns false if path cannot be bound.
+    static bool Listen(const char* path, void (*serve)(int)){
+        int listener=socket(AF_UNIX,SOCK_STREAM,0);
+        sockaddr_un addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sun_family=AF_UNIX;
+        strncpy(addr.sun_path,path,sizeof(addr.sun_path)-1);
+        unlink(path);
+        if(listener<0 || bind(listener,(sockaddr*)&addr,sizeof(addr))!=0 || listen(listener,16)!=0){
+            if(listener>=0){
+                close(listener);
+            }
+            return false;
+        }
+        while(true){
+            int fd=accept(listener,NULL,NULL);
+            if(fd<0){
+                if(errno==EINTR){
+                    continue;
+                }
+                break;
+            }
+            serve(fd);
+        }
+        close(listener);
+        return true;
+    }
+    /*start a local worker process that runs serve on its end of a new Unix socket pair, and set fd
+    to the caller's end. The sockets in open belong to the caller and are closed in the child.
+    Returns the pid of the worker, or -1.
+    */
+    static pid_t Spawn(void (*serve)(int), const std::vector<socket_channel>& open, int& fd){
+        int pair[2];
+        if(socketpair(AF_UNIX,SOCK_STREAM,0,pair)!=0){
+            return -1;
+        }
+        fflush(NULL);//do not let the child flush copies of buffered output
+        pid_t pid=fork();
+        if(pid==0){
+            close(pair[0]);
+            for(size_t k=0;k<open.size();k++){
+                close(open[k].Fd());
+            }
+            serve(pair[1]);
+            _exit(0);//skip the destructors of objects that belong to the caller
+        }
+        close(pair[1]);
+        if(pid<0){
+            close(pair[0]);
+            return -1;
+        }
+        fd=pair[0];
+        return pid;
+    }
+};
+
+/*shard_worker is the worker side of dimension-sharded decryption. A worker owns a range of the
+coordinates of functional keys: the coordinator loads the worker's shard of y once per key, and
+afterwards sends only the worker's shard of Ct_{1}. The worker answers with the partial product
+Product of (Ct_{i})^(y_{i}) over its shard, computed with the same multi-exponentiation as
+FE_inner_product_DDH::Decrypt.
+
+Nothing read from the socket is trusted. A load whose modulus is below 3, whose window is outside
+[1, max_window], or whose y has a negative component is refused with status 1. So is a shard longer
+than max_length, in a load or a product; the worker cannot skip that many integers, so it also drops
+the connection.
+*/
+class shard_worker{
+public:
+    enum operation{op_load=1,op_unload=2,op_product=3,op_quit=4};
+    static const unsigned int max_window=16;//digits are stored as unsigned short
+    static unsigned int max_length;//longest shard a worker accepts; set it before Listen or Spawn
+    //answer requests on the connected socket fd until the coordinator quits or disconnects
+    static void Serve(int fd){
+        socket_channel ch(fd);
+        struct shard{
+            mpz_t p;
+            std::unique_ptr<decrypt_plan> plan;
+        };
+        std::map<uint64_t,shard> shards;
+        mpz_t product,p;
+        mpz_init(product);mpz_init(p);
+        uint64_t op,id,count,window;
+        while(ch.Get_Word(op) && op!=op_quit){
+            if(op==op_load){//id, p, window, count, y_{1..count}
+                if(!ch.Get_Word(id) || !ch.Get_Mpz(p) || !ch.Get_Word(window) || !ch.Get_Word(count)){
+                    break;
+                }
+                if(count==0 || count>max_length){
+                    ch.Put_Word(1);
+                    ch.Flush();
+                    break;
+                }
+                std::unique_ptr<decrypt_plan> plan(new decrypt_plan((unsigned int)count,1));
+                size_t bits=1;
+                bool ok=true,valid=mpz_cmp_ui(p,3)>=0 && window>=1 && window<=max_window;
+                for(uint64_t i=0;i<count && ok;i++){
+                    ok=ch.Get_Mpz(plan->y[i]);
+                    valid=valid && mpz_sgn(plan->y[i])>=0;
+                    if(mpz_sizeinbase(plan->y[i],2)>bits){
+                        bits=mpz_sizeinbase(plan->y[i],2);
+                    }
+                }
+                if(!ok){
+                    break;
+                }
+                if(valid){
+                    plan->window=(unsigned int)window;
+                    plan->Recode((unsigned int)bits);
+                    shard& s=shards[id];
+                    if(!s.plan){
+                        mpz_init(s.p);
+                    }
+                    mpz_set(s.p,p);
+                    s.plan.swap(plan);
+                }
+                ch.Put_Word(valid?0:1);
+            }else if(op==op_unload){//id
+                if(!ch.Get_Word(id)){
+                    break;
+                }
+                auto it=shards.find(id);
+                if(it!=shards.end()){
+                    mpz_clear(it->second.p);
+                    shards.erase(it);
+                }
+                ch.Put_Word(0);
+            }else if(op==op_product){//id, count, c1_{1..count}
+                if(!ch.Get_Word(id) || !ch.Get_Word(count)){
+                    break;
+                }
+                if(count>max_length){
+                    ch.Put_Word(1);
+                    ch.Flush();
+                    break;
+                }
+                auto it=shards.find(id);
+                unsigned int len=(it==shards.end())?0:it->second.plan->len;
+                mpz_t* c1=(mpz_t *) malloc(count * sizeof(mpz_t));
+                bool ok=true;
+                for(uint64_t i=0;i<count;i++){
+                    mpz_init(c1[i]);
+                    ok=ok && ch.Get_Mpz(c1[i]);
+                }
+                if(ok && it!=shards.end() && count==len){
+                    it->second.plan->Product(product,c1,it->second.p);
+                    ch.Put_Word(0);
+                    ch.Put_Mpz(product);
+                }else{
+                    ch.Put_Word(1);//unknown key or wrong shard length
+                }
+                for(uint64_t i=0;i<count;i++){
+                    mpz_clear(c1[i]);
+                }
+                free(c1);
+                if(!ok){
+                    break;
+                }
+            }else{
+                break;
+            }
+            if(!ch.Flush()){
+                break;
+            }
+        }
+        for(auto& s:shards){
+            mpz_clear(s.second.p);
+        }
+        mpz_clear(product);mpz_clear(p);
+        ch.Close();
+    }
+    //serve coordinators that connect to the Unix socket at path, one after the other. Returns false if path cannot be bound.
+    static bool Listen(const char* path){
+        return socket_channel::Listen(path,Serve);
+    }
+};
+unsigned int shard_worker::max_length=1U<<20;
+
+/*sharded_decryptor is the coordinator side of dimension-sharded decryption. The coordinates
+[0, l) are split into one contiguous shard per worker; Decrypt sends every worker its shard of
+Ct_{1}, multiplies the partial products the workers return, and finishes locally with the
+Ct_{0}^(sk_{y}) step (and, on request, the discrete log). Workers are either local processes
+started by Spawn or servers reached through Connect.
+
+Every request is answered by every worker it was sent to, and those replies are always read in
+full, even after one of them reports a failure, so the next request starts on a clean stream. A
+failed send or receive leaves the stream position unknown; the decryptor is then broken and
+refuses every further call.
+*/
+class sharded_decryptor{
+private:
+    FE_inner_product_DDH& fe;
+    std::vector<socket_channel> workers;
+    std::vector<pid_t> children;//worker processes started by this coordinator
+    struct loaded_plan{
+        uint64_t id;//under which the workers hold their shards
+        unsigned long version;//of the plan when it was loaded
+        std::shared_ptr<const decrypt_plan> plan;
+    };
+    std::map<const decrypt_plan*,loaded_plan> loaded;
+    uint64_t next_id;
+    bool broken;//a worker connection failed mid-request
+    //first coordinate of worker w's shard; the shard ends where the next one begins
+    unsigned int Shard_Begin(unsigned int w){
+        return (unsigned int)((uint64_t)fe.Length()*w/workers.size());
+    }
+public:
+    sharded_decryptor(FE_inner_product_DDH& scheme, const std::vector<int>& fds):fe(scheme){
+        next_id=1;broken=false;
+        for(size_t w=0;w<fds.size();w++){
+            workers.emplace_back(fds[w]);
+        }
+    }
+    //start count local worker processes, each connected to this coordinator by a Unix socket pair
+    sharded_decryptor(FE_inner_product_DDH& scheme, unsigned int count):fe(scheme){
+        next_id=1;broken=false;
+        for(unsigned int w=0;w<count;w++){
+            int fd;
+            pid_t pid=socket_channel::Spawn(shard_worker::Serve,workers,fd);
+            if(pid<0){
+                break;
+            }
+            children.push_back(pid);
+            workers.emplace_back(fd);
+        }
+    }
+    sharded_decryptor(const sharded_decryptor&)=delete;
+    sharded_decryptor& operator=(const sharded_decryptor&)=delete;
+    ~sharded_decryptor(){
+        for(size_t w=0;w<workers.size();w++){
+            workers[w].Put_Word(shard_worker::op_quit);
+            workers[w].Flush();
+            workers[w].Close();
+        }
+        for(size_t c=0;c<children.size();c++){
+            waitpid(children[c],NULL,0);
+        }
+    }
+    unsigned int Workers() const{
+        return (unsigned int)workers.size();
+    }
+    bool Broken() const{
+        return broken;
+    }
+    /*send every worker its shard of plan's y. Decrypt loads plans on first use, so calling this is optional.
+    A plan patched by Update_Plan since it was loaded is sent again under the same id, and the workers replace their shards.
+    */
+    bool Load(std::shared_ptr<const decrypt_plan> plan){
+        if(broken){
+            return false;
+        }
+        auto it=loaded.find(plan.get());
+        if(it!=loaded.end() && it->second.version==plan->version){
+            return true;
+        }
+        uint64_t id=it!=loaded.end()?it->second.id:next_id++;
+        for(unsigned int w=0;w<workers.size();w++){
+            unsigned int begin=Shard_Begin(w),end=Shard_Begin(w+1);
+            workers[w].Put_Word(shard_worker::op_load);
+            workers[w].Put_Word(id);
+            workers[w].Put_Mpz(ElGamal_Client::param.p);
+            workers[w].Put_Word(plan->window);
+            workers[w].Put_Word(end-begin);
+            for(unsigned int i=begin;i<end;i++){
+                workers[w].Put_Mpz(plan->y[i]);
+            }
+            if(!workers[w].Flush()){
+                broken=true;
+                return false;
+            }
+        }
+        bool ok=true;
+        for(unsigned int w=0;w<workers.size();w++){
+            uint64_t status=1;
+            if(!workers[w].Get_Word(status)){
+                broken=true;
+                return false;
+            }
+            ok=ok && status==0;
+        }
+        if(ok){
+            loaded[plan.get()]=loaded_plan{id,plan->version,plan};
+        }
+        return ok;
+    }
+    //tell the workers to drop their shards of plan
+    bool Unload(std::shared_ptr<const decrypt_plan> plan){
+        if(broken){
+            return false;
+        }
+        auto it=loaded.find(plan.get());
+        if(it==loaded.end()){
+            return true;
+        }
+        uint64_t id=it->second.id,status;
+        loaded.erase(it);
+        bool ok=true;
+        for(unsigned int w=0;w<workers.size();w++){
+            workers[w].Put_Word(shard_worker::op_unload);
+            workers[w].Put_Word(id);
+            if(!workers[w].Flush()){
+                broken=true;
+                return false;
+            }
+        }
+        for(unsigned int w=0;w<workers.size();w++){
+            if(!workers[w].Get_Word(status)){
+                broken=true;
+                return false;
+            }
+            ok=ok && status==0;
+        }
+        return ok;
+    }
+    //decrypt ct with plan, the partial products being computed by the workers in parallel. Returns false if a worker fails.
+    bool Decrypt(cipher_text_FE& ct, std::shared_ptr<const decrypt_plan> plan, plain_text& pt){
+        if(!Load(plan)){
+            return false;
+        }
+        uint64_t id=loaded[plan.get()].id;
+        for(unsigned int w=0;w<workers.size();w++){
+            unsigned int begin=Shard_Begin(w),end=Shard_Begin(w+1);
+            workers[w].Put_Word(shard_worker::op_product);
+            workers[w].Put_Word(id);
+            workers[w].Put_Word(end-begin);
+            for(unsigned int i=begin;i<end;i++){
+                workers[w].Put_Mpz(ct.c1[i]);
+            }
+            if(!workers[w].Flush()){
+                broken=true;
+                return false;
+            }
+        }
+        mpz_t product,partial;
+        mpz_init_set_ui(product,1);mpz_init(partial);
+        bool ok=true;
+        for(unsigned int w=0;w<workers.size() && !broken;w++){//every worker is busy by now; collect the partials in order
+            uint64_t status=1;
+            if(!workers[w].Get_Word(status) || (status==0 && !workers[w].Get_Mpz(partial))){
+                broken=true;
+            }else if(status==0){//a failed worker sends no partial; the others' are still read
+                mpz_mul(product,product,partial);
+                mpz_mod(product,product,ElGamal_Client::param.p);
+            }
+            ok=ok && status==0;
+        }
+        ok=ok && !broken;
+        if(ok){
+            pt=fe.Decrypt_Product(ct.c0,product,*plan);
+        }
+        mpz_clear(product);mpz_clear(partial);
+        return ok;
+    }
+    //decrypt ct with plan and take the discrete log with dlog: result = <x,y> (mod q)
+    bool Decrypt(cipher_text_FE& ct, std::shared_ptr<const decrypt_plan> plan, const dlog_table& dlog, mpz_t result){
+        plain_text pt;
+        bool ok=Decrypt(ct,plan,pt) && dlog.Lookup(result,pt.msg);
+        mpz_clear(pt.msg);
+        return ok;
+    }
+};
+
+/*batch_encrypt_worker is the worker side of distributed batch encryption. After the setup
+message (the public keys h_{i}, a seed, the input file and the output prefix) it builds the
+fixed-base tables once, then repeatedly asks the coordinator for a range of input records,
+encrypts them and writes them to a segment file of its own. Input files hold one message per
+line, as l whitespace-separated integers; segment files hold one cipher text per line, as
+Ct_{0} followed by the l components of Ct_{1}, in hexadecimal.
+*/
+class batch_encrypt_worker{
+public:
+    enum message{msg_request=1,msg_complete=2,msg_failed=3,msg_range=4,msg_done=5,msg_cancel=6,msg_cancelled=7};
+    enum outcome{range_failed,range_complete,range_interrupted};
+    static const uint64_t check_interval=64;//records between two looks for a message from the coordinator
+    //name of the segment file that holds attempt of range
+    static std::string Segment(const std::string& prefix, uint64_t range, uint64_t attempt){
+        return prefix+".seg"+std::to_string(range)+"."+std::to_string(attempt);
+    }
+    /*read the next record of input into msg: a line of exactly len integers. Empty lines are
+    skipped, as Split does; a line with fewer or more integers, or anything else on it, is an error.
+    */
+    static bool Read_Record(FILE* input, char*& line, size_t& capacity, mpz_t* msg, size_t len){
+        ssize_t got;
+        do{
+            got=getline(&line,&capacity,input);
+        }while(got==1 && line[0]=='\n');
+        if(got<=0){
+            return false;
+        }
+        const char* cursor=line;
+        for(size_t i=0;i<len;i++){
+            int used=0;
+            if(gmp_sscanf(cursor,"%Zd%n",msg[i],&used)!=1){
+                return false;
+            }
+            cursor+=used;
+        }
+        while(*cursor==' ' || *cursor=='\t' || *cursor=='\r' || *cursor=='\n'){
+            cursor++;
+        }
+        return *cursor=='\0';
+    }
+    /*encrypt count records that start at byte offset of the input into segment. Every
+    check_interval records the worker looks at control (if given): a message from the coordinator
+    in the middle of a range can only be a cancel or the end, so the range is abandoned and
+    range_interrupted returned, leaving the message to be read. range_failed means the input is
+    malformed or the segment cannot be written.
+    */
+    static outcome Encrypt_Range(FILE* input, uint64_t offset, uint64_t count, const std::string& segment, const fixed_base_table& g_table, const std::vector<fixed_base_table>& h_tables, gmp_randstate_t state, socket_channel* control=NULL){
+        size_t len=h_tables.size();
+        FILE* out=fopen(segment.c_str(),"w");
+        if(out==NULL || fseek(input,(long)offset,SEEK_SET)!=0){
+            if(out!=NULL){
+                fclose(out);
+            }
+            return range_failed;
+        }
+        mpz_t* msg=(mpz_t *) malloc(len * sizeof(mpz_t));
+        for(size_t i=0;i<len;i++){
+            mpz_init(msg[i]);
+        }
+        char* line=NULL;
+        size_t capacity=0;
+        bool ok=true,interrupted=false;
+        for(uint64_t k=0;k<count && ok;k++){
+            if(control!=NULL && k%check_interval==0 && k>0 && control->Readable()){
+                interrupted=true;
+                break;
+            }
+            ok=Read_Record(input,line,capacity,msg,len);
+            if(!ok){
+                break;
+            }
+            cipher_text_FE ct=FE_inner_product_DDH::Encrypt(msg,g_table,h_tables,state);
+            gmp_fprintf(out,"%Zx",ct.c0);
+            for(size_t i=0;i<len;i++){
+                gmp_fprintf(out," %Zx",ct.c1[i]);
+                mpz_clear(ct.c1[i]);
+            }
+            fputc('\n',out);
+            mpz_clear(ct.c0);
+            free(ct.c1);
+        }
+        for(size_t i=0;i<len;i++){
+            mpz_clear(msg[i]);
+        }
+        free(msg);
+        free(line);
+        if(fclose(out)!=0 || !ok){
+            return range_failed;
+        }
+        return interrupted?range_interrupted:range_complete;
+    }
+    static void Serve(int fd){
+        socket_channel ch(fd);
+        uint64_t len,seed;
+        std::string input_path,prefix;
+        if(!ch.Get_Word(len)){
+            ch.Close();
+            return;
+        }
+        //read the whole setup message before building anything; a short read ends the session
+        mpz_t* h=(mpz_t *) malloc(len * sizeof(mpz_t));
+        bool ok=true;
+        uint64_t received=0;
+        for(;received<len && ok;received++){
+            mpz_init(h[received]);
+            ok=ch.Get_Mpz(h[received]);
+        }
+        ok=ok && ch.Get_Word(seed) && ch.Get_String(input_path) && ch.Get_String(prefix);
+        FILE* input=ok?fopen(input_path.c_str(),"r"):NULL;
+        std::vector<fixed_base_table> h_tables(input!=NULL?len:0);
+        for(uint64_t i=0;i<h_tables.size();i++){
+            h_tables[i].Build(h[i],ElGamal_Client::param.p,mpz_sizeinbase(ElGamal_Client::param.q,2),4);
+        }
+        for(uint64_t i=0;i<received;i++){
+            mpz_clear(h[i]);
+        }
+        free(h);
+        if(input==NULL){
+            ch.Close();
+            return;
+        }
+        fixed_base_table g_table;
+        g_table.Build(ElGamal_Client::param.g,ElGamal_Client::param.p,mpz_sizeinbase(ElGamal_Client::param.q,2),4);
+        gmp_randstate_t state;
+        gmp_randinit_mt(state);
+        gmp_randseed_ui(state,seed);
+        ch.Put_Word(msg_request);
+        uint64_t kind,range,attempt,offset,count;
+        while(ch.Flush() && ch.Get_Word(kind)){
+            if(kind==msg_cancel){//of the range being encrypted, or of one that finished meanwhile
+                if(!ch.Get_Word(range) || !ch.Get_Word(attempt)){
+                    break;
+                }
+                remove(Segment(prefix,range,attempt).c_str());
+                ch.Put_Word(msg_cancelled);
+                ch.Put_Word(range);
+                ch.Put_Word(attempt);
+                continue;
+            }
+            if(kind!=msg_range || !ch.Get_Word(range) || !ch.Get_Word(attempt) || !ch.Get_Word(offset) || !ch.Get_Word(count)){
+                break;
+            }
+            outcome result=Encrypt_Range(input,offset,count,Segment(prefix,range,attempt),g_table,h_tables,state,&ch);
+            if(result==range_interrupted){
+                continue;//the pending message is read by the loop
+            }
+            ch.Put_Word(result==range_complete?msg_complete:msg_failed);
+            ch.Put_Word(range);
+            ch.Put_Word(attempt);
+        }
+        fclose(input);
+        gmp_randclear(state);
+        ch.Close();
+    }
+    //serve coordinators that connect to the Unix socket at path, one after the other
+    static bool Listen(const char* path){
+        return socket_channel::Listen(path,Serve);
+    }
+};
+
+/*batch_encrypt_coordinator splits an input file into ranges of range_records records and
+hands them out to workers on demand, so fast workers simply take more ranges. When no range is
+left to hand out, an idle worker instead gets a second copy of a range that has been running
+for more than straggler_factor times the average range time; whichever copy finishes first is
+kept, and the workers still running the other copy are sent a cancel. A worker answers every
+cancel with msg_cancelled, whether it abandoned the range or had already finished it, and removes
+the losing segment; the coordinator removes it as well, in case the worker runs elsewhere. A range
+that a worker reports as failed goes back to the open ranges for the other workers, and the job
+is abandoned only once every live worker has failed some range. At the end the coordinator writes
+output.index, which lists for every range, in input order, its first record, its number of
+records and its segment file; Read_Index reads it back.
+*/
+class batch_encrypt_coordinator{
+private:
+    struct range{
+        uint64_t first;//index of the first record
+        uint64_t count;
+        uint64_t offset;//byte offset of the first record in the input
+        unsigned int running;//attempts in flight
+        uint64_t attempts;//attempts started so far
+        int64_t winner;//attempt whose segment is kept, -1 while the range is open
+        std::chrono::steady_clock::time_point started;
+        std::vector<bool> failed_on;//workers that reported the range as failed
+    };
+    FE_inner_product_DDH& fe;
+    std::vector<socket_channel> workers;
+    std::vector<pid_t> children;
+    //index the input: one range per range_records lines
+    bool Split(const std::string& input, std::vector<range>& ranges){
+        FILE* f=fopen(input.c_str(),"r");
+        if(f==NULL){
+            return false;
+        }
+        uint64_t offset=0,record=0;
+        bool line_start=true;
+        int c;
+        while((c=fgetc(f))!=EOF){
+            if(line_start && c!='\n'){
+                if(record%range_records==0){
+                    ranges.push_back(range{record,0,offset,0,0,-1,std::chrono::steady_clock::time_point(),std::vector<bool>(workers.size(),false)});
+                }
+                ranges.back().count++;
+                record++;
+                line_start=false;
+            }
+            if(c=='\n'){
+                line_start=true;
+            }
+            offset++;
+        }
+        fclose(f);
+        return true;
+    }
+    //whether range r is open and every live worker has failed it
+    static bool Hopeless(const range& r, const std::vector<bool>& alive){
+        for(size_t w=0;w<alive.size();w++){
+            if(alive[w] && !r.failed_on[w]){
+                return false;
+            }
+        }
+        return true;
+    }
+public:
+    struct index_entry{
+        uint64_t first;//index of the first record of the range
+        uint64_t count;
+        std::string segment;
+    };
+    uint64_t range_records=4096;//records per range
+    double straggler_factor=2.0;//a range is a straggler once it runs this many times longer than the average
+    batch_encrypt_coordinator(FE_inner_product_DDH& scheme, const std::vector<int>& fds):fe(scheme){
+        for(size_t w=0;w<fds.size();w++){
+            workers.emplace_back(fds[w]);
+        }
+    }
+    //start count local worker processes
+    batch_encrypt_coordinator(FE_inner_product_DDH& scheme, unsigned int count):fe(scheme){
+        for(unsigned int w=0;w<count;w++){
+            int fd;
+            pid_t pid=socket_channel::Spawn(batch_encrypt_worker::Serve,workers,fd);
+            if(pid<0){
+                break;
+            }
+            children.push_back(pid);
+            workers.emplace_back(fd);
+        }
+    }
+    batch_encrypt_coordinator(const batch_encrypt_coordinator&)=delete;
+    batch_encrypt_coordinator& operator=(const batch_encrypt_coordinator&)=delete;
+    ~batch_encrypt_coordinator(){
+        for(size_t w=0;w<workers.size();w++){
+            workers[w].Close();
+        }
+        for(size_t c=0;c<children.size();c++){
+            waitpid(children[c],NULL,0);
+        }
+    }
+    /*encrypt every message of input into segments named after output, and write output.index.
+    Returns false, and removes the segments, if every live worker fails a range or all workers are lost.
+    */
+    bool Run(const std::string& input, const std::string& output){
+        std::vector<range> ranges;
+        if(workers.empty() || !Split(input,ranges)){
+            return false;
+        }
+        for(size_t w=0;w<workers.size();w++){
+            workers[w].Put_Word(fe.Length());
+            for(unsigned int i=0;i<fe.Length();i++){
+                workers[w].Put_Mpz(fe.key_gen[i].h);
+            }
+            workers[w].Put_Word(gmp_urandomb_ui(ElGamal_Client::param.state,sizeof(unsigned long)*CHAR_BIT));
+            workers[w].Put_String(input);
+            workers[w].Put_String(output);
+            workers[w].Flush();
+        }
+        std::deque<size_t> open;//ranges that no worker has started
+        for(size_t r=0;r<ranges.size();r++){
+            open.push_back(r);
+        }
+        std::vector<bool> alive(workers.size(),true),idle(workers.size(),false);
+        std::vector<bool> cancelling(workers.size(),false);//a cancel was sent and msg_cancelled has not come back
+        std::vector<int64_t> busy(workers.size(),-1);//range a worker is encrypting
+        std::vector<uint64_t> busy_attempt(workers.size(),0);
+        size_t remaining=ranges.size(),live=workers.size();
+        double total_seconds=0;
+        size_t timed=0;
+        bool failed=false;
+        while(remaining>0 && live>0 && !failed){
+            std::vector<pollfd> fds;
+            std::vector<size_t> who;
+            for(size_t w=0;w<workers.size();w++){
+                if(alive[w] && !idle[w]){
+                    fds.push_back(pollfd{workers[w].Fd(),POLLIN,0});
+                    who.push_back(w);
+                }
+            }
+            if(!fds.empty() && poll(fds.data(),fds.size(),50)<0 && errno!=EINTR){
+                break;
+            }
+            for(size_t k=0;k<fds.size();k++){
+                if(fds[k].revents==0){
+                    continue;
+                }
+                size_t w=who[k];
+                uint64_t kind,r,attempt;
+                if(!workers[w].Get_Word(kind) || (kind!=batch_encrypt_worker::msg_request && (!workers[w].Get_Word(r) || !workers[w].Get_Word(attempt)))){
+                    alive[w]=false;//the worker is gone; its range goes back to the open ranges
+                    live--;
+                    if(busy[w]>=0 && --ranges[busy[w]].running==0 && ranges[busy[w]].winner<0){
+                        open.push_front(busy[w]);
+                    }
+                    continue;
+                }
+                if(kind==batch_encrypt_worker::msg_cancelled){
+                    if(busy[w]>=0){//abandoned in the middle, so no msg_complete will come
+                        ranges[busy[w]].running--;
+                        busy[w]=-1;
+                    }
+                    remove(batch_encrypt_worker::Segment(output,r,attempt).c_str());
+                    cancelling[w]=false;
+                    idle[w]=true;
+                    continue;
+                }
+                if(kind==batch_encrypt_worker::msg_complete || kind==batch_encrypt_worker::msg_failed){
+                    range& rg=ranges[r];
+                    rg.running--;
+                    if(rg.winner>=0){
+                        remove(batch_encrypt_worker::Segment(output,r,attempt).c_str());//a slower copy of a finished range
+                    }else if(kind==batch_encrypt_worker::msg_failed){//let another worker try the range
+                        remove(batch_encrypt_worker::Segment(output,r,attempt).c_str());
+                        rg.failed_on[w]=true;
+                        if(rg.running==0){
+                            open.push_front(r);
+                        }
+                    }else{
+                        rg.winner=(int64_t)attempt;
+                        remaining--;
+                        total_seconds+=std::chrono::duration<double>(std::chrono::steady_clock::now()-rg.started).count();
+                        timed++;
+                        for(size_t v=0;v<workers.size();v++){//cancel the other copies
+                            if(v!=w && alive[v] && busy[v]==(int64_t)r && !cancelling[v]){
+                                workers[v].Put_Word(batch_encrypt_worker::msg_cancel);
+                                workers[v].Put_Word(r);
+                                workers[v].Put_Word(busy_attempt[v]);
+                                workers[v].Flush();
+                                cancelling[v]=true;
+                            }
+                        }
+                    }
+                }
+                busy[w]=-1;
+                idle[w]=!cancelling[w];
+            }
+            for(size_t k=0;k<open.size() && !failed;k++){
+                failed=Hopeless(ranges[open[k]],alive);
+            }
+            //hand out open ranges first, then second copies of stragglers; a worker never gets a range it failed
+            std::chrono::steady_clock::time_point now=std::chrono::steady_clock::now();
+            for(size_t w=0;w<workers.size() && !failed;w++){
+                if(!alive[w] || !idle[w]){
+                    continue;
+                }
+                int64_t r=-1;
+                for(size_t k=0;k<open.size() && r<0;k++){
+                    if(!ranges[open[k]].failed_on[w]){
+                        r=(int64_t)open[k];
+                        open.erase(open.begin()+k);
+                    }
+                }
+                if(r<0 && timed>0){
+                    double average=total_seconds/timed;
+                    double oldest=0;
+                    for(size_t k=0;k<ranges.size();k++){
+                        double age=std::chrono::duration<double>(now-ranges[k].started).count();
+                        if(ranges[k].winner<0 && ranges[k].running==1 && !ranges[k].failed_on[w] && age>straggler_factor*average && age>oldest){
+                            r=(int64_t)k;
+                            oldest=age;
+                        }
+                    }
+                }
+                if(r<0){
+                    continue;
+                }
+                range& rg=ranges[r];
+                if(rg.running==0){
+                    rg.started=now;
+                }
+                rg.running++;
+                busy[w]=r;
+                busy_attempt[w]=rg.attempts++;
+                idle[w]=false;
+                workers[w].Put_Word(batch_encrypt_worker::msg_range);
+                workers[w].Put_Word((uint64_t)r);
+                workers[w].Put_Word(busy_attempt[w]);
+                workers[w].Put_Word(rg.offset);
+                workers[w].Put_Word(rg.count);
+                workers[w].Flush();
+            }
+        }
+        //release the workers. Local workers still busy on a losing copy are stopped, and their segments removed.
+        for(size_t w=0;w<workers.size();w++){
+            if(alive[w]){
+                workers[w].Put_Word(batch_encrypt_worker::msg_done);
+                workers[w].Flush();
+            }
+            if(alive[w] && busy[w]>=0 && w<children.size()){
+                kill(children[w],SIGTERM);
+                waitpid(children[w],NULL,0);//so that it cannot write a segment after the clean-up below
+            }
+        }
+        for(size_t r=0;r<ranges.size();r++){
+            for(uint64_t a=0;a<ranges[r].attempts;a++){
+                if((int64_t)a!=ranges[r].winner || remaining>0){//a failed job leaves no segments
+                    remove(batch_encrypt_worker::Segment(output,r,a).c_str());
+                }
+            }
+        }
+        if(remaining>0){
+            return false;
+        }
+        FILE* index=fopen((output+".index").c_str(),"w");
+        if(index==NULL){
+            return false;
+        }
+        for(size_t r=0;r<ranges.size();r++){
+            fprintf(index,"%llu %llu %s\n",(unsigned long long)ranges[r].first,(unsigned long long)ranges[r].count,batch_encrypt_worker::Segment(output,r,ranges[r].winner).c_str());
+        }
+        return fclose(index)==0;
+    }
+    /*read output.index into entries. Every line must be complete and hold the first record, the
+    count and the segment; the ranges must follow each other without gaps. A truncated or
+    malformed index is reported by returning false, with entries holding the lines read so far.
+    */
+    static bool Read_Index(const std::string& output, std::vector<index_entry>& entries){
+        FILE* index=fopen((output+".index").c_str(),"r");
+        if(index==NULL){
+            return false;
+        }
+        char* line=NULL;
+        size_t capacity=0;
+        ssize_t got;
+        bool ok=true;
+        while(ok && (got=getline(&line,&capacity,index))>0){
+            unsigned long long first,count;
+            int used=0;
+            ok=line[got-1]=='\n' && sscanf(line,"%llu %llu %n",&first,&count,&used)==2 && used>0 && used<got-1;
+            ok=ok && count>0 && first==(entries.empty()?0:entries.back().first+entries.back().count);
+            if(ok){
+                entries.push_back(index_entry{first,count,std::string(line+used,got-1-used)});
+            }
+        }
+        ok=ok && !ferror(index);
+        free(line);
+        fclose(index);
+        return ok;
+    }
+};
+
+/*A compact container for batches of cipher texts. Every group element is stored in exactly
+bits(p) bits (7 bits for p = 73) in one continuous bit stream per block, so there is no padding
+between elements or records. Records carry strictly increasing ids, stored per block as the
+first id followed by the gaps. The layout is
+
+    header: "FEC1", bits, l, block_records, records, blocks          (varints after the magic)
+    index:  per block, first id - first id of the previous block, and the size of the block in bytes
+    blocks: per block, the id gaps - 1 as varints, then the packed elements Ct_{0}, ..., Ct_{l} of each record
+    8 zero bytes, so that readers can always load a whole 64-bit word
+
+A reader parses the header and the index only, and decodes any block on its own.
+*/
+class ciphertext_writer{
+private:
+    unsigned int vec_len;
+    unsigned int bits;//bits of one element
+    size_t block_records;
+    std::vector<std::string> blocks;
+    std::vector<uint64_t> first_ids;
+    std::string ids,packed;//the block being filled
+    uint64_t last_id;
+    size_t records,in_block;
+    uint64_t acc;//bits not yet flushed to packed
+    unsigned int acc_bits;
+    void Put_Bits(uint64_t v, unsigned int n){//n <= 32
+        acc|=v<<acc_bits;
+        acc_bits+=n;
+        while(acc_bits>=8){
+            packed.push_back((char)(acc&0xff));
+            acc>>=8;
+            acc_bits-=8;
+        }
+    }
+    void Put_Element(const mpz_t x){
+        for(unsigned int off=0;off<bits;off+=32){
+            unsigned int n=bits-off<32?bits-off:32;
+            uint64_t limb=mpz_getlimbn(x,off/GMP_NUMB_BITS);
+            Put_Bits((limb>>(off%GMP_NUMB_BITS))&((((uint64_t)1)<<n)-1),n);
+        }
+    }
+    void End_Block(){
+        if(in_block==0){
+            return;
+        }
+        if(acc_bits>0){
+            packed.push_back((char)(acc&0xff));
+        }
+        acc=0;acc_bits=0;
+        blocks.push_back(ids+packed);
+        ids.clear();packed.clear();
+        in_block=0;
+    }
+public:
+    ciphertext_writer(unsigned int len, const mpz_t p, size_t block=1024){
+        vec_len=len;
+        bits=(unsigned int)mpz_sizeinbase(p,2);
+        block_records=block;
+        last_id=0;records=0;in_block=0;acc=0;acc_bits=0;
+    }
+    static void Put_Varint(std::string& out, uint64_t v){
+        while(v>=0x80){
+            out.push_back((char)((v&0x7f)|0x80));
+            v>>=7;
+        }
+        out.push_back((char)v);
+    }
+    //append the record id; ids must be strictly increasing. Returns false if id is out of order.
+    bool Add(uint64_t id, const cipher_text_FE& ct){
+        if(records>0 && id<=last_id){
+            return false;
+        }
+        if(in_block==0){
+            first_ids.push_back(id);
+        }else{
+            Put_Varint(ids,id-last_id-1);
+        }
+        Put_Element(ct.c0);
+        for(unsigned int i=0;i<vec_len;i++){
+            Put_Element(ct.c1[i]);
+        }
+        last_id=id;
+        records++;
+        if(++in_block==block_records){
+            End_Block();
+        }
+        return true;
+    }
+    //the whole container; the writer is empty afterwards
+    std::string Finish(){
+        End_Block();
+        std::string out("FEC1");
+        Put_Varint(out,bits);
+        Put_Varint(out,vec_len);
+        Put_Varint(out,block_records);
+        Put_Varint(out,records);
+        Put_Varint(out,blocks.size());
+        for(size_t b=0;b<blocks.size();b++){
+            Put_Varint(out,first_ids[b]-(b==0?0:first_ids[b-1]));
+            Put_Varint(out,blocks[b].size());
+        }
+        for(size_t b=0;b<blocks.size();b++){
+            out+=blocks[b];
+        }
+        out.append(8,'\0');
+        blocks.clear();first_ids.clear();
+        records=0;last_id=0;
+        return out;
+    }
+};
+
+class ciphertext_reader{
+private:
+    const uint8_t* data;
+    size_t size;
+    std::vector<size_t> offsets;//offsets[b] is the start of block b, offsets[blocks] the end of the last one
+    static uint64_t Load(const uint8_t* at){
+        uint64_t v;
+        memcpy(&v,at,sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+        v=__builtin_bswap64(v);
+#endif
+        return v;
+    }
+    //n <= 56 bits starting at bit pos of the block at base
+    static uint64_t Get_Bits(const uint8_t* base, uint64_t pos, unsigned int n){
+        return (Load(base+(pos>>3))>>(pos&7))&((((uint64_t)1)<<n)-1);
+    }
+    bool Get_Varint(size_t& at, size_t end, uint64_t& v) const{
+        v=0;
+        for(unsigned int shift=0;at<end && shift<64;shift+=7){
+            uint8_t byte=data[at++];
+            v|=(uint64_t)(byte&0x7f)<<shift;
+            if((byte&0x80)==0){
+                return true;
+            }
+        }
+        return false;
+    }
+public:
+    unsigned int bits,vec_len;
+    size_t block_records,records;
+    std::vector<uint64_t> first_ids;//first id of every block
+    ciphertext_reader(){
+        data=NULL;size=0;bits=0;vec_len=0;block_records=0;records=0;
+    }
+    /*parse the header and the index of a container held in bytes, which must stay alive while the
+    reader is used. Returns false if it is not a well-formed container.
+    */
+    bool Open(const std::string& bytes){
+        data=(const uint8_t*)bytes.data();
+        size=bytes.size();
+        offsets.clear();first_ids.clear();
+        size_t at=4;
+        uint64_t b,l,block,count,blocks;
+        if(size<12 || memcmp(data,"FEC1",4)!=0 || !Get_Varint(at,size,b) || !Get_Varint(at,size,l) ||
+            !Get_Varint(at,size,block) || !Get_Varint(at,size,count) || !Get_Varint(at,size,blocks)){
+            return false;
+        }
+        if(b==0 || b>4096 || block==0 || blocks!=(count+block-1)/block){
+            return false;
+        }
+        bits=(unsigned int)b;vec_len=(unsigned int)l;
+        block_records=block;records=count;
+        std::vector<uint64_t> lengths(blocks);
+        uint64_t id=0;
+        for(size_t k=0;k<blocks;k++){
+            uint64_t delta;
+            if(!Get_Varint(at,size,delta) || !Get_Varint(at,size,lengths[k])){
+                return false;
+            }
+            id+=delta;
+            first_ids.push_back(id);
+        }
+        offsets.push_back(at);
+        for(size_t k=0;k<blocks;k++){
+            if(lengths[k]>size-offsets.back()){
+                return false;
+            }
+            offsets.push_back(offsets.back()+lengths[k]);
+        }
+        return size-offsets.back()>=8;//the trailing zero bytes
+    }
+    size_t Blocks() const{
+        return first_ids.size();
+    }
+    size_t Block_Records(size_t block) const{
+        return block+1<Blocks()?block_records:records-block*block_records;
+    }
+    /*decode block number block into ids and cts. Cipher texts that already have room for vec_len
+    components are reused, so decoding blocks in a loop does not allocate. Returns false on a
+    damaged block.
+    */
+    bool Read_Block(size_t block, std::vector<uint64_t>& ids, std::vector<cipher_text_FE>& cts) const{
+        if(block>=Blocks()){
+            return false;
+        }
+        size_t count=Block_Records(block);
+        size_t at=offsets[block],end=offsets[block+1];
+        ids.resize(count);
+        ids[0]=first_ids[block];
+        for(size_t k=1;k<count;k++){
+            uint64_t gap;
+            if(!Get_Varint(at,end,gap)){
+                return false;
+            }
+            ids[k]=ids[k-1]+gap+1;
+        }
+        size_t elements=count*(vec_len+1);
+        if(((uint64_t)elements*bits+7)/8>end-at){
+            return false;
+        }
+        while(cts.size()<count){
+            cts.emplace_back(vec_len);
+        }
+        const uint8_t* base=data+at;
+        uint64_t pos=0;
+        std::vector<mp_limb_t> limbs((bits+GMP_NUMB_BITS-1)/GMP_NUMB_BITS);
+        for(size_t k=0;k<count;k++){
+            for(unsigned int i=0;i<=vec_len;i++,pos+=bits){
+                mpz_ptr rop=(i==0)?cts[k].c0:cts[k].c1[i-1];
+                if(bits<=56){
+                    mpz_set_ui(rop,(unsigned long)Get_Bits(base,pos,bits));
+                    continue;
+                }
+                std::fill(limbs.begin(),limbs.end(),0);
+                for(unsigned int off=0;off<bits;off+=32){
+                    unsigned int n=bits-off<32?bits-off:32;
+                    limbs[off/GMP_NUMB_BITS]|=(mp_limb_t)Get_Bits(base,pos+off,n)<<(off%GMP_NUMB_BITS);
+                }
+                mpz_import(rop,limbs.size(),-1,sizeof(mp_limb_t),0,0,limbs.data());
+            }
+        }
+        return true;
+    }
+    //the block that holds id, if any: the last block whose first id is <= id
+    size_t Find_Block(uint64_t id) const{
+        size_t lo=0,hi=Blocks();
+        while(lo<hi){
+            size_t mid=(lo+hi)/2;
+            if(first_ids[mid]<=id){
+                lo=mid+1;
+            }else{
+                hi=mid;
+            }
+        }
+        return lo==0?Blocks():lo-1;
+    }
+};
+
+/*similarity_search scores an encrypted database against one query key y and returns the best
+matches: those with <x,y> >= threshold, the k highest of them if k > 0. Most records score
+below the threshold, so the full discrete log is not taken for every decryption. The predicate
+table, a blocked_bloom of the elements g^s for threshold <= s < the dlog bound, tells which
+decryptions may reach the threshold; only those survivors go to the dlog_table, which also
+drops the few false positives of the filter. Threads keep top-k heaps of their own, merged when
+all are done. If the range above the threshold is too large for the predicate's budget, the
+filter stays empty and every decryption survives.
+*/
+class similarity_search{
+public:
+    struct match{
+        int64_t score;//<x,y>
+        uint64_t id;//position in the batch, or record id in the file
+    };
+private:
+    FE_inner_product_DDH& scheme;
+    const dlog_table& dlog;
+    unsigned long threshold;
+    blocked_bloom predicate;
+    //lower scores first, and among equal scores the later id, so that a heap's top is the worst match
+    static bool Better(const match& a, const match& b){
+        return a.score>b.score || (a.score==b.score && a.id<b.id);
+    }
+    //decrypt ct and, if it survives the predicate and the threshold, offer it to the heap of at most k matches
+    void Score(cipher_text_FE& ct, uint64_t id, const decrypt_plan& plan, size_t k, std::vector<match>& heap, mp_limb_t* buf, mpz_t log, size_t& survivors) const{
+        plain_text pt=scheme.Decrypt(ct,plan);
+        dlog.Pad(pt.msg,buf);
+        bool pass=predicate.Contains(dlog_table::Hash(buf,dlog.limbs));
+        if(pass){
+            survivors++;
+            pass=dlog.Lookup(log,pt.msg) && mpz_cmp_ui(log,threshold)>=0;
+        }
+        mpz_clear(pt.msg);
+        if(!pass){
+            return;
+        }
+        match m={(int64_t)mpz_get_si(log),id};
+        if(k>0 && heap.size()==k){
+            if(!Better(m,heap.front())){
+                return;
+            }
+            std::pop_heap(heap.begin(),heap.end(),Better);
+            heap.pop_back();
+        }
+        heap.push_back(m);
+        std::push_heap(heap.begin(),heap.end(),Better);
+    }
+    //merge the heaps of the threads into the best k matches (all of them if k is 0), best first
+    std::vector<match> Merge(std::vector<std::vector<match>>& heaps, size_t k){
+        std::vector<match> all;
+        for(size_t t=0;t<heaps.size();t++){
+            all.insert(all.end(),heaps[t].begin(),heaps[t].end());
+        }
+        std::sort(all.begin(),all.end(),Better);
+        if(k>0 && all.size()>k){
+            all.resize(k);
+        }
+        return all;
+    }
+public:
+    static const size_t predicate_bytes=((size_t)16)<<20;
+    size_t decrypted,survivors;//counts of the last search
+    similarity_search(FE_inner_product_DDH& fe, const dlog_table& table, const mpz_t g, unsigned long t):scheme(fe),dlog(table){
+        threshold=t;decrypted=0;survivors=0;
+        unsigned long bound=dlog.baby*dlog.giant;
+        unsigned long width=threshold<bound?bound-threshold:0;
+        predicate.Build(width,predicate_bytes);
+        if(predicate.Empty()){
+            return;
+        }
+        std::vector<mp_limb_t> buf(dlog.limbs);
+        mpz_t e;
+        mpz_init(e);
+        mpz_powm_ui(e,g,threshold,dlog.p);
+        for(unsigned long s=0;s<width;s++){
+            dlog.Pad(e,buf.data());
+            predicate.Insert(dlog_table::Hash(buf.data(),dlog.limbs));
+            mpz_mul(e,e,g);
+            mpz_mod(e,e,dlog.p);
+        }
+        mpz_clear(e);
+    }
+    //search the batch cts; the id of a match is its position in cts
+    std::vector<match> Search(std::vector<cipher_text_FE>& cts, const decrypt_plan& plan, size_t k, unsigned int threads=1){
+        threads=threads==0?1:threads;
+        std::vector<std::vector<match>> heaps(threads);
+        std::vector<size_t> passed(threads,0);
+        size_t share=(cts.size()+threads-1)/threads;
+        auto run=[&](unsigned int t){
+            std::vector<mp_limb_t> buf(dlog.limbs);
+            mpz_t log;
+            mpz_init(log);
+            size_t end=(t+1)*share<cts.size()?(t+1)*share:cts.size();
+            for(size_t n=t*share;n<end;n++){
+                Score(cts[n],n,plan,k,heaps[t],buf.data(),log,passed[t]);
+            }
+            mpz_clear(log);
+        };
+        std::vector<std::thread> pool;
+        for(unsigned int t=1;t<threads;t++){
+            pool.emplace_back(run,t);
+        }
+        run(0);
+        for(size_t t=0;t<pool.size();t++){
+            pool[t].join();
+        }
+        decrypted=cts.size();
+        survivors=0;
+        for(unsigned int t=0;t<threads;t++){
+            survivors+=passed[t];
+        }
+        return Merge(heaps,k);
+    }
+    /*search every record of a container; the id of a match is its record id. The threads take
+    blocks in turn, each decoding into cipher texts of its own. A damaged block is skipped.
+    */
+    std::vector<match> Search(const ciphertext_reader& reader, const decrypt_plan& plan, size_t k, unsigned int threads=1){
+        threads=threads==0?1:threads;
+        std::vector<std::vector<match>> heaps(threads);
+        std::vector<size_t> passed(threads,0),read(threads,0);
+        std::atomic<size_t> next(0);
+        auto run=[&](unsigned int t){
+            std::vector<mp_limb_t> buf(dlog.limbs);
+            std::vector<uint64_t> ids;
+            std::vector<cipher_text_FE> cts;
+            mpz_t log;
+            mpz_init(log);
+            for(size_t b=next++;b<reader.Blocks();b=next++){
+                if(!reader.Read_Block(b,ids,cts)){
+                    continue;
+                }
+                for(size_t n=0;n<ids.size();n++){
+                    Score(cts[n],ids[n],plan,k,heaps[t],buf.data(),log,passed[t]);
+                }
+                read[t]+=ids.size();
+            }
+            mpz_clear(log);
+        };
+        std::vector<std::thread> pool;
+        for(unsigned int t=1;t<threads;t++){
+            pool.emplace_back(run,t);
+        }
+        run(0);
+        for(size_t t=0;t<pool.size();t++){
+            pool[t].join();
+        }
+        decrypted=0;survivors=0;
+        for(unsigned int t=0;t<threads;t++){
+            decrypted+=read[t];
+            survivors+=passed[t];
+        }
+        return Merge(heaps,k);
+    }
+};
+
+/*The classes below run inner product functional encryption over a prime-order elliptic curve
+instead of Z_{p}^{*}. The group operation becomes point addition, exponentiation becomes scalar
+multiplication, and the product in Decrypt becomes the multi-scalar multiplication
+Sum y_{i} * Ct_{i}. Field elements are kept in Montgomery form in a fixed number of limbs, so
+that no GMP allocation happens inside the point arithmetic.
+*/
+static const int fp_limbs=4;//curve fields of up to 256 bits
+static_assert(GMP_NUMB_BITS==64,"the curve backend assumes 64-bit limbs without nails");
+
+//an element of the curve's base field, in Montgomery form
+class fp_elem{
+public:
+    mp_limb_t v[fp_limbs];
+};
+
+//a point in affine coordinates (x, y); the point at infinity has infinity set
+class ec_affine{
+public:
+    fp_elem x,y;
+    bool infinity;
+};
+
+//a point in Jacobian coordinates (X, Y, Z), standing for (X/Z^2, Y/Z^3); Z = 0 is the point at infinity
+class ec_point{
+public:
+    fp_elem X,Y,Z;
+};
+
+/*ec_group is a short Weierstrass curve y^2 = x^3 + a*x + b over F_{p} whose group of points has
+prime order n, with generator G. It provides the field arithmetic, the point arithmetic, and
+multi-scalar multiplication.
+*/
+class ec_group{
+public:
+    mpz_t p,a,b,n;
+    ec_affine G;
+    fp_elem one,a_m,b_m;//1, a and b in Montgomery form
+    bool a_zero;//a = 0 saves a multiplication in every doubling
+    /*GLV endomorphism, if the curve has one: phi(x, y) = (beta * x, y) equals lambda * (x, y), and
+    (a1, b1), (a2, b2) is a short basis of the lattice of (k1, k2) with k1 + k2 * lambda = 0 (mod n)
+    */
+    bool glv;
+    fp_elem beta;
+    mpz_t lambda,glv_a1,glv_b1,glv_a2,glv_b2;
+    ec_group(const char* p_hex, const char* a_hex, const char* b_hex, const char* n_hex, const char* gx_hex, const char* gy_hex){
+        mpz_init_set_str(p,p_hex,16);mpz_init_set_str(a,a_hex,16);
+        mpz_init_set_str(b,b_hex,16);mpz_init_set_str(n,n_hex,16);
+        Export(P,p);
+        mp_limb_t inv=1;//Newton iteration for p^(-1) mod 2^64
+        for(int i=0;i<6;i++){
+            inv*=2-P[0]*inv;
+        }
+        pinv=-inv;
+        mpz_t r;
+        mpz_init(r);
+        mpz_setbit(r,2*fp_limbs*GMP_NUMB_BITS);
+        mpz_mod(r,r,p);
+        Export(R2.v,r);
+        mpz_set_ui(r,0);
+        mpz_setbit(r,3*fp_limbs*GMP_NUMB_BITS);
+        mpz_mod(r,r,p);
+        Export(R3.v,r);
+        mpz_clear(r);
+        mpz_t t;
+        mpz_init_set_ui(t,1);
+        To_Field(one,t);
+        To_Field(a_m,a);
+        To_Field(b_m,b);
+        a_zero=(mpz_sgn(a)==0);
+        mpz_add_ui(t,p,1);//square roots are x^((p+1)/4), which needs p = 3 (mod 4)
+        mpz_fdiv_q_2exp(t,t,2);
+        for(long j=((long)mpz_sizeinbase(t,2)+3)/4-1;j>=0;j--){
+            sqrt_digits.push_back((unsigned char)Exponent_Digit(t,(unsigned long)j*4,4));
+        }
+        mpz_set_str(t,gx_hex,16);
+        To_Field(G.x,t);
+        mpz_set_str(t,gy_hex,16);
+        To_Field(G.y,t);
+        G.infinity=false;
+        mpz_clear(t);
+        glv=false;
+        mpz_init(lambda);mpz_init(glv_a1);mpz_init(glv_b1);mpz_init(glv_a2);mpz_init(glv_b2);
+    }
+    ec_group(const ec_group&)=delete;
+    ec_group& operator=(const ec_group&)=delete;
+    //secp256k1, with its GLV endomorphism
+    static const ec_group& Secp256k1(){
+        static ec_group curve("fffffffffffffffffffffffffffffffffffffffffffffffffffffffefffffc2f",
+            "0","7",
+            "fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364141",
+            "79be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+            "483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8");
+        static const bool endomorphism=curve.Set_Endomorphism("7ae96a2b657c07106e64479eac3434e99cf0497512f58995c1396c28719501ee",
+            "5363ad4cc05c30e0a5261c028812645a122e22ea20816678df02967c1b23bd72",
+            "3086d221a7d46bcde86c90e49284eb15","-e4437ed6010e88286f547fa90abfe4c3",
+            "114ca50f7a8e2f3f657c1108d9d44cfd8","3086d221a7d46bcde86c90e49284eb15");
+        (void)endomorphism;
+        return curve;
+    }
+    bool Set_Endomorphism(const char* beta_hex, const char* lambda_hex, const char* a1_hex, const char* b1_hex, const char* a2_hex, const char* b2_hex){
+        mpz_t t;
+        mpz_init_set_str(t,beta_hex,16);
+        To_Field(beta,t);
+        mpz_clear(t);
+        mpz_set_str(lambda,lambda_hex,16);
+        mpz_set_str(glv_a1,a1_hex,16);mpz_set_str(glv_b1,b1_hex,16);
+        mpz_set_str(glv_a2,a2_hex,16);mpz_set_str(glv_b2,b2_hex,16);
+        glv=true;
+        return glv;
+    }
+    //k = k1 + k2 * lambda (mod n) with k1, k2 of about half the bits of n; k1 and k2 may be negative
+    void Decompose(mpz_t k1, mpz_t k2, const mpz_t k) const{
+        mpz_t c1,c2,e,t;
+        mpz_init(c1);mpz_init(c2);mpz_init(e);mpz_init(t);
+        mpz_mod(e,k,n);
+        mpz_mul(c1,glv_b2,e);//c1 = round(b2 * k / n)
+        mpz_fdiv_q_2exp(t,n,1);
+        mpz_add(c1,c1,t);
+        mpz_fdiv_q(c1,c1,n);
+        mpz_neg(c2,glv_b1);//c2 = round(-b1 * k / n)
+        mpz_mul(c2,c2,e);
+        mpz_add(c2,c2,t);
+        mpz_fdiv_q(c2,c2,n);
+        mpz_mul(t,c1,glv_a1);
+        mpz_sub(e,e,t);
+        mpz_submul(e,c2,glv_a2);
+        mpz_mul(t,c1,glv_b1);
+        mpz_neg(k2,t);
+        mpz_submul(k2,c2,glv_b2);
+        mpz_set(k1,e);
+        mpz_clear(c1);mpz_clear(c2);mpz_clear(e);mpz_clear(t);
+    }
+    //r = phi(q) = lambda * q
+    void Endomorphism(ec_affine& r, const ec_affine& q) const{
+        Field_Mul(r.x,q.x,beta);
+        r.y=q.y;
+        r.infinity=q.infinity;
+    }
+    //NIST P-256
+    static const ec_group& P256(){
+        static const ec_group curve("ffffffff00000001000000000000000000000000ffffffffffffffffffffffff",
+            "ffffffff00000001000000000000000000000000fffffffffffffffffffffffc",
+            "5ac635d8aa3a93e7b3ebbd55769886bc651d06b0cc53b0f63bce3c3e27d2604b",
+            "ffffffff00000000ffffffffffffffffbce6faada7179e84f3b9cac2fc632551",
+            "6b17d1f2e12c4247f8bce6e563a440f277037d812deb33a0f4a13945d898c296",
+            "4fe342e2fe1a7f9b8ee7eb4a7c0f9e162bce33576b315ececbb6406837bf51f5");
+        return curve;
+    }
+
+    /*field arithmetic*/
+    void To_Field(fp_elem& r, const mpz_t x) const{
+        mpz_t t;
+        mpz_init(t);
+        mpz_mod(t,x,p);
+        fp_elem raw;
+        Export(raw.v,t);
+        Field_Mul(r,raw,R2);//x * R^2 / R = x * R
+        mpz_clear(t);
+    }
+    void From_Field(mpz_t r, const fp_elem& x) const{
+        mp_limb_t t[2*fp_limbs+1]={0};
+        memcpy(t,x.v,sizeof(x.v));
+        fp_elem raw;
+        Reduce(raw,t);//x * R / R
+        mpz_import(r,fp_limbs,-1,sizeof(mp_limb_t),0,0,raw.v);
+    }
+    void Field_Mul(fp_elem& r, const fp_elem& x, const fp_elem& y) const{
+        mp_limb_t t[2*fp_limbs+1];
+        mpn_mul_n(t,x.v,y.v,fp_limbs);
+        t[2*fp_limbs]=0;
+        Reduce(r,t);
+    }
+    void Field_Sqr(fp_elem& r, const fp_elem& x) const{
+        mp_limb_t t[2*fp_limbs+1];
+        mpn_sqr(t,x.v,fp_limbs);
+        t[2*fp_limbs]=0;
+        Reduce(r,t);
+    }
+    void Field_Add(fp_elem& r, const fp_elem& x, const fp_elem& y) const{
+        mp_limb_t carry=mpn_add_n(r.v,x.v,y.v,fp_limbs);
+        if(carry || mpn_cmp(r.v,P,fp_limbs)>=0){
+            mpn_sub_n(r.v,r.v,P,fp_limbs);
+        }
+    }
+    void Field_Sub(fp_elem& r, const fp_elem& x, const fp_elem& y) const{
+        if(mpn_sub_n(r.v,x.v,y.v,fp_limbs)){
+            mpn_add_n(r.v,r.v,P,fp_limbs);
+        }
+    }
+    void Field_Neg(fp_elem& r, const fp_elem& x) const{
+        if(Field_Is_Zero(x)){
+            r=x;
+        }else{
+            mpn_sub_n(r.v,P,x.v,fp_limbs);
+        }
+    }
+    //r = x^(-1); x must not be 0. Field inversions are expensive: batch them where possible.
+    void Field_Inv(fp_elem& r, const fp_elem& x) const{
+        mpz_t t,xr;
+        mpz_init(t);
+        mpz_roinit_n(xr,x.v,fp_limbs);
+        mpz_invert(t,xr,p);//(x*R)^(-1)
+        fp_elem raw;
+        Export(raw.v,t);
+        Field_Mul(r,raw,R3);//(x*R)^(-1) * R^3 / R = x^(-1) * R
+        mpz_clear(t);
+    }
+    bool Field_Is_Zero(const fp_elem& x) const{
+        return mpn_zero_p(x.v,fp_limbs);
+    }
+    bool Field_Equal(const fp_elem& x, const fp_elem& y) const{
+        return mpn_cmp(x.v,y.v,fp_limbs)==0;
+    }
+
+    /*point arithmetic*/
+    void Set_Infinity(ec_point& r) const{
+        r.X=one;r.Y=one;
+        memset(r.Z.v,0,sizeof(r.Z.v));
+    }
+    bool Is_Infinity(const ec_point& r) const{
+        return Field_Is_Zero(r.Z);
+    }
+    void From_Affine(ec_point& r, const ec_affine& q) const{
+        if(q.infinity){
+            Set_Infinity(r);
+        }else{
+            r.X=q.x;r.Y=q.y;r.Z=one;
+        }
+    }
+    void To_Affine(ec_affine& r, const ec_point& q) const{
+        if(Is_Infinity(q)){
+            r.infinity=true;
+            return;
+        }
+        fp_elem zi,zi2;
+        Field_Inv(zi,q.Z);
+        Field_Sqr(zi2,zi);
+        Field_Mul(r.x,q.X,zi2);
+        Field_Mul(zi2,zi2,zi);
+        Field_Mul(r.y,q.Y,zi2);
+        r.infinity=false;
+    }
+    void Negate(ec_affine& r, const ec_affine& q) const{
+        r.x=q.x;
+        Field_Neg(r.y,q.y);
+        r.infinity=q.infinity;
+    }
+    /*Batch_To_Affine converts count points with a single field inversion (Montgomery's trick):
+    the Z coordinates are multiplied together, the product is inverted once, and each 1/Z is
+    peeled off on the way back. Points at infinity are skipped.
+    */
+    void Batch_To_Affine(ec_affine* out, const ec_point* in, size_t count) const{
+        std::vector<fp_elem> prefix(count);
+        fp_elem acc=one;
+        for(size_t i=0;i<count;i++){
+            prefix[i]=acc;
+            if(!Is_Infinity(in[i])){
+                Field_Mul(acc,acc,in[i].Z);
+            }
+        }
+        fp_elem inv,zi,zi2;
+        Field_Inv(inv,acc);
+        for(size_t i=count;i-->0;){
+            if(Is_Infinity(in[i])){
+                out[i].infinity=true;
+                continue;
+            }
+            Field_Mul(zi,inv,prefix[i]);
+            Field_Mul(inv,inv,in[i].Z);
+            Field_Sqr(zi2,zi);
+            Field_Mul(out[i].x,in[i].X,zi2);
+            Field_Mul(zi2,zi2,zi);
+            Field_Mul(out[i].y,in[i].Y,zi2);
+            out[i].infinity=false;
+        }
+    }
+    /*Field_Sqrt sets r_{i} to a square root of x_{i} for count elements and reports whether all of
+    them are squares. With p = 3 (mod 4) the root is x^((p+1)/4). The elements are exponentiated
+    in lockstep, a block at a time: the 4-bit window schedule of the fixed exponent is walked
+    once per block, and each squaring or multiplication runs across all lanes of the block.
+    */
+    bool Field_Sqrt(fp_elem* r, const fp_elem* x, size_t count) const{
+        static const size_t lanes=8;
+        fp_elem table[lanes][16];
+        bool all=true;
+        for(size_t base=0;base<count;base+=lanes){
+            size_t m=count-base<lanes?count-base:lanes;
+            for(size_t j=0;j<m;j++){
+                table[j][0]=one;
+                for(int d=1;d<16;d++){
+                    Field_Mul(table[j][d],table[j][d-1],x[base+j]);
+                }
+                r[base+j]=one;
+            }
+            for(size_t w=0;w<sqrt_digits.size();w++){
+                for(size_t j=0;j<m;j++){
+                    if(w>0){
+                        for(int s=0;s<4;s++){
+                            Field_Sqr(r[base+j],r[base+j]);
+                        }
+                    }
+                    if(sqrt_digits[w]!=0){
+                        Field_Mul(r[base+j],r[base+j],table[j][sqrt_digits[w]]);
+                    }
+                }
+            }
+            fp_elem t;
+            for(size_t j=0;j<m;j++){
+                Field_Sqr(t,r[base+j]);
+                all=all && Field_Equal(t,x[base+j]);
+            }
+        }
+        return all;
+    }
+
+    /*compressed encoding: a point takes point_bytes bytes, a tag (2 for even y, 3 for odd y, 0 for
+    the point at infinity) followed by x as a big-endian integer
+    */
+    static const size_t point_bytes=1+fp_limbs*sizeof(mp_limb_t);
+    void Encode(unsigned char* out, const ec_affine* points, size_t count) const{
+        mpz_t t;
+        mpz_init(t);
+        for(size_t i=0;i<count;i++,out+=point_bytes){
+            memset(out,0,point_bytes);
+            if(points[i].infinity){
+                continue;
+            }
+            From_Field(t,points[i].y);
+            out[0]=mpz_odd_p(t)?3:2;
+            From_Field(t,points[i].x);
+            size_t len=(mpz_sizeinbase(t,2)+7)/8;
+            mpz_export(out+point_bytes-len,NULL,1,1,1,0,t);
+        }
+        mpz_clear(t);
+    }
+    //decode count points written by Encode; false if any of them is malformed or not on the curve
+    bool Decode(ec_affine* points, const unsigned char* in, size_t count) const{
+        std::vector<fp_elem> rhs(count),roots(count);
+        mpz_t t;
+        mpz_init(t);
+        bool valid=true;
+        const unsigned char* at=in;
+        for(size_t i=0;i<count;i++,at+=point_bytes){
+            points[i].infinity=(at[0]==0);
+            mpz_import(t,point_bytes-1,1,1,1,0,at+1);
+            if(points[i].infinity){
+                valid=valid && mpz_sgn(t)==0;
+                rhs[i]=one;
+                continue;
+            }
+            valid=valid && (at[0]==2 || at[0]==3) && mpz_cmp(t,p)<0;
+            To_Field(points[i].x,t);
+            Field_Sqr(rhs[i],points[i].x);
+            Field_Add(rhs[i],rhs[i],a_m);
+            Field_Mul(rhs[i],rhs[i],points[i].x);
+            Field_Add(rhs[i],rhs[i],b_m);
+        }
+        valid=valid && Field_Sqrt(roots.data(),rhs.data(),count);
+        at=in;
+        for(size_t i=0;i<count && valid;i++,at+=point_bytes){
+            if(points[i].infinity){
+                continue;
+            }
+            From_Field(t,roots[i]);
+            if((mpz_odd_p(t)?3:2)==at[0]){
+                points[i].y=roots[i];
+            }else{
+                Field_Neg(points[i].y,roots[i]);
+            }
+        }
+        mpz_clear(t);
+        return valid;
+    }
+    bool On_Curve(const ec_affine& q) const{
+        if(q.infinity){
+            return true;
+        }
+        fp_elem lhs,rhs,t;
+        Field_Sqr(lhs,q.y);
+        Field_Sqr(t,q.x);
+        Field_Add(t,t,a_m);
+        Field_Mul(rhs,t,q.x);
+        Field_Add(rhs,rhs,b_m);
+        return Field_Equal(lhs,rhs);
+    }
+    //r = 2q (dbl-2007-bl)
+    void Point_Double(ec_point& r, const ec_point& q) const{
+        if(Is_Infinity(q) || Field_Is_Zero(q.Y)){
+            Set_Infinity(r);
+            return;
+        }
+        fp_elem XX,YY,YYYY,ZZ,S,M,T,t;
+        Field_Sqr(XX,q.X);
+        Field_Sqr(YY,q.Y);
+        Field_Sqr(YYYY,YY);
+        Field_Sqr(ZZ,q.Z);
+        Field_Add(S,q.X,YY);
+        Field_Sqr(S,S);
+        Field_Sub(S,S,XX);
+        Field_Sub(S,S,YYYY);
+        Field_Add(S,S,S);
+        Field_Add(M,XX,XX);
+        Field_Add(M,M,XX);
+        if(!a_zero){
+            Field_Sqr(t,ZZ);
+            Field_Mul(t,t,a_m);
+            Field_Add(M,M,t);
+        }
+        Field_Sqr(T,M);
+        Field_Sub(T,T,S);
+        Field_Sub(T,T,S);
+        Field_Add(t,q.Y,q.Z);
+        Field_Sqr(t,t);
+        Field_Sub(t,t,YY);
+        Field_Sub(r.Z,t,ZZ);
+        Field_Sub(t,S,T);
+        Field_Mul(t,M,t);
+        Field_Add(YYYY,YYYY,YYYY);
+        Field_Add(YYYY,YYYY,YYYY);
+        Field_Add(YYYY,YYYY,YYYY);
+        Field_Sub(r.Y,t,YYYY);
+        r.X=T;
+    }
+    //r = q1 + q2 (add-2007-bl)
+    void Point_Add(ec_point& r, const ec_point& q1, const ec_point& q2) const{
+        if(Is_Infinity(q1)){
+            r=q2;
+            return;
+        }
+        if(Is_Infinity(q2)){
+            r=q1;
+            return;
+        }
+        fp_elem Z1Z1,Z2Z2,U1,U2,S1,S2,H,R,I,J,V,t;
+        Field_Sqr(Z1Z1,q1.Z);
+        Field_Sqr(Z2Z2,q2.Z);
+        Field_Mul(U1,q1.X,Z2Z2);
+        Field_Mul(U2,q2.X,Z1Z1);
+        Field_Mul(S1,q1.Y,q2.Z);
+        Field_Mul(S1,S1,Z2Z2);
+        Field_Mul(S2,q2.Y,q1.Z);
+        Field_Mul(S2,S2,Z1Z1);
+        Field_Sub(H,U2,U1);
+        Field_Sub(R,S2,S1);
+        if(Field_Is_Zero(H)){
+            if(Field_Is_Zero(R)){
+                Point_Double(r,q1);
+            }else{
+                Set_Infinity(r);
+            }
+            return;
+        }
+        Field_Add(R,R,R);
+        Field_Add(I,H,H);
+        Field_Sqr(I,I);
+        Field_Mul(J,H,I);
+        Field_Mul(V,U1,I);
+        Field_Add(t,q1.Z,q2.Z);
+        Field_Sqr(t,t);
+        Field_Sub(t,t,Z1Z1);
+        Field_Sub(t,t,Z2Z2);
+        Field_Mul(r.Z,t,H);
+        Field_Sqr(r.X,R);
+        Field_Sub(r.X,r.X,J);
+        Field_Sub(r.X,r.X,V);
+        Field_Sub(r.X,r.X,V);
+        Field_Sub(t,V,r.X);
+        Field_Mul(t,R,t);
+        Field_Mul(S1,S1,J);
+        Field_Add(S1,S1,S1);
+        Field_Sub(r.Y,t,S1);
+    }
+    //r = q1 + q2 with q2 affine (madd-2007-bl)
+    void Point_Add(ec_point& r, const ec_point& q1, const ec_affine& q2) const{
+        if(q2.infinity){
+            r=q1;
+            return;
+        }
+        if(Is_Infinity(q1)){
+            From_Affine(r,q2);
+            return;
+        }
+        fp_elem Z1Z1,U2,S2,H,HH,I,J,R,V,t;
+        Field_Sqr(Z1Z1,q1.Z);
+        Field_Mul(U2,q2.x,Z1Z1);
+        Field_Mul(S2,q2.y,q1.Z);
+        Field_Mul(S2,S2,Z1Z1);
+        Field_Sub(H,U2,q1.X);
+        Field_Sub(R,S2,q1.Y);
+        if(Field_Is_Zero(H)){
+            if(Field_Is_Zero(R)){
+                Point_Double(r,q1);
+            }else{
+                Set_Infinity(r);
+            }
+            return;
+        }
+        Field_Sqr(HH,H);
+        Field_Add(I,HH,HH);
+        Field_Add(I,I,I);
+        Field_Mul(J,H,I);
+        Field_Add(R,R,R);
+        Field_Mul(V,q1.X,I);
+        Field_Add(t,q1.Z,H);
+        Field_Sqr(t,t);
+        Field_Sub(t,t,Z1Z1);
+        Field_Sub(r.Z,t,HH);
+        fp_elem Y1J;
+        Field_Mul(Y1J,q1.Y,J);
+        Field_Sqr(r.X,R);
+        Field_Sub(r.X,r.X,J);
+        Field_Sub(r.X,r.X,V);
+        Field_Sub(r.X,r.X,V);
+        Field_Sub(t,V,r.X);
+        Field_Mul(t,R,t);
+        Field_Add(Y1J,Y1J,Y1J);
+        Field_Sub(r.Y,t,Y1J);
+    }
+    /*r = k * q with a fixed 4-bit window; k is reduced modulo n. With an endomorphism, k is split
+    into k1 + k2 * lambda and k1 * q + k2 * phi(q) is evaluated with shared doublings, which
+    halves their number.
+    */
+    void Multiply(ec_point& r, const ec_affine& q, const mpz_t k) const{
+        mpz_t e[2];
+        ec_affine base[2];
+        int terms=1;
+        mpz_init(e[0]);mpz_init(e[1]);
+        base[0]=q;
+        if(glv){
+            Decompose(e[0],e[1],k);
+            Endomorphism(base[1],q);
+            terms=2;
+        }else{
+            mpz_mod(e[0],k,n);
+        }
+        ec_point table[2][16];
+        size_t bits=0;
+        for(int t=0;t<terms;t++){
+            if(mpz_sgn(e[t])<0){
+                mpz_neg(e[t],e[t]);
+                Negate(base[t],base[t]);
+            }
+            Set_Infinity(table[t][0]);
+            for(int d=1;d<16;d++){
+                Point_Add(table[t][d],table[t][d-1],base[t]);
+            }
+            if(mpz_sizeinbase(e[t],2)>bits){
+                bits=mpz_sizeinbase(e[t],2);
+            }
+        }
+        ec_point acc;
+        Set_Infinity(acc);
+        for(long j=((long)bits+3)/4-1;j>=0;j--){
+            for(int s=0;s<4;s++){
+                Point_Double(acc,acc);
+            }
+            for(int t=0;t<terms;t++){
+                unsigned long d=Exponent_Digit(e[t],(unsigned long)j*4,4);
+                if(d!=0){
+                    Point_Add(acc,acc,table[t][d]);
+                }
+            }
+        }
+        r=acc;
+        mpz_clear(e[0]);mpz_clear(e[1]);
+    }
+
+    /*Multi_Multiply computes r = Sum k_{i} * points_{i} with Pippenger's bucket method.
+    Scalars are recoded into signed c-bit digits, so a window needs only 2^(c-1) buckets and a
+    negative digit adds the negated point. Scalars above n/2 are replaced by n - k with the point
+    negated, so small negative weights stay short. In every window the points that fall into one
+    bucket are summed pairwise in affine coordinates, round by round, and all additions of a
+    round share one field inversion (Montgomery's trick). The bucket sums are then combined with
+    a running sum. Windows, and slices of the points within a window, are spread over threads,
+    but never more threads than there are min_thread_work (point, window) pairs, so a short vector
+    runs on the calling thread alone.
+    */
+    void Multi_Multiply(ec_point& r, const ec_affine* points, mpz_t* scalars, size_t count, unsigned int threads=0) const{
+        if(!glv){
+            Pippenger(r,points,scalars,count,threads);
+            return;
+        }
+        //with an endomorphism every term k * P becomes k1 * P + k2 * phi(P) with half-length scalars
+        std::vector<ec_affine> split(2*count);
+        mpz_t* k=(mpz_t *) malloc(2*count*sizeof(mpz_t));
+        size_t m=0,short_bits=mpz_sizeinbase(n,2)/2;
+        for(size_t i=0;i<count;i++){
+            if(mpz_sgn(scalars[i])>=0 && mpz_sizeinbase(scalars[i],2)<=short_bits){//already short, e.g. a small weight
+                mpz_init_set(k[m],scalars[i]);
+                split[m++]=points[i];
+                continue;
+            }
+            mpz_init(k[m]);mpz_init(k[m+1]);
+            Decompose(k[m],k[m+1],scalars[i]);
+            split[m]=points[i];
+            if(mpz_sgn(k[m+1])!=0){
+                Endomorphism(split[m+1],points[i]);
+                m+=2;
+            }else{
+                mpz_clear(k[m+1]);
+                m+=1;
+            }
+        }
+        Pippenger(r,split.data(),k,m,threads);
+        for(size_t i=0;i<m;i++){
+            mpz_clear(k[i]);
+        }
+        free(k);
+    }
+private:
+    void Pippenger(ec_point& r, const ec_affine* points, mpz_t* scalars, size_t count, unsigned int threads) const{
+        Set_Infinity(r);
+        if(count==0){
+            return;
+        }
+        mpz_t k,half;
+        mpz_init(k);mpz_init(half);
+        mpz_fdiv_q_2exp(half,n,1);
+        std::vector<ec_affine> signed_points(points,points+count);
+        std::vector<mp_limb_t> limbs(count*fp_limbs,0);
+        size_t bits=1;
+        for(size_t i=0;i<count;i++){
+            mpz_mod(k,scalars[i],n);
+            if(mpz_cmp(k,half)>0){
+                mpz_sub(k,n,k);
+                Negate(signed_points[i],points[i]);
+            }
+            mpz_export(&limbs[i*fp_limbs],NULL,-1,sizeof(mp_limb_t),0,0,k);
+            if(mpz_sizeinbase(k,2)>bits){
+                bits=mpz_sizeinbase(k,2);
+            }
+        }
+        mpz_clear(k);mpz_clear(half);
+        unsigned int c=2;
+        while(c<16 && (((size_t)1)<<(c+2))<count){
+            c++;//about log2(count) - 2 bits per window
+        }
+        if(c>bits+1){
+            c=(unsigned int)bits+1;
+        }
+        unsigned int windows=(unsigned int)((bits+1+c-1)/c);//one more bit for the carry of the signed digits
+        std::vector<int> digits(count*windows);
+        for(size_t i=0;i<count;i++){
+            mpz_t s;
+            mpz_roinit_n(s,&limbs[i*fp_limbs],fp_limbs);
+            int carry=0;
+            for(unsigned int w=0;w<windows;w++){
+                int d=(int)Exponent_Digit(s,(unsigned long)w*c,c)+carry;
+                carry=0;
+                if(d>(1<<(c-1))){
+                    d-=(1<<c);
+                    carry=1;
+                }
+                digits[i*windows+w]=d;
+            }
+        }
+        if(threads==0){
+            threads=std::thread::hardware_concurrency();
+        }
+        size_t work_threads=count*windows/min_thread_work;//more threads than this cost more to start than they save
+        if(threads>work_threads){
+            threads=(unsigned int)work_threads;
+        }
+        if(threads==0){
+            threads=1;
+        }
+        unsigned int parts=(threads+windows-1)/windows;//slices of the points per window
+        if((size_t)parts>count){
+            parts=(unsigned int)count;
+        }
+        std::vector<ec_point> partial(windows*parts);
+        std::vector<std::thread> pool;
+        std::atomic<unsigned int> next_task(0);
+        auto work=[&](){
+            unsigned int task;
+            while((task=next_task.fetch_add(1))<windows*parts){
+                unsigned int w=task/parts,part=task%parts;
+                size_t begin=count*part/parts,end=count*(part+1)/parts;
+                Window_Sum(partial[task],&signed_points[begin],&digits[begin*windows+w],windows,end-begin,c);
+            }
+        };
+        for(unsigned int t=1;t<threads && t<windows*parts;t++){
+            pool.emplace_back(work);
+        }
+        work();
+        for(size_t t=0;t<pool.size();t++){
+            pool[t].join();
+        }
+        for(int w=(int)windows-1;w>=0;w--){
+            for(unsigned int s=0;s<c && w!=(int)windows-1;s++){
+                Point_Double(r,r);
+            }
+            for(unsigned int part=0;part<parts;part++){
+                Point_Add(r,r,partial[w*parts+part]);
+            }
+        }
+    }
+    static const size_t min_thread_work=((size_t)1)<<14;//(point, window) pairs that justify one more Pippenger thread
+    mp_limb_t P[fp_limbs];//p as limbs
+    mp_limb_t pinv;//-p^(-1) mod 2^64
+    fp_elem R2,R3;//R^2 and R^3 mod p, R = 2^(64*fp_limbs)
+    std::vector<unsigned char> sqrt_digits;//4-bit digits of (p+1)/4, most significant first
+    static void Export(mp_limb_t* out, const mpz_t x){
+        memset(out,0,fp_limbs*sizeof(mp_limb_t));
+        mpz_export(out,NULL,-1,sizeof(mp_limb_t),0,0,x);
+    }
+    //Montgomery reduction of the 2*fp_limbs+1 limbs of t (t < p*R) into r = t / R mod p
+    void Reduce(fp_elem& r, mp_limb_t* t) const{
+        for(int i=0;i<fp_limbs;i++){
+            mp_limb_t m=t[i]*pinv;
+            mp_limb_t carry=mpn_addmul_1(t+i,P,fp_limbs,m);
+            mpn_add_1(t+i+fp_limbs,t+i+fp_limbs,fp_limbs+1-i,carry);
+        }
+        if(t[2*fp_limbs]!=0 || mpn_cmp(t+fp_limbs,P,fp_limbs)>=0){
+            mpn_sub_n(r.v,t+fp_limbs,P,fp_limbs);
+        }else{
+            memcpy(r.v,t+fp_limbs,sizeof(r.v));
+        }
+    }
+    /*add the pairs (items[first[k]], items[first[k]+1]) in affine coordinates with a single field
+    inversion for all of them, and store the sums in sums[k]
+    */
+    void Batch_Add(const std::vector<ec_affine>& items, const std::vector<size_t>& first, std::vector<ec_affine>& sums) const{
+        size_t m=first.size();
+        enum{copy_a,copy_b,add,twice,none};
+        std::vector<char> kind(m);
+        std::vector<fp_elem> den(m),prefix(m);
+        fp_elem acc=one;
+        for(size_t k=0;k<m;k++){
+            const ec_affine& A=items[first[k]];
+            const ec_affine& B=items[first[k]+1];
+            if(A.infinity){
+                kind[k]=copy_b;
+            }else if(B.infinity){
+                kind[k]=copy_a;
+            }else if(!Field_Equal(A.x,B.x)){
+                kind[k]=add;
+                Field_Sub(den[k],B.x,A.x);
+            }else if(Field_Equal(A.y,B.y) && !Field_Is_Zero(A.y)){
+                kind[k]=twice;
+                Field_Add(den[k],A.y,A.y);
+            }else{
+                kind[k]=none;//A = -B
+            }
+            prefix[k]=acc;
+            if(kind[k]==add || kind[k]==twice){
+                Field_Mul(acc,acc,den[k]);
+            }
+        }
+        fp_elem inv,lambda,t;
+        if(!Field_Equal(acc,one)){
+            Field_Inv(inv,acc);
+        }else{
+            inv=one;
+        }
+        sums.resize(m);
+        for(size_t k=m;k-->0;){
+            const ec_affine& A=items[first[k]];
+            const ec_affine& B=items[first[k]+1];
+            if(kind[k]==copy_a){
+                sums[k]=A;
+                continue;
+            }
+            if(kind[k]==copy_b){
+                sums[k]=B;
+                continue;
+            }
+            if(kind[k]==none){
+                sums[k].infinity=true;
+                continue;
+            }
+            Field_Mul(t,inv,prefix[k]);//1/den[k]
+            Field_Mul(inv,inv,den[k]);//1/(den[0]*...*den[k-1]) for the next pair down
+            if(kind[k]==add){
+                Field_Sub(lambda,B.y,A.y);
+            }else{
+                Field_Sqr(lambda,A.x);
+                fp_elem three;
+                Field_Add(three,lambda,lambda);
+                Field_Add(lambda,three,lambda);
+                Field_Add(lambda,lambda,a_m);
+            }
+            Field_Mul(lambda,lambda,t);
+            ec_affine& S=sums[k];
+            Field_Sqr(S.x,lambda);
+            Field_Sub(S.x,S.x,A.x);
+            Field_Sub(S.x,S.x,B.x);
+            Field_Sub(t,A.x,S.x);
+            Field_Mul(S.y,lambda,t);
+            Field_Sub(S.y,S.y,A.y);
+            S.infinity=false;
+        }
+    }
+    //r = Sum digit_{i} * points_{i} for the window whose digits are digits[i*stride]
+    void Window_Sum(ec_point& r, const ec_affine* points, const int* digits, unsigned int stride, size_t count, unsigned int c) const{
+        size_t buckets=((size_t)1)<<(c-1);
+        std::vector<size_t> offset(buckets+1,0),length(buckets,0);
+        for(size_t i=0;i<count;i++){
+            int d=digits[i*stride];
+            if(d!=0){
+                offset[(d>0?d:-d)]++;
+            }
+        }
+        for(size_t b=0;b<buckets;b++){
+            offset[b+1]+=offset[b];
+        }
+        std::vector<ec_affine> items(offset[buckets]);
+        for(size_t i=0;i<count;i++){//counting sort of the points by bucket
+            int d=digits[i*stride];
+            if(d==0){
+                continue;
+            }
+            size_t b=(size_t)(d>0?d:-d)-1;
+            ec_affine& slot=items[offset[b]+length[b]++];
+            if(d>0){
+                slot=points[i];
+            }else{
+                Negate(slot,points[i]);
+            }
+        }
+        std::vector<size_t> first;
+        std::vector<ec_affine> sums;
+        while(true){//halve every bucket's list of points per round
+            first.clear();
+            for(size_t b=0;b<buckets;b++){
+                for(size_t k=0;k+1<length[b];k+=2){
+                    first.push_back(offset[b]+k);
+                }
+            }
+            if(first.empty()){
+                break;
+            }
+            Batch_Add(items,first,sums);
+            size_t at=0;
+            for(size_t b=0;b<buckets;b++){
+                size_t pairs=length[b]/2;
+                for(size_t k=0;k<pairs;k++){
+                    items[offset[b]+k]=sums[at++];
+                }
+                if(length[b]%2==1){
+                    items[offset[b]+pairs]=items[offset[b]+length[b]-1];
+                }
+                length[b]=(length[b]+1)/2;
+            }
+        }
+        ec_point running,total;//running = Sum of the buckets >= b, total = Sum (b + 1) * bucket_{b}
+        Set_Infinity(running);
+        Set_Infinity(total);
+        for(size_t b=buckets;b-->0;){
+            if(length[b]==1){
+                Point_Add(running,running,items[offset[b]]);
+            }
+            Point_Add(total,total,running);
+        }
+        r=total;
+    }
+};
+
+/*curve_dlog_table solves k * G = D for -baby < k < baby*giant. The baby steps j * G, 0 <= j < baby,
+are stored in affine coordinates and indexed by x only, since j * G and -j * G share x; the sign
+is then read from y. A lookup subtracts baby * G at most giant times.
+*/
+class curve_dlog_table{
+public:
+    const ec_group& curve;
+    unsigned long baby,giant;
+    std::vector<ec_affine> steps;//steps[j] = j * G
+    std::vector<unsigned long> slots;//open addressing by x: j + 1, 0 for an empty slot
+    size_t mask;
+    ec_affine giant_step;//-baby * G
+    curve_dlog_table(const ec_group& group, unsigned long baby_steps, unsigned long giant_steps):curve(group){
+        baby=baby_steps;giant=giant_steps;
+        size_t n=1;
+        while(n<2*baby){
+            n*=2;
+        }
+        mask=n-1;
+        slots.assign(n,0);
+        steps.resize(baby);
+        std::vector<ec_point> multiples(baby);
+        ec_point acc;
+        curve.Set_Infinity(acc);
+        for(unsigned long j=0;j<baby;j++){
+            multiples[j]=acc;
+            curve.Point_Add(acc,acc,curve.G);
+        }
+        curve.Batch_To_Affine(steps.data(),multiples.data(),baby);
+        for(unsigned long j=1;j<baby;j++){
+            size_t s=Slot(steps[j].x);
+            while(slots[s]!=0){
+                s=(s+1)&mask;
+            }
+            slots[s]=j+1;
+        }
+        ec_affine t;
+        curve.To_Affine(t,acc);
+        curve.Negate(giant_step,t);
+    }
+    size_t Slot(const fp_elem& x) const{
+        return (size_t)((x.v[0]^(x.v[1]*0x9e3779b97f4a7c15ULL))&mask);
+    }
+    //k with k * G = D, for -baby < k < baby*giant. Returns false if there is none.
+    bool Lookup(mpz_t k, const ec_point& D) const{
+        ec_point e=D;
+        ec_affine q;
+        for(unsigned long i=0;i<giant;i++){
+            curve.To_Affine(q,e);
+            if(q.infinity){
+                mpz_set_ui(k,i);
+                mpz_mul_ui(k,k,baby);
+                return true;
+            }
+            size_t s=Slot(q.x);
+            while(slots[s]!=0){
+                const ec_affine& b=steps[slots[s]-1];
+                if(curve.Field_Equal(b.x,q.x)){
+                    mpz_set_ui(k,i);
+                    mpz_mul_ui(k,k,baby);
+                    if(curve.Field_Equal(b.y,q.y)){
+                        mpz_add_ui(k,k,slots[s]-1);
+                    }else{
+                        mpz_sub_ui(k,k,slots[s]-1);
+                    }
+                    return true;
+                }
+                s=(s+1)&mask;
+            }
+            curve.Point_Add(e,e,giant_step);
+        }
+        return false;
+    }
+};
+
+//cipher text for Functional Encryption over a curve: Ct_{0} = r * G, Ct_{i} = x_{i} * G + r * H_{i}
+class cipher_text_FE_curve{
+public:
+    ec_affine c0;
+    std::vector<ec_affine> c1;
+};
+
+/*FE_inner_product_DDH_curve is the scheme of FE_inner_product_DDH over the curve group: the
+master secret key is (s_{1}, ..., s_{l}) in Z_{n}, the public keys are H_{i} = s_{i} * G, and
+Decrypt computes Sum y_{i} * Ct_{i} - sk_{y} * Ct_{0} = <x,y> * G with one multi-scalar
+multiplication over the components and one scalar multiplication of Ct_{0}.
+*/
+class FE_inner_product_DDH_curve{
+private:
+    const ec_group& curve;
+    unsigned int vec_len;
+    mpz_t* s;//master secret key
+public:
+    std::vector<ec_affine> h;//public keys H_{i}
+    FE_inner_product_DDH_curve(const ec_group& group, unsigned int len, gmp_randstate_t state):curve(group){
+        vec_len=len;
+        s=(mpz_t *) malloc(vec_len * sizeof(mpz_t));
+        h.resize(vec_len);
+        std::vector<ec_point> t(vec_len);
+        for(unsigned int i=0;i<vec_len;i++){
+            mpz_init(s[i]);
+            mpz_urandomm(s[i],state,curve.n);
+            curve.Multiply(t[i],curve.G,s[i]);
+        }
+        curve.Batch_To_Affine(h.data(),t.data(),vec_len);
+    }
+    FE_inner_product_DDH_curve(const FE_inner_product_DDH_curve&)=delete;
+    FE_inner_product_DDH_curve& operator=(const FE_inner_product_DDH_curve&)=delete;
+    ~FE_inner_product_DDH_curve(){
+        for(unsigned int i=0;i<vec_len;i++){
+            mpz_clear(s[i]);
+        }
+        free(s);
+    }
+    unsigned int Length() const{
+        return vec_len;
+    }
+    //sk_{y} = Sum y_{i} * s_{i} (mod n)
+    void Key_Derivation(mpz_t sk_y, mpz_t* y){
+        mpz_set_ui(sk_y,0);
+        for(unsigned int i=0;i<vec_len;i++){
+            mpz_addmul(sk_y,y[i],s[i]);
+        }
+        mpz_mod(sk_y,sk_y,curve.n);
+    }
+    cipher_text_FE_curve Encrypt(mpz_t* msg, gmp_randstate_t state){
+        return Encrypt_Batch(&msg,1,state)[0];
+    }
+    /*encrypt count messages; msgs[k] holds the vec_len components of the k-th message. The
+    (l+1) * count points of the batch are normalized together, with a single field inversion.
+    */
+    std::vector<cipher_text_FE_curve> Encrypt_Batch(mpz_t** msgs, size_t count, gmp_randstate_t state){
+        size_t stride=vec_len+1;
+        std::vector<ec_point> t(count*stride);//Ct_{0}, Ct_{1}, ..., Ct_{l} of every record
+        ec_point u;
+        mpz_t r;
+        mpz_init(r);
+        for(size_t k=0;k<count;k++){
+            mpz_urandomm(r,state,curve.n);
+            curve.Multiply(t[k*stride],curve.G,r);
+            for(unsigned int i=0;i<vec_len;i++){
+                ec_point& c=t[k*stride+i+1];
+                curve.Multiply(c,curve.G,msgs[k][i]);
+                curve.Multiply(u,h[i],r);
+                curve.Point_Add(c,c,u);
+            }
+        }
+        mpz_clear(r);
+        std::vector<ec_affine> points(t.size());
+        curve.Batch_To_Affine(points.data(),t.data(),t.size());
+        std::vector<cipher_text_FE_curve> cts(count);
+        for(size_t k=0;k<count;k++){
+            cts[k].c0=points[k*stride];
+            cts[k].c1.assign(points.begin()+k*stride+1,points.begin()+(k+1)*stride);
+        }
+        return cts;
+    }
+    /*Serialize writes the cipher texts back to back, each as the compressed encodings of Ct_{0},
+    Ct_{1}, ..., Ct_{l}; Deserialize reads them back and rejects points that are not on the curve.
+    */
+    std::string Serialize(const std::vector<cipher_text_FE_curve>& cts) const{
+        std::string out(cts.size()*(vec_len+1)*ec_group::point_bytes,'\0');
+        unsigned char* at=(unsigned char*)&out[0];
+        for(size_t k=0;k<cts.size();k++){
+            curve.Encode(at,&cts[k].c0,1);
+            at+=ec_group::point_bytes;
+            curve.Encode(at,cts[k].c1.data(),vec_len);
+            at+=vec_len*ec_group::point_bytes;
+        }
+        return out;
+    }
+    bool Deserialize(const std::string& bytes, std::vector<cipher_text_FE_curve>& cts) const{
+        size_t record=(vec_len+1)*ec_group::point_bytes;
+        if(bytes.size()%record!=0){
+            return false;
+        }
+        size_t count=bytes.size()/record;
+        std::vector<ec_affine> points(count*(vec_len+1));
+        if(!curve.Decode(points.data(),(const unsigned char*)bytes.data(),points.size())){
+            return false;
+        }
+        cts.resize(count);
+        for(size_t k=0;k<count;k++){
+            cts[k].c0=points[k*(vec_len+1)];
+            cts[k].c1.assign(points.begin()+k*(vec_len+1)+1,points.begin()+(k+1)*(vec_len+1));
+        }
+        return true;
+    }
+    //D = <x,y> * G
+    void Decrypt(ec_point& D, const cipher_text_FE_curve& ct, mpz_t* y, const mpz_t sk_y, unsigned int threads=0){
+        curve.Multi_Multiply(D,ct.c1.data(),y,vec_len,threads);
+        ec_point t;
+        ec_affine neg_c0;
+        curve.Negate(neg_c0,ct.c0);
+        curve.Multiply(t,neg_c0,sk_y);
+        curve.Point_Add(D,D,t);
+    }
+    //result = <x,y>, if it is in the range of dlog
+    bool Decrypt(mpz_t result, const cipher_text_FE_curve& ct, mpz_t* y, const mpz_t sk_y, const curve_dlog_table& dlog, unsigned int threads=0){
+        ec_point D;
+        Decrypt(D,ct,y,sk_y,threads);
+        return dlog.Lookup(result,D);
+    }
+};
+
+//generate p, g for ElGamal before everything else
+ElGamal_Param ElGamal_Client::param;
+adaptive_precomputation ElGamal_Client::precomp(ElGamal_Client::param);
+
+/*The C interface of fe.h. A fe_scheme is a tenant with its own group tables and a batch_engine.
+Cipher texts are read from and written to the caller's buffers in place; the GMP integers that a
+call needs in between live in the worker's gmp_arena for one block of records.
+*/
+struct fe_scheme{
+    std::shared_ptr<tenant> owner;
+    std::unique_ptr<lane_kernel> lanes;//the batch path for short vectors, if the scheme fits it
+    batch_engine engine;
+    size_t element_bytes;
+    fe_scheme(uint32_t len, uint64_t dlog_bound){
+        if(mpz_cmp_ui(ElGamal_Client::param.q,(unsigned long)dlog_bound)<0){
+            throw std::invalid_argument("fe_scheme: dlog_bound exceeds the group order q");//exponents only exist modulo q
+        }
+        std::shared_ptr<const group_precomputation> group=std::make_shared<const group_precomputation>(ElGamal_Client::param,(unsigned long)dlog_bound,4);
+        owner=std::make_shared<tenant>(group,len,4);
+        if(lane_kernel::Fits(len,ElGamal_Client::param.p)){
+            lanes.reset(new lane_kernel(group->g_table,owner->h_tables,ElGamal_Client::param.p,ElGamal_Client::param.q));
+        }
+        element_bytes=(mpz_sizeinbase(ElGamal_Client::param.p,2)+7)/8;
+    }
+    size_t Length() const{
+        return owner->h_tables.size();
+    }
+    size_t Ciphertext_Bytes() const{
+        return (Length()+1)*element_bytes;
+    }
+    //write v, 0 <= v < p, as element_bytes big-endian bytes
+    void Put(uint8_t* out, const mpz_t v) const{
+        memset(out,0,element_bytes);
+        size_t len=(mpz_sizeinbase(v,2)+7)/8;
+        mpz_export(out+element_bytes-len,NULL,1,1,1,0,v);
+    }
+    void Get(mpz_t v, const uint8_t* in) const{
+        mpz_import(v,element_bytes,1,1,1,0,in);
+    }
+    //the same for elements of the lane_kernel, which fit in one word
+    void Put_Word(uint8_t* out, uint64_t v) const{
+        for(size_t b=element_bytes;b-->0;v>>=8){
+            out[b]=(uint8_t)v;
+        }
+    }
+    uint64_t Get_Word(const uint8_t* in) const{
+        uint64_t v=0;
+        for(size_t b=0;b<element_bytes;b++){
+            v=(v<<8)|in[b];
+        }
+        return v;
+    }
+    //encrypt the vectors [begin, end) of x into cts with the calling thread's generator
+    void Encrypt_Range(const int64_t* x, size_t begin, size_t end, uint8_t* cts){
+        size_t len=Length();
+        gmp_randstate_t& block_state=owner->random.Local();//before the arena opens, since the generator outlives it
+        gmp_arena::scope block;
+        if(lanes){
+            std::vector<uint64_t> words((end-begin)*(len+1));
+            lanes->Encrypt(x+begin*len,end-begin,words.data(),block_state);
+            for(size_t k=0;k<words.size();k++){
+                Put_Word(cts+begin*Ciphertext_Bytes()+k*element_bytes,words[k]);
+            }
+            return;
+        }
+        mpz_t* msg=(mpz_t *) malloc(len * sizeof(mpz_t));
+        for(size_t i=0;i<len;i++){
+            mpz_init(msg[i]);
+        }
+        for(size_t k=begin;k<end;k++){
+            for(size_t i=0;i<len;i++){
+                mpz_set_si(msg[i],(long)x[k*len+i]);
+            }
+            cipher_text_FE ct=owner->gh_tables.empty()?
+                FE_inner_product_DDH::Encrypt(msg,owner->group->g_table,owner->h_tables,block_state):
+                FE_inner_product_DDH::Encrypt(msg,owner->group->g_table,owner->gh_tables,block_state);
+            uint8_t* out=cts+k*Ciphertext_Bytes();
+            Put(out,ct.c0);
+            for(size_t i=0;i<len;i++){
+                Put(out+(i+1)*element_bytes,ct.c1[i]);
+            }
+            free(ct.c1);
+        }
+        free(msg);
+    }
+    /*decrypt the cipher texts [begin, end) of cts into values; returns the number of values out of
+    range. The discrete logs are taken dlog_table::batch_group at a time with Lookup_Batch.
+    */
+    size_t Decrypt_Range(const decrypt_plan& plan, const uint8_t* cts, size_t begin, size_t end, int64_t* values){
+        static const size_t group=dlog_table::batch_group;
+        size_t len=Length(),missed=0;
+        gmp_arena::scope block;
+        cipher_text_FE ct((unsigned int)len);
+        mpz_t h[group],result[group];
+        bool found[group];
+        for(size_t a=0;a<group;a++){
+            mpz_init(h[a]);mpz_init(result[a]);
+        }
+        std::vector<uint64_t> words,elements;
+        if(lanes){
+            words.resize((end-begin)*(len+1));
+            elements.resize(end-begin);
+            for(size_t k=0;k<words.size();k++){
+                words[k]=Get_Word(cts+begin*Ciphertext_Bytes()+k*element_bytes);
+            }
+            lanes->Decrypt(plan,words.data(),end-begin,elements.data());
+        }
+        for(size_t k0=begin;k0<end;k0+=group){
+            size_t m=end-k0<group?end-k0:group;
+            for(size_t a=0;a<m && lanes;a++){
+                mpz_set_ui(h[a],(unsigned long)elements[k0+a-begin]);
+            }
+            for(size_t a=0;a<m && !lanes;a++){
+                const uint8_t* in=cts+(k0+a)*Ciphertext_Bytes();
+                Get(ct.c0,in);
+                for(size_t i=0;i<len;i++){
+                    Get(ct.c1[i],in+(i+1)*element_bytes);
+                }
+                plain_text pt=owner->scheme->Decrypt(ct,plan);
+                mpz_swap(h[a],pt.msg);
+                mpz_clear(pt.msg);
+            }
+            owner->group->dlog.Lookup_Batch(result,h,m,found);
+            for(size_t a=0;a<m;a++){
+                if(found[a]){
+                    values[k0+a]=(int64_t)mpz_get_si(result[a]);
+                }else{
+                    values[k0+a]=-1;
+                    missed++;
+                }
+            }
+        }
+        for(size_t a=0;a<group;a++){
+            mpz_clear(h[a]);mpz_clear(result[a]);
+        }
+        free(ct.c1);
+        return missed;
+    }
+};
+
+struct fe_key{
+    std::shared_ptr<decrypt_plan> plan;
+    size_t length;//l of the scheme the key was derived for
+};
+
+extern "C"{
+
+fe_scheme* fe_setup(uint32_t length, uint64_t dlog_bound){
+    if(length==0 || dlog_bound==0 || mpz_cmp_ui(ElGamal_Client::param.q,(unsigned long)dlog_bound)<0){
+        return NULL;
+    }
+    try{
+        return new fe_scheme(length,dlog_bound);
+    }catch(...){
+        return NULL;
+    }
+}
+
+void fe_scheme_free(fe_scheme* scheme){
+    delete scheme;
+}
+
+uint32_t fe_length(const fe_scheme* scheme){
+    return scheme==NULL?0:(uint32_t)scheme->Length();
+}
+
+size_t fe_element_bytes(const fe_scheme* scheme){
+    return scheme==NULL?0:scheme->element_bytes;
+}
+
+size_t fe_ciphertext_bytes(const fe_scheme* scheme){
+    return scheme==NULL?0:scheme->Ciphertext_Bytes();
+}
+
+fe_key* fe_keyder(fe_scheme* scheme, const int64_t* y){
+    if(scheme==NULL || y==NULL){
+        return NULL;
+    }
+    size_t len=scheme->Length();
+    mpz_t* vec=(mpz_t *) malloc(len * sizeof(mpz_t));
+    if(vec==NULL){
+        return NULL;
+    }
+    for(size_t i=0;i<len;i++){
+        mpz_init_set_si(vec[i],(long)y[i]);
+    }
+    fe_key* key=NULL;
+    try{
+        key=new fe_key;
+        key->plan=scheme->owner->scheme->Plan(vec);
+        key->length=len;
+    }catch(...){
+        delete key;
+        key=NULL;
+    }
+    for(size_t i=0;i<len;i++){
+        mpz_clear(vec[i]);
+    }
+    free(vec);
+    return key;
+}
+
+void fe_key_free(fe_key* key){
+    delete key;
+}
+
+int fe_encrypt(fe_scheme* scheme, const int64_t* x, uint8_t* ct){
+    return fe_encrypt_batch(scheme,x,1,ct);
+}
+
+int fe_decrypt(fe_scheme* scheme, const fe_key* key, const uint8_t* ct, int64_t* value){
+    return fe_decrypt_batch(scheme,key,ct,1,value);
+}
+
+int fe_encrypt_batch(fe_scheme* scheme, const int64_t* x, size_t count, uint8_t* cts){
+    if(scheme==NULL || x==NULL || cts==NULL){
+        return FE_ERROR_ARGUMENT;
+    }
+    try{
+        if(count==1){//not worth waking the workers
+            scheme->Encrypt_Range(x,0,1,cts);
+            return FE_OK;
+        }
+        scheme->engine.Run(count,[&](unsigned int, size_t begin, size_t end){
+            scheme->Encrypt_Range(x,begin,end,cts);
+        });
+    }catch(...){
+        return FE_ERROR_MEMORY;
+    }
+    return FE_OK;
+}
+
+int fe_decrypt_batch(fe_scheme* scheme, const fe_key* key, const uint8_t* cts, size_t count, int64_t* values){
+    if(scheme==NULL || key==NULL || cts==NULL || values==NULL || key->length!=scheme->Length()){
+        return FE_ERROR_ARGUMENT;
+    }
+    std::atomic<size_t> missed(0);
+    try{
+        if(count==1){
+            missed=scheme->Decrypt_Range(*key->plan,cts,0,1,values);
+        }else{
+            scheme->engine.Run(count,[&](unsigned int, size_t begin, size_t end){
+                missed+=scheme->Decrypt_Range(*key->plan,cts,begin,end,values);
+            });
+        }
+    }catch(...){
+        return FE_ERROR_MEMORY;
+    }
+    return missed==0?FE_OK:FE_ERROR_RANGE;
+}
+
+}
+
+#ifndef FE_LIBRARY
+/*Self-checks of the batched paths against the scalar ones they replace, run by main on the demo
+group. They are deterministic: whatever the random commitments, every result has one right value.
+*/
+
+//print the outcome of one self-check and pass it on
+static bool Report(const char* name, bool ok){
+    printf("Self-check %s: %s\n",name,ok?"passed":"FAILED");
+    return ok;
+}
+
+//fill the len components of every message of msgs with small values from a fixed sequence
+static void Fill_Messages(mpz_t** msgs, size_t count, unsigned int len, unsigned long seed){
+    for(size_t n=0;n<count;n++){
+        msgs[n]=(mpz_t *) malloc(len * sizeof(mpz_t));
+        for(unsigned int i=0;i<len;i++){
+            mpz_init_set_ui(msgs[n][i],(seed+n*5+i*3)%4);
+        }
+    }
+}
+
+static void Free_Messages(mpz_t** msgs, size_t count, unsigned int len){
+    for(size_t n=0;n<count;n++){
+        for(unsigned int i=0;i<len;i++){
+            mpz_clear(msgs[n][i]);
+        }
+        free(msgs[n]);
+    }
+}
+
+//the arena-backed Encrypt_Batch and Decrypt_Batch against Decrypt, and integers that outlive a scope
+static bool Check_Arena(){
+    unsigned int len=4;
+    size_t count=2000;
+    FE_inner_product_DDH fe(len);
+    mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+    for(unsigned int i=0;i<len;i++){
+        mpz_init_set_ui(y[i],i+1);
+    }
+    std::shared_ptr<decrypt_plan> plan=fe.Plan(y);
+    std::vector<mpz_t*> msgs(count);
+    Fill_Messages(msgs.data(),count,len,2);
+    std::vector<cipher_text_FE> cts=fe.Encrypt_Batch(msgs.data(),count);
+    std::vector<plain_text> pts=fe.Decrypt_Batch(cts,*plan);
+    bool ok=true;
+    for(size_t n=0;n<count;n++){
+        plain_text pt=fe.Decrypt(cts[n],*plan);
+        ok=ok && mpz_cmp(pt.msg,pts[n].msg)==0;
+        mpz_clear(pt.msg);
+    }
+    Free_Messages(msgs.data(),count,len);
+    for(unsigned int i=0;i<len;i++){
+        mpz_clear(y[i]);
+    }
+    free(y);
+    //an integer from before the scope grows on the heap, and one made under a pause outlives it
+    mpz_t before,kept;
+    mpz_init_set_ui(before,1);
+    {
+        gmp_arena::scope batch;
+        mpz_mul_2exp(before,before,1<<16);
+        gmp_arena::pause heap;
+        mpz_init_set(kept,before);
+    }
+    ok=ok && mpz_sizeinbase(before,2)==(1<<16)+1 && mpz_cmp(before,kept)==0;
+    mpz_clear(before);mpz_clear(kept);
+    return ok && gmp_arena::Bytes_Reserved()>0 && gmp_arena::Bytes_Reserved()<=(((size_t)64)<<20);
+}
+
+//adaptive_precomputation against mpz_powm while a base turns hot and gets its table, and with a budget that no table fits
+static bool Check_Precomputation(){
+    const ElGamal_Param& param=ElGamal_Client::param;
+    adaptive_precomputation precomp(param),tiny(param);
+    precomp.hot_threshold=2;
+    tiny.hot_threshold=1;
+    tiny.memory_budget=1;
+    bool ok=true;
+    mpz_t e,r,got,want;
+    mpz_init(e);mpz_init(r);mpz_init(got);mpz_init(want);
+    for(int round=0;round<400 && ok;round++){
+        mpz_set_si(e,(long)round*37-500);//negative exponents and exponents past q
+        mpz_mod(r,e,param.q);
+        mpz_powm(want,param.g,r,param.p);
+        precomp.Power(got,param.g,e);
+        ok=mpz_cmp(got,want)==0;
+        tiny.Power(got,param.g,e);
+        ok=ok && mpz_cmp(got,want)==0;
+        if(round>=200 && precomp.Table_Bytes()==0){
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));//give the builder time, so the later rounds use the table
+        }
+    }
+    mpz_clear(e);mpz_clear(r);mpz_clear(got);mpz_clear(want);
+    return ok && precomp.Table_Bytes()>0 && tiny.Table_Bytes()==0;
+}
+
+//functional_key_cache: hits return the cached plan, y and y + q share one plan, and the least recently used plan is evicted first
+static bool Check_Key_Cache(){
+    unsigned int len=3;
+    FE_inner_product_DDH fe(len);
+    mpz_t* y[4];
+    for(unsigned int v=0;v<4;v++){
+        y[v]=(mpz_t *) malloc(len * sizeof(mpz_t));
+        for(unsigned int i=0;i<len;i++){
+            mpz_init_set_ui(y[v][i],v+i+1);//no 0 components, so that all plans take the same memory
+        }
+    }
+    mpz_add(y[3][0],y[0][0],ElGamal_Client::param.q);//y[3] = y[0] (mod q)
+    mpz_set(y[3][1],y[0][1]);mpz_set(y[3][2],y[0][2]);
+    std::shared_ptr<const decrypt_plan> fresh=fe.Plan(y[0]);
+    functional_key_cache cache(fe,2*fresh->Bytes());//room for two plans
+    std::shared_ptr<const decrypt_plan> first=cache.Get(y[0]);
+    bool ok=cache.Get(y[0])==first && cache.Get(y[3])==first;
+    ok=ok && mpz_cmp(first->sk.sk_y,fresh->sk.sk_y)==0 && cache.hits==2 && cache.misses==1;
+    cache.Get(y[1]);
+    cache.Get(y[0]);//y[0] is now more recent than y[1]
+    cache.Get(y[2]);//evicts y[1]
+    ok=ok && cache.evictions==1 && cache.misses==3 && cache.Get(y[0])==first && cache.misses==3;
+    cache.Get(y[1]);
+    ok=ok && cache.misses==4 && cache.Bytes()<=cache.memory_budget;
+    for(unsigned int v=0;v<4;v++){
+        for(unsigned int i=0;i<len;i++){
+            mpz_clear(y[v][i]);
+        }
+        free(y[v]);
+    }
+    return ok;
+}
+
+/*epoch_reclaimer keeps a retired object while a reader that entered before its retirement is
+active, and key_registry serves a snapshot the version it was taken in across a key rotation
+*/
+static bool Check_Key_Registry(){
+    epoch_reclaimer reclaimer;
+    bool first=false,second=false;
+    unsigned int slot=reclaimer.Enter();
+    reclaimer.Retire([&first]{first=true;});
+    bool ok=!first;//the reader may still see it
+    reclaimer.Exit(slot);
+    reclaimer.Retire([&second]{second=true;});
+    ok=ok && first && second;
+    unsigned int len=2;
+    key_registry registry;
+    mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+    mpz_t* x=(mpz_t *) malloc(len * sizeof(mpz_t));
+    for(unsigned int i=0;i<len;i++){
+        mpz_init_set_ui(y[i],i+1);mpz_init_set_ui(x[i],i+2);//<x,y> = 8
+    }
+    std::shared_ptr<FE_inner_product_DDH> instance=std::make_shared<FE_inner_product_DDH>(len);
+    registry.Publish_Instance("a",instance);
+    ok=ok && registry.Publish_Key("k","a",y) && !registry.Publish_Key("k","b",y);
+    std::vector<cipher_text_FE> cts=instance->Encrypt_Batch(&x,1);
+    mpz_t want;
+    mpz_init(want);
+    mpz_powm_ui(want,ElGamal_Client::param.g,8,ElGamal_Client::param.p);
+    plain_text pt;
+    ok=ok && registry.Decrypt("k",cts[0],pt) && mpz_cmp(pt.msg,want)==0;
+    {
+        key_registry::snapshot before=registry.Read();
+        registry.Publish_Instance("a",std::make_shared<FE_inner_product_DDH>(len));//rotation drops the key
+        key_registry::snapshot after=registry.Read();
+        ok=ok && before.Find_Key("k")!=nullptr && before.Find_Instance("a")==instance.get();
+        ok=ok && after.Find_Key("k")==nullptr && after->number==before->number+1;
+        plain_text old=before.Find_Instance("a")->Decrypt(cts[0],*before.Find_Key("k")->plan);
+        ok=ok && mpz_cmp(old.msg,want)==0;
+        mpz_clear(old.msg);
+    }
+    ok=ok && !registry.Decrypt("k",cts[0],pt);
+    mpz_clear(want);mpz_clear(pt.msg);
+    for(unsigned int i=0;i<len;i++){
+        mpz_clear(y[i]);mpz_clear(x[i]);
+    }
+    free(y);free(x);
+    return ok;
+}
+
+//two tenants of one registry encrypting on two threads each, every thread with its own generators, and decrypting to <x,y>
+static bool Check_Tenants(){
+    unsigned int len=3;
+    tenant_registry registry(72);
+    std::shared_ptr<tenant> tenants[2]={registry.Add("a",len),registry.Add("b",len)};
+    std::vector<mpz_t*> msgs(40);
+    Fill_Messages(msgs.data(),msgs.size(),len,3);
+    std::vector<cipher_text_FE> cts[4];
+    std::vector<std::thread> threads;
+    for(unsigned int t=0;t<4;t++){
+        threads.emplace_back([&,t]{
+            for(size_t n=0;n<msgs.size();n++){
+                cts[t].push_back(tenants[t%2]->Encrypt(msgs[n]));
+            }
+        });
+    }
+    for(size_t t=0;t<threads.size();t++){
+        threads[t].join();
+    }
+    bool ok=&tenants[0]->random.Local()!=&tenants[1]->random.Local() && tenants[0]->group==tenants[1]->group;
+    mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+    for(unsigned int i=0;i<len;i++){
+        mpz_init_set_ui(y[i],i+1);
+    }
+    std::shared_ptr<decrypt_plan> plans[2]={tenants[0]->scheme->Plan(y),tenants[1]->scheme->Plan(y)};
+    mpz_t result;
+    mpz_init(result);
+    for(unsigned int t=0;t<4;t++){
+        for(size_t n=0;n<msgs.size();n++){
+            unsigned long inner=0;
+            for(unsigned int i=0;i<len;i++){
+                inner+=mpz_get_ui(msgs[n][i])*(i+1);
+            }
+            ok=ok && tenants[t%2]->Decrypt(result,cts[t][n],*plans[t%2]) && mpz_cmp_ui(result,inner)==0;
+        }
+    }
+    mpz_clear(result);
+    for(unsigned int i=0;i<len;i++){
+        mpz_clear(y[i]);
+    }
+    free(y);
+    Free_Messages(msgs.data(),msgs.size(),len);
+    return ok;
+}
+
+//batch_engine covers every record once and runs On_Node on every node; tenant_batch against the inner products and Decrypt
+static bool Check_Batch_Engine(){
+    batch_engine engine(2);
+    size_t count=1000;
+    std::unique_ptr<std::atomic<unsigned int>[]> visits(new std::atomic<unsigned int>[count]);
+    for(size_t k=0;k<count;k++){
+        visits[k]=0;
+    }
+    bool ok=true;
+    engine.Run(count,[&](unsigned int node, size_t begin, size_t end){
+        if(node>=engine.Nodes() || begin>end || end>count){
+            ok=false;
+            return;
+        }
+        for(size_t k=begin;k<end;k++){
+            visits[k]++;
+        }
+    });
+    for(size_t k=0;k<count;k++){
+        ok=ok && visits[k]==1;
+    }
+    std::atomic<unsigned int> nodes_run{0};
+    for(unsigned int n=0;n<engine.Nodes();n++){
+        engine.On_Node(n,[&]{nodes_run++;});
+    }
+    ok=ok && nodes_run==engine.Nodes();
+    unsigned int len=3;
+    tenant_registry registry(72);
+    std::shared_ptr<tenant> owner=registry.Add("a",len);
+    tenant_batch batch(engine,owner);
+    std::vector<mpz_t*> msgs(300);
+    Fill_Messages(msgs.data(),msgs.size(),len,5);
+    std::vector<cipher_text_FE> cts=batch.Encrypt(msgs.data(),msgs.size());
+    mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+    for(unsigned int i=0;i<len;i++){
+        mpz_init_set_ui(y[i],2*i+1);
+    }
+    std::shared_ptr<decrypt_plan> plan=owner->scheme->Plan(y);
+    std::vector<plain_text> pts=batch.Decrypt(cts,*plan);
+    mpz_t result;
+    mpz_init(result);
+    for(size_t n=0;n<msgs.size();n++){
+        unsigned long inner=0;
+        for(unsigned int i=0;i<len;i++){
+            inner+=mpz_get_ui(msgs[n][i])*(2*i+1);
+        }
+        ok=ok && mpz_cmp_ui(pts[n].msg,inner)==0;
+        ok=ok && owner->Decrypt(result,cts[n],*plan) && mpz_cmp(result,pts[n].msg)==0;
+    }
+    mpz_clear(result);
+    for(unsigned int i=0;i<len;i++){
+        mpz_clear(y[i]);
+    }
+    free(y);
+    Free_Messages(msgs.data(),msgs.size(),len);
+    return ok && pts.size()==msgs.size();
+}
+
+//sharded_decryptor with spawned workers against Decrypt, and a worker fed malformed requests
+//g^(<x,y>) computed directly, for checking decryptions
+static void Inner_Product_Power(mpz_t result, mpz_t* x, mpz_t* y, unsigned int len){
+    mpz_t e;
+    mpz_init_set_ui(e,0);
+    for(unsigned int i=0;i<len;i++){
+        mpz_addmul(e,x[i],y[i]);
+    }
+    mpz_powm(result,ElGamal_Client::param.g,e,ElGamal_Client::param.p);
+    mpz_clear(e);
+}
+
+//Update_Plan in place against a fresh Plan, a bad index, versioned_plan under concurrent readers, and a sharded reload
+static bool Check_Update_Plan(){
+    unsigned int len=6;
+    FE_inner_product_DDH fe(len);
+    mpz_t& q=ElGamal_Client::param.q;
+    mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+    mpz_t delta[3];
+    for(unsigned int i=0;i<len;i++){
+        mpz_init_set_ui(y[i],i+1);
+    }
+    for(unsigned int k=0;k<3;k++){
+        mpz_init(delta[k]);
+    }
+    std::vector<mpz_t*> msgs(4);
+    Fill_Messages(msgs.data(),msgs.size(),len,11);
+    std::vector<cipher_text_FE> cts;
+    for(size_t n=0;n<msgs.size();n++){
+        cts.push_back(fe.Encrypt(msgs[n]));
+    }
+    mpz_t want;
+    mpz_init(want);
+    bool ok=true;
+    std::shared_ptr<decrypt_plan> plan=fe.Plan(y);
+    for(unsigned int round=0;round<20 && ok;round++){
+        unsigned int index[3]={round%len,(round*5+1)%len,(round+2)%len};//may repeat
+        for(unsigned int k=0;k<3;k++){
+            mpz_set_si(delta[k],(long)(round*7%13)-6);
+            mpz_add(y[index[k]],y[index[k]],delta[k]);
+            mpz_mod(y[index[k]],y[index[k]],q);
+        }
+        ok=fe.Update_Plan(*plan,index,delta,3) && plan->version==round+1;
+        std::shared_ptr<decrypt_plan> fresh=fe.Plan(y);
+        ok=ok && mpz_cmp(plan->sk.sk_y,fresh->sk.sk_y)==0;
+        for(unsigned int i=0;i<len && ok;i++){
+            ok=mpz_cmp(plan->y[i],y[i])==0;
+        }
+        for(size_t n=0;n<cts.size() && ok;n++){
+            plain_text pt=fe.Decrypt(cts[n],*plan);
+            Inner_Product_Power(want,msgs[n],y,len);
+            ok=mpz_cmp(pt.msg,want)==0;
+            mpz_clear(pt.msg);
+        }
+    }
+    //an index past the end is refused before anything changes
+    unsigned int bad[2]={0,len};
+    unsigned long version=plan->version;
+    mpz_set_ui(delta[0],5);mpz_set_ui(delta[1],5);
+    ok=ok && !fe.Update_Plan(*plan,bad,delta,2) && plan->version==version && mpz_cmp(plan->y[0],y[0])==0;
+    //readers of a versioned_plan always see a plan consistent with itself while a writer updates it
+    versioned_plan shared(fe,y);
+    std::atomic<bool> done(false),consistent(true);
+    std::vector<std::thread> readers;
+    for(unsigned int t=0;t<3;t++){
+        readers.emplace_back([&,t](){
+            mpz_t expected;
+            mpz_init(expected);
+            while(!done.load() && consistent.load()){
+                versioned_plan::reader r=shared.Read();
+                plain_text pt=fe.Decrypt(cts[t],*r);
+                Inner_Product_Power(expected,msgs[t],r->y,len);
+                if(mpz_cmp(pt.msg,expected)!=0){
+                    consistent.store(false);
+                }
+                mpz_clear(pt.msg);
+            }
+            mpz_clear(expected);
+        });
+    }
+    for(unsigned int round=0;round<200 && ok;round++){
+        unsigned int index[3]={round%len,(round+3)%len,(round*7)%len};
+        for(unsigned int k=0;k<3;k++){
+            mpz_set_ui(delta[k],round%5+1);
+            mpz_add(y[index[k]],y[index[k]],delta[k]);
+            mpz_mod(y[index[k]],y[index[k]],q);
+        }
+        ok=shared.Update(index,delta,3) && shared.Version()==round+1;
+    }
+    ok=ok && !shared.Update(bad,delta,2) && shared.Version()==200;
+    done.store(true);
+    for(auto& t:readers){
+        t.join();
+    }
+    ok=ok && consistent.load();
+    {
+        versioned_plan::reader r=shared.Read();
+        for(unsigned int i=0;i<len && ok;i++){
+            ok=mpz_cmp(r->y[i],y[i])==0;
+        }
+    }
+    //a sharded_decryptor sends a patched plan to its workers again
+    {
+        dlog_table dlog;
+        dlog.Build(ElGamal_Client::param.g,ElGamal_Client::param.p,9,8);
+        sharded_decryptor shards(fe,2);
+        mpz_t result;
+        mpz_init(result);
+        for(unsigned int round=0;round<3 && ok;round++){
+            plain_text pt=fe.Decrypt(cts[0],*plan);
+            ok=shards.Decrypt(cts[0],plan,dlog,result) && dlog.Lookup(want,pt.msg) && mpz_cmp(result,want)==0;
+            mpz_clear(pt.msg);
+            unsigned int index[1]={round};
+            mpz_set_ui(delta[0],round+1);
+            ok=ok && fe.Update_Plan(*plan,index,delta,1);
+        }
+        mpz_clear(result);
+    }
+    mpz_clear(want);
+    for(unsigned int k=0;k<3;k++){
+        mpz_clear(delta[k]);
+    }
+    for(unsigned int i=0;i<len;i++){
+        mpz_clear(y[i]);
+    }
+    free(y);
+    Free_Messages(msgs.data(),msgs.size(),len);
+    return ok;
+}
+
+static bool Check_Shards(){
+    unsigned int len=5;
+    FE_inner_product_DDH fe(len);
+    dlog_table dlog;
+    dlog.Build(ElGamal_Client::param.g,ElGamal_Client::param.p,9,8);
+    mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+    for(unsigned int i=0;i<len;i++){
+        mpz_init_set_ui(y[i],i%3);
+    }
+    std::shared_ptr<const decrypt_plan> plan=fe.Plan(y);
+    std::vector<mpz_t*> msgs(20);
+    Fill_Messages(msgs.data(),msgs.size(),len,7);
+    bool ok=true;
+    mpz_t result,want;
+    mpz_init(result);mpz_init(want);
+    {
+        sharded_decryptor shards(fe,2);
+        ok=shards.Workers()==2;
+        for(size_t n=0;n<msgs.size() && ok;n++){
+            cipher_text_FE ct=fe.Encrypt(msgs[n]);
+            plain_text pt=fe.Decrypt(ct,*plan);
+            ok=shards.Decrypt(ct,plan,dlog,result) && dlog.Lookup(want,pt.msg) && mpz_cmp(result,want)==0;
+            mpz_clear(pt.msg);
+            if(n==10){
+                ok=ok && shards.Unload(plan);//the next Decrypt loads the key again
+            }
+        }
+        ok=ok && !shards.Broken();
+    }
+    //a worker answers 1 to a bad window, an unknown key and a negative y, and hangs up on an oversized shard
+    std::vector<socket_channel> none;
+    int fd;
+    pid_t pid=socket_channel::Spawn(shard_worker::Serve,none,fd);
+    ok=ok && pid>=0;
+    if(pid>=0){
+        socket_channel ch(fd);
+        uint64_t status=0;
+        const uint64_t bad_window[3]={0,shard_worker::max_window+1,4};
+        for(unsigned int t=0;t<3;t++){
+            ch.Put_Word(shard_worker::op_load);
+            ch.Put_Word(1);
+            ch.Put_Mpz(ElGamal_Client::param.p);
+            ch.Put_Word(bad_window[t]);
+            ch.Put_Word(2);
+            mpz_set_si(want,t==2?-1:1);
+            ch.Put_Mpz(want);
+            ch.Put_Mpz(want);
+            ok=ok && ch.Flush() && ch.Get_Word(status) && status==1;
+        }
+        ch.Put_Word(shard_worker::op_product);
+        ch.Put_Word(1);
+        ch.Put_Word(1);
+        ch.Put_Mpz(want);
+        ok=ok && ch.Flush() && ch.Get_Word(status) && status==1;
+        ch.Put_Word(shard_worker::op_load);
+        ch.Put_Word(2);
+        ch.Put_Mpz(ElGamal_Client::param.p);
+        ch.Put_Word(4);
+        ch.Put_Word((uint64_t)shard_worker::max_length+1);
+        ok=ok && ch.Flush() && ch.Get_Word(status) && status==1 && !ch.Get_Word(status);
+        ch.Close();
+        waitpid(pid,NULL,0);
+    }
+    mpz_clear(result);mpz_clear(want);
+    for(unsigned int i=0;i<len;i++){
+        mpz_clear(y[i]);
+    }
+    free(y);
+    Free_Messages(msgs.data(),msgs.size(),len);
+    return ok;
+}
+
+//a batch encryption worker that reads the setup and then reports every range it is given as failed
+static void Failing_Worker(int fd){
+    socket_channel ch(fd);
+    uint64_t len,seed,kind,range=0,attempt=0,offset,count;
+    std::string input,prefix;
+    bool ok=ch.Get_Word(len);
+    mpz_t h;
+    mpz_init(h);
+    for(uint64_t i=0;i<len && ok;i++){
+        ok=ch.Get_Mpz(h);
+    }
+    mpz_clear(h);
+    ok=ok && ch.Get_Word(seed) && ch.Get_String(input) && ch.Get_String(prefix);
+    ch.Put_Word(batch_encrypt_worker::msg_request);
+    while(ok && ch.Flush() && ch.Get_Word(kind) && kind!=batch_encrypt_worker::msg_done){
+        ok=ch.Get_Word(range) && ch.Get_Word(attempt);
+        if(kind==batch_encrypt_worker::msg_range){
+            ok=ok && ch.Get_Word(offset) && ch.Get_Word(count);
+            ch.Put_Word(batch_encrypt_worker::msg_failed);
+        }else{
+            ch.Put_Word(batch_encrypt_worker::msg_cancelled);
+        }
+        ch.Put_Word(range);
+        ch.Put_Word(attempt);
+    }
+    ch.Close();
+}
+
+//decrypt every record listed in output.index with plan and compare with the inner products of msgs
+static bool Check_Segments(FE_inner_product_DDH& fe, const std::string& output, const decrypt_plan& plan, mpz_t** msgs, size_t count){
+    std::vector<batch_encrypt_coordinator::index_entry> entries;
+    if(!batch_encrypt_coordinator::Read_Index(output,entries) || entries.empty() || entries.back().first+entries.back().count!=count){
+        return false;
+    }
+    unsigned int len=fe.Length();
+    cipher_text_FE ct(len);
+    mpz_t want;
+    mpz_init(want);
+    bool ok=true;
+    for(size_t e=0;e<entries.size() && ok;e++){
+        FILE* segment=fopen(entries[e].segment.c_str(),"r");
+        ok=segment!=NULL;
+        for(uint64_t n=entries[e].first;n<entries[e].first+entries[e].count && ok;n++){
+            ok=gmp_fscanf(segment,"%Zx",ct.c0)==1;
+            unsigned long inner=0;
+            for(unsigned int i=0;i<len && ok;i++){
+                ok=gmp_fscanf(segment,"%Zx",ct.c1[i])==1;
+                inner+=mpz_get_ui(msgs[n][i])*mpz_get_ui(plan.y[i]);
+            }
+            if(ok){
+                plain_text pt=fe.Decrypt(ct,plan);
+                mpz_powm_ui(want,ElGamal_Client::param.g,inner,ElGamal_Client::param.p);
+                ok=mpz_cmp(pt.msg,want)==0;
+                mpz_clear(pt.msg);
+            }
+        }
+        if(segment!=NULL){
+            fclose(segment);
+        }
+        remove(entries[e].segment.c_str());
+    }
+    mpz_clear(ct.c0);mpz_clear(want);
+    for(unsigned int i=0;i<len;i++){
+        mpz_clear(ct.c1[i]);
+    }
+    free(ct.c1);
+    return ok;
+}
+
+/*batch_encrypt_coordinator end to end: segments that decrypt to the inputs, ranges of a failing
+worker taken over by the other one, a malformed record that fails the job, and a truncated index
+*/
+static bool Check_Batch_Encrypt(){
+    unsigned int len=3;
+    size_t count=40;
+    FE_inner_product_DDH fe(len);
+    std::vector<mpz_t*> msgs(count);
+    Fill_Messages(msgs.data(),count,len,9);
+    std::string input="/tmp/fe_check_input."+std::to_string(getpid()),output="/tmp/fe_check_output."+std::to_string(getpid());
+    FILE* f=fopen(input.c_str(),"w");
+    if(f==NULL){
+        Free_Messages(msgs.data(),count,len);
+        return false;
+    }
+    for(size_t n=0;n<count;n++){
+        gmp_fprintf(f,n==count/2?"\n%Zd %Zd %Zd\n":"%Zd %Zd %Zd\n",msgs[n][0],msgs[n][1],msgs[n][2]);//with one empty line
+    }
+    fclose(f);
+    mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+    for(unsigned int i=0;i<len;i++){
+        mpz_init_set_ui(y[i],i+2);
+    }
+    std::shared_ptr<decrypt_plan> plan=fe.Plan(y);
+    bool ok;
+    {
+        batch_encrypt_coordinator coordinator(fe,2);
+        coordinator.range_records=8;
+        ok=coordinator.Run(input,output) && Check_Segments(fe,output,*plan,msgs.data(),count);
+    }
+    std::vector<socket_channel> open;
+    std::vector<int> fds(2);
+    pid_t pids[2]={socket_channel::Spawn(batch_encrypt_worker::Serve,open,fds[0]),-1};
+    if(pids[0]>=0){
+        open.emplace_back(fds[0]);
+        pids[1]=socket_channel::Spawn(Failing_Worker,open,fds[1]);
+    }
+    if(pids[1]>=0){
+        {
+            batch_encrypt_coordinator coordinator(fe,fds);
+            coordinator.range_records=8;
+            ok=ok && coordinator.Run(input,output) && Check_Segments(fe,output,*plan,msgs.data(),count);
+        }
+        waitpid(pids[1],NULL,0);
+    }else{
+        ok=false;
+        if(pids[0]>=0){
+            close(fds[0]);
+        }
+    }
+    if(pids[0]>=0){
+        waitpid(pids[0],NULL,0);
+    }
+    //cut the index in the middle of its last line
+    std::string index=output+".index";
+    std::vector<batch_encrypt_coordinator::index_entry> entries;
+    ok=ok && batch_encrypt_coordinator::Read_Index(output,entries) && entries.size()==(count+7)/8;
+    f=fopen(index.c_str(),"r+");
+    if(f!=NULL){
+        fseek(f,0,SEEK_END);
+        ok=ok && ftruncate(fileno(f),ftell(f)-3)==0;
+        fclose(f);
+    }
+    entries.clear();
+    ok=ok && !batch_encrypt_coordinator::Read_Index(output,entries) && entries.size()==(count+7)/8-1;
+    //a record with a missing component fails on every worker
+    f=fopen(input.c_str(),"a");
+    if(f!=NULL){
+        fputs("1 2\n",f);
+        fclose(f);
+    }
+    {
+        batch_encrypt_coordinator coordinator(fe,2);
+        coordinator.range_records=8;
+        ok=ok && !coordinator.Run(input,output);
+    }
+    remove(input.c_str());
+    remove(index.c_str());
+    for(unsigned int i=0;i<len;i++){
+        mpz_clear(y[i]);
+    }
+    free(y);
+    Free_Messages(msgs.data(),count,len);
+    return ok;
+}
+
+//r = k * q by plain double-and-add, the reference for the curve self-checks
+static void Naive_Multiply(const ec_group& curve, ec_point& r, const ec_affine& q, const mpz_t k){
+    mpz_t e;
+    mpz_init(e);
+    mpz_mod(e,k,curve.n);
+    curve.Set_Infinity(r);
+    for(long b=(long)mpz_sizeinbase(e,2)-1;b>=0 && mpz_sgn(e)!=0;b--){
+        curve.Point_Double(r,r);
+        if(mpz_tstbit(e,b)){
+            curve.Point_Add(r,r,q);
+        }
+    }
+    mpz_clear(e);
+}
+
+static bool Same_Point(const ec_group& curve, const ec_point& u, const ec_point& v){
+    ec_affine a,b;
+    curve.To_Affine(a,u);
+    curve.To_Affine(b,v);
+    if(a.infinity || b.infinity){
+        return a.infinity==b.infinity;
+    }
+    return curve.Field_Equal(a.x,b.x) && curve.Field_Equal(a.y,b.y);
+}
+
+//the points i * G for i = 1..count, normalized together
+static std::vector<ec_affine> Multiples_Of_G(const ec_group& curve, size_t count){
+    std::vector<ec_point> t(count);
+    ec_point acc;
+    curve.From_Affine(acc,curve.G);
+    for(size_t i=0;i<count;i++){
+        t[i]=acc;
+        curve.Point_Add(acc,acc,curve.G);
+    }
+    std::vector<ec_affine> points(count);
+    curve.Batch_To_Affine(points.data(),t.data(),count);
+    return points;
+}
+
+/*Multiply and Multi_Multiply against double-and-add on both curves, with scalars that are 0, above n,
+or just below n (small negative weights), on one thread and on four; then the decrypt product of
+10^5 dimensions with 16-bit weights is checked and timed
+*/
+static bool Check_Curve_MSM(){
+    gmp_randstate_t state;
+    gmp_randinit_mt(state);
+    gmp_randseed_ui(state,85);
+    const ec_group* curves[2]={&ec_group::P256(),&ec_group::Secp256k1()};
+    const char* names[2]={"P-256","secp256k1"};
+    bool ok=true;
+    for(int c=0;c<2;c++){
+        const ec_group& curve=*curves[c];
+        size_t count=200;
+        std::vector<ec_affine> points(count);
+        std::vector<ec_point> t(count);
+        mpz_t* k=(mpz_t *) malloc(count * sizeof(mpz_t));
+        ec_point want,got,term;
+        curve.Set_Infinity(want);
+        for(size_t i=0;i<count;i++){
+            mpz_init(k[i]);
+            mpz_urandomm(k[i],state,curve.n);
+            Naive_Multiply(curve,t[i],curve.G,k[i]);
+            if(i%11==0){
+                mpz_set_ui(k[i],0);
+            }else if(i%7==0){
+                mpz_sub_ui(k[i],curve.n,i);
+            }else if(i%13==0){
+                mpz_add(k[i],k[i],curve.n);
+            }
+        }
+        curve.Batch_To_Affine(points.data(),t.data(),count);
+        for(size_t i=0;i<count;i++){
+            Naive_Multiply(curve,term,points[i],k[i]);
+            curve.Multiply(got,points[i],k[i]);
+            ok=ok && Same_Point(curve,got,term);
+            curve.Point_Add(want,want,term);
+        }
+        curve.Multi_Multiply(got,points.data(),k,count,1);
+        ok=ok && Same_Point(curve,got,want);
+        curve.Multi_Multiply(got,points.data(),k,count,4);
+        ok=ok && Same_Point(curve,got,want);
+        curve.Multi_Multiply(got,points.data(),k,0);
+        ok=ok && curve.Is_Infinity(got);
+        for(size_t i=0;i<count;i++){
+            mpz_clear(k[i]);
+        }
+        free(k);
+        //with P_{i} = (i+1) * G the product is (Sum (i+1) * k_{i}) * G, which checks it cheaply
+        count=100000;
+        points=Multiples_Of_G(curve,count);
+        k=(mpz_t *) malloc(count * sizeof(mpz_t));
+        mpz_t sum;
+        mpz_init_set_ui(sum,0);
+        for(size_t i=0;i<count;i++){
+            mpz_init(k[i]);
+            mpz_urandomb(k[i],state,16);
+            mpz_addmul_ui(sum,k[i],i+1);
+        }
+        std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+        curve.Multi_Multiply(got,points.data(),k,count);
+        double ms=std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-start).count();
+        printf("Curve decrypt product, %s, %zu dimensions, 16-bit weights: %.1f ms\n",names[c],count,ms);
+        Naive_Multiply(curve,want,curve.G,sum);
+        ok=ok && Same_Point(curve,got,want);
+        mpz_clear(sum);
+        for(size_t i=0;i<count;i++){
+            mpz_clear(k[i]);
+        }
+        free(k);
+    }
+    gmp_randclear(state);
+    return ok;
+}
+
+static bool Same_Affine(const ec_group& curve, const ec_affine& a, const ec_affine& b){
+    if(a.infinity || b.infinity){
+        return a.infinity==b.infinity;
+    }
+    return curve.Field_Equal(a.x,b.x) && curve.Field_Equal(a.y,b.y);
+}
+
+/*Batch_To_Affine against To_Affine, Encode and Decode round trips with the point at infinity among
+the points, Decode of malformed encodings, and curve cipher texts through Serialize, Deserialize and Decrypt
+*/
+static bool Check_Point_Encoding(){
+    gmp_randstate_t state;
+    gmp_randinit_mt(state);
+    gmp_randseed_ui(state,86);
+    const ec_group* curves[2]={&ec_group::P256(),&ec_group::Secp256k1()};
+    bool ok=true;
+    mpz_t k;
+    mpz_init(k);
+    for(int c=0;c<2;c++){
+        const ec_group& curve=*curves[c];
+        size_t count=37;
+        std::vector<ec_point> t(count);
+        for(size_t i=0;i<count;i++){
+            mpz_urandomm(k,state,curve.n);
+            Naive_Multiply(curve,t[i],curve.G,k);//Jacobian, with Z != 1
+        }
+        curve.Set_Infinity(t[5]);
+        std::vector<ec_affine> batch(count),back(count);
+        curve.Batch_To_Affine(batch.data(),t.data(),count);
+        for(size_t i=0;i<count;i++){
+            ec_affine single;
+            curve.To_Affine(single,t[i]);
+            ok=ok && Same_Affine(curve,batch[i],single) && curve.On_Curve(batch[i]);
+        }
+        std::vector<unsigned char> bytes(count*ec_group::point_bytes);
+        curve.Encode(bytes.data(),batch.data(),count);
+        ok=ok && curve.Decode(back.data(),bytes.data(),count);
+        for(size_t i=0;i<count;i++){
+            ok=ok && Same_Affine(curve,batch[i],back[i]);
+        }
+        //a bad tag, an infinity with an x, x = p, and an x with no point above it
+        std::vector<unsigned char> bad(bytes.begin(),bytes.begin()+ec_group::point_bytes);
+        bad[0]=4;
+        ok=ok && !curve.Decode(back.data(),bad.data(),1);
+        bad[0]=0;
+        ok=ok && !curve.Decode(back.data(),bad.data(),1);
+        bad[0]=2;
+        mpz_export(&bad[1],NULL,1,1,1,0,curve.p);
+        ok=ok && !curve.Decode(back.data(),bad.data(),1);
+        for(unsigned long x=1;;x++){
+            ec_affine q;
+            fp_elem y2;
+            mpz_set_ui(k,x);
+            curve.To_Field(q.x,k);
+            curve.Field_Sqr(y2,q.x);
+            curve.Field_Add(y2,y2,curve.a_m);
+            curve.Field_Mul(y2,y2,q.x);
+            curve.Field_Add(y2,y2,curve.b_m);
+            fp_elem root;
+            if(!curve.Field_Sqrt(&root,&y2,1)){
+                std::fill(bad.begin()+1,bad.end(),0);
+                bad.back()=(unsigned char)x;
+                ok=ok && !curve.Decode(back.data(),bad.data(),1);
+                break;
+            }
+        }
+        //cipher texts through Serialize and Deserialize still decrypt to <x,y>
+        unsigned int len=4;
+        FE_inner_product_DDH_curve fe(curve,len,state);
+        std::vector<mpz_t*> msgs(10);
+        Fill_Messages(msgs.data(),msgs.size(),len,11);
+        std::vector<cipher_text_FE_curve> cts=fe.Encrypt_Batch(msgs.data(),msgs.size(),state),read;
+        std::string serialized=fe.Serialize(cts);
+        ok=ok && fe.Deserialize(serialized,read) && read.size()==cts.size();
+        ok=ok && !fe.Deserialize(serialized.substr(1),read);
+        fe.Deserialize(serialized,read);
+        mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+        for(unsigned int i=0;i<len;i++){
+            mpz_init_set_ui(y[i],i+1);
+        }
+        mpz_t sk_y;
+        mpz_init(sk_y);
+        fe.Key_Derivation(sk_y,y);
+        curve_dlog_table dlog(curve,16,4);
+        for(size_t n=0;n<read.size() && ok;n++){
+            unsigned long inner=0;
+            for(unsigned int i=0;i<len;i++){
+                inner+=mpz_get_ui(msgs[n][i])*(i+1);
+                ok=ok && Same_Affine(curve,read[n].c1[i],cts[n].c1[i]);
+            }
+            ok=ok && Same_Affine(curve,read[n].c0,cts[n].c0) && fe.Decrypt(k,read[n],y,sk_y,dlog) && mpz_cmp_ui(k,inner)==0;
+        }
+        mpz_clear(sk_y);
+        for(unsigned int i=0;i<len;i++){
+            mpz_clear(y[i]);
+        }
+        free(y);
+        Free_Messages(msgs.data(),msgs.size(),len);
+    }
+    mpz_clear(k);
+    gmp_randclear(state);
+    return ok;
+}
+
+/*the GLV split of secp256k1: k1 + k2 * lambda = k (mod n) with k1, k2 of at most 129 bits, for
+random and edge-case k; phi(P) = lambda * P; and Multiply against double-and-add
+*/
+static bool Check_GLV(){
+    const ec_group& curve=ec_group::Secp256k1();
+    gmp_randstate_t state;
+    gmp_randinit_mt(state);
+    gmp_randseed_ui(state,87);
+    mpz_t k,k1,k2,t;
+    mpz_init(k);mpz_init(k1);mpz_init(k2);mpz_init(t);
+    bool ok=curve.glv && !ec_group::P256().glv;
+    ec_point want,got;
+    for(int i=0;i<200 && ok;i++){
+        if(i==0){
+            mpz_set_ui(k,0);
+        }else if(i==1){
+            mpz_sub_ui(k,curve.n,1);
+        }else if(i==2){
+            mpz_set(k,curve.lambda);
+        }else if(i==3){
+            mpz_mul_2exp(k,curve.n,1);
+            mpz_add_ui(k,k,5);
+        }else if(i==4){
+            mpz_set_si(k,-3);
+        }else{
+            mpz_urandomb(k,state,256+i%3);
+        }
+        curve.Decompose(k1,k2,k);
+        mpz_addmul(k1,k2,curve.lambda);
+        mpz_sub(t,k1,k);
+        ok=mpz_divisible_p(t,curve.n) && mpz_sizeinbase(k2,2)<=129;
+        mpz_submul(k1,k2,curve.lambda);
+        ok=ok && mpz_sizeinbase(k1,2)<=129;
+        if(i<20){
+            Naive_Multiply(curve,want,curve.G,k);
+            curve.Multiply(got,curve.G,k);
+            ok=ok && Same_Point(curve,got,want);
+        }
+    }
+    ec_affine phi;
+    curve.Endomorphism(phi,curve.G);
+    curve.From_Affine(got,phi);
+    Naive_Multiply(curve,want,curve.G,curve.lambda);
+    ok=ok && Same_Point(curve,got,want) && curve.On_Curve(phi);
+    mpz_clear(k);mpz_clear(k1);mpz_clear(k2);mpz_clear(t);
+    gmp_randclear(state);
+    return ok;
+}
+
+//fe_setup accepts dlog_bound up to q and refuses 0 and anything above q
+static bool Check_Setup_Bounds(){
+    unsigned long q=mpz_get_ui(ElGamal_Client::param.q);
+    fe_scheme* at_q=fe_setup(2,q);
+    bool ok=at_q!=NULL && fe_setup(2,q+1)==NULL && fe_setup(2,0)==NULL && fe_setup(0,q)==NULL;
+    fe_scheme_free(at_q);
+    return ok;
+}
+
+/*ciphertext_writer and ciphertext_reader round trips at 7 bits (p = 73) and at 200 bits, with
+gaps in the ids and a partial last block; ids out of order, a bad magic and a cut container are refused
+*/
+static bool Check_Container(){
+    gmp_randstate_t state;
+    gmp_randinit_mt(state);
+    gmp_randseed_ui(state,90);
+    unsigned int len=3;
+    size_t count=2500,block=1000;
+    mpz_t p;
+    mpz_init(p);
+    bool ok=true;
+    for(int pass=0;pass<2;pass++){
+        if(pass==0){
+            mpz_set(p,ElGamal_Client::param.p);
+        }else{
+            mpz_urandomb(p,state,200);
+            mpz_setbit(p,199);
+        }
+        unsigned int bits=(unsigned int)mpz_sizeinbase(p,2);
+        std::vector<cipher_text_FE> cts;
+        std::vector<uint64_t> ids(count);
+        ciphertext_writer writer(len,p,block);
+        for(size_t n=0;n<count;n++){
+            cts.emplace_back(len);
+            mpz_urandomm(cts[n].c0,state,p);
+            for(unsigned int i=0;i<len;i++){
+                mpz_urandomm(cts[n].c1[i],state,p);
+            }
+            mpz_set(cts[n].c1[n%len],p);
+            mpz_sub_ui(cts[n].c1[n%len],cts[n].c1[n%len],1);//the widest element, p - 1
+            ids[n]=(n==0?5:ids[n-1]+1+n%4);
+            ok=ok && writer.Add(ids[n],cts[n]);
+        }
+        ok=ok && !writer.Add(ids[count-1],cts[0]);
+        std::string bytes=writer.Finish();
+        ok=ok && bytes.size()<=count*(len+1)*bits/8+count+64;//no padding between elements: the ids and header are all that is added
+        ciphertext_reader reader;
+        ok=ok && reader.Open(bytes) && reader.Blocks()==(count+block-1)/block && reader.bits==bits;
+        std::vector<uint64_t> read_ids;
+        std::vector<cipher_text_FE> read;
+        for(size_t b=0;b<reader.Blocks() && ok;b++){
+            ok=reader.Read_Block(b,read_ids,read) && read_ids.size()==reader.Block_Records(b);
+            for(size_t k=0;k<read_ids.size() && ok;k++){
+                const cipher_text_FE& want=cts[b*block+k];
+                ok=read_ids[k]==ids[b*block+k] && mpz_cmp(read[k].c0,want.c0)==0;
+                for(unsigned int i=0;i<len;i++){
+                    ok=ok && mpz_cmp(read[k].c1[i],want.c1[i])==0;
+                }
+            }
+        }
+        ciphertext_reader broken;
+        std::string bad=bytes;
+        bad[0]='X';
+        ok=ok && !broken.Open(bad) && !broken.Open(bytes.substr(0,bytes.size()/2));
+        for(std::vector<cipher_text_FE>* list:{&cts,&read}){
+            for(size_t n=0;n<list->size();n++){
+                mpz_clear((*list)[n].c0);
+                for(unsigned int i=0;i<len;i++){
+                    mpz_clear((*list)[n].c1[i]);
+                }
+                free((*list)[n].c1);
+            }
+        }
+    }
+    mpz_clear(p);
+    gmp_randclear(state);
+    return ok;
+}
+
+/*joint_base_table::Power against two mpz_powm: every pair of exponents mod q of the demo group at
+windows 1 to 4, and 256-bit exponents mod a 256-bit prime; then Encrypt with joint tables against
+Encrypt with separate tables under the same commitments
+*/
+static bool Check_Joint_Base(){
+    const ElGamal_Param& param=ElGamal_Client::param;
+    gmp_randstate_t state;
+    gmp_randinit_mt(state);
+    gmp_randseed_ui(state,91);
+    mpz_t e1,e2,got,want,t,p,h;
+    mpz_init(e1);mpz_init(e2);mpz_init(got);mpz_init(want);mpz_init(t);mpz_init(p);mpz_init(h);
+    bool ok=true;
+    unsigned int exp_bits=(unsigned int)mpz_sizeinbase(param.q,2);
+    mpz_set_ui(h,5);
+    for(unsigned int w=1;w<=4;w++){
+        joint_base_table table;
+        table.Build(param.g,h,param.p,exp_bits,w);
+        unsigned long q=mpz_get_ui(param.q);
+        for(unsigned long a=0;a<q && ok;a++){
+            for(unsigned long b=0;b<q && ok;b++){
+                mpz_set_ui(e1,a);mpz_set_ui(e2,b);
+                table.Power(got,e1,e2,param.p);
+                mpz_powm(want,param.g,e1,param.p);
+                mpz_powm(t,h,e2,param.p);
+                mpz_mul(want,want,t);
+                mpz_mod(want,want,param.p);
+                ok=mpz_cmp(got,want)==0;
+            }
+        }
+    }
+    mpz_urandomb(p,state,256);
+    mpz_setbit(p,255);
+    mpz_nextprime(p,p);
+    mpz_urandomm(h,state,p);
+    joint_base_table wide;
+    wide.Build(param.g,h,p,256,3);
+    for(int k=0;k<50 && ok;k++){
+        mpz_urandomb(e1,state,256);
+        mpz_urandomb(e2,state,256);
+        if(k==0){
+            mpz_set_ui(e1,0);
+            mpz_ui_pow_ui(e2,2,256);
+            mpz_sub_ui(e2,e2,1);
+        }
+        wide.Power(got,e1,e2,p);
+        mpz_powm(want,param.g,e1,p);
+        mpz_powm(t,h,e2,p);
+        mpz_mul(want,want,t);
+        mpz_mod(want,want,p);
+        ok=mpz_cmp(got,want)==0;
+    }
+    unsigned int len=3;
+    FE_inner_product_DDH fe(len);
+    fixed_base_table g_table;
+    g_table.Build(param.g,param.p,exp_bits,4);
+    std::vector<fixed_base_table> h_tables(len);
+    std::vector<joint_base_table> gh_tables(len);
+    for(unsigned int i=0;i<len;i++){
+        h_tables[i].Build(fe.key_gen[i].h,param.p,exp_bits,4);
+        gh_tables[i].Build(param.g,fe.key_gen[i].h,param.p,exp_bits,4);
+    }
+    std::vector<mpz_t*> msgs(30);
+    Fill_Messages(msgs.data(),msgs.size(),len,13);
+    mpz_set_si(msgs[0][0],-1);//reduced modulo q first
+    gmp_randstate_t same;
+    gmp_randinit_mt(same);
+    for(size_t n=0;n<msgs.size();n++){
+        gmp_randseed_ui(state,n);
+        gmp_randseed_ui(same,n);
+        cipher_text_FE split=FE_inner_product_DDH::Encrypt(msgs[n],g_table,h_tables,state);
+        cipher_text_FE joint=FE_inner_product_DDH::Encrypt(msgs[n],g_table,gh_tables,same);
+        ok=ok && mpz_cmp(split.c0,joint.c0)==0;
+        for(unsigned int i=0;i<len;i++){
+            ok=ok && mpz_cmp(split.c1[i],joint.c1[i])==0;
+            mpz_clear(split.c1[i]);mpz_clear(joint.c1[i]);
+        }
+        mpz_clear(split.c0);mpz_clear(joint.c0);
+        free(split.c1);free(joint.c1);
+    }
+    Free_Messages(msgs.data(),msgs.size(),len);
+    mpz_clear(e1);mpz_clear(e2);mpz_clear(got);mpz_clear(want);mpz_clear(t);mpz_clear(p);mpz_clear(h);
+    gmp_randclear(state);gmp_randclear(same);
+    return ok;
+}
+
+/*record_packer: the choice of k, Pack then an inner product in the clear that Unpack splits into the
+records' inner products, and the same through tenant::Encrypt_Packed and Decrypt_Packed
+*/
+static bool Check_Record_Packer(){
+    unsigned int len=2;
+    record_packer packer(len,1,1,72),single(3,3,3,72),none(3,10,10,72);
+    bool ok=packer.k==3 && mpz_cmp_ui(packer.base,3)==0 && single.k==1 && none.k==0;//B = 3, 28 and 301 against q = 72
+    ok=ok && packer.Ciphertexts(10)==4 && none.Ciphertexts(10)==0;
+    size_t count=10;
+    std::vector<mpz_t*> records(count);
+    for(size_t n=0;n<count;n++){
+        records[n]=(mpz_t *) malloc(len * sizeof(mpz_t));
+        for(unsigned int i=0;i<len;i++){
+            mpz_init_set_ui(records[n][i],(n>>i)&1);
+        }
+    }
+    mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+    mpz_t* packed=(mpz_t *) malloc(len * sizeof(mpz_t));
+    mpz_t* values=(mpz_t *) malloc(packer.k * sizeof(mpz_t));
+    for(unsigned int i=0;i<len;i++){
+        mpz_init_set_ui(y[i],1);
+        mpz_init(packed[i]);
+    }
+    for(unsigned int j=0;j<packer.k;j++){
+        mpz_init(values[j]);
+    }
+    mpz_t ip;
+    mpz_init(ip);
+    for(size_t first=0;first<count;first+=packer.k){
+        size_t n=count-first<packer.k?count-first:packer.k;
+        packer.Pack(packed,records.data()+first,n);
+        mpz_set_ui(ip,0);
+        for(unsigned int i=0;i<len;i++){
+            mpz_addmul(ip,packed[i],y[i]);
+        }
+        packer.Unpack(values,ip,n);
+        for(size_t j=0;j<n;j++){
+            ok=ok && mpz_get_ui(values[j])==mpz_get_ui(records[first+j][0])+mpz_get_ui(records[first+j][1]);
+        }
+    }
+    tenant_registry registry(72);
+    std::shared_ptr<tenant> owner=registry.Add("packed",len);
+    std::shared_ptr<decrypt_plan> plan=owner->scheme->Plan(y);
+    std::vector<cipher_text_FE> cts=owner->Encrypt_Packed(packer,records.data(),count);
+    ok=ok && cts.size()==packer.Ciphertexts(count);
+    for(size_t c=0;c<cts.size() && ok;c++){
+        size_t n=count-c*packer.k<packer.k?count-c*packer.k:packer.k;
+        ok=owner->Decrypt_Packed(values,cts[c],*plan,packer,n);
+        for(size_t j=0;j<n;j++){
+            size_t r=c*packer.k+j;
+            ok=ok && mpz_get_ui(values[j])==mpz_get_ui(records[r][0])+mpz_get_ui(records[r][1]);
+        }
+    }
+    for(size_t c=0;c<cts.size();c++){
+        mpz_clear(cts[c].c0);
+        for(unsigned int i=0;i<len;i++){
+            mpz_clear(cts[c].c1[i]);
+        }
+        free(cts[c].c1);
+    }
+    mpz_clear(ip);
+    for(unsigned int j=0;j<packer.k;j++){
+        mpz_clear(values[j]);
+    }
+    for(unsigned int i=0;i<len;i++){
+        mpz_clear(y[i]);mpz_clear(packed[i]);
+    }
+    free(values);free(y);free(packed);
+    Free_Messages(records.data(),count,len);
+    return ok;
+}
+
+//window_aggregator against the componentwise product of the last W cipher texts, and the decryption of Aggregate against the windowed sum
+static bool Check_Window_Aggregator(){
+    unsigned int len=4;
+    FE_inner_product_DDH fe(len);
+    mpz_t& p=ElGamal_Client::param.p;
+    mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+    for(unsigned int i=0;i<len;i++){
+        mpz_init_set_ui(y[i],i+2);
+    }
+    std::shared_ptr<const decrypt_plan> plan=fe.Plan(y);
+    std::vector<mpz_t*> msgs(12);
+    Fill_Messages(msgs.data(),msgs.size(),len,5);
+    std::vector<cipher_text_FE> cts;
+    for(size_t n=0;n<msgs.size();n++){
+        cts.push_back(fe.Encrypt(msgs[n]));
+    }
+    bool ok=true;
+    try{
+        window_aggregator empty(len,0,p);
+        ok=false;
+    }catch(const std::invalid_argument&){
+    }
+    mpz_t want,term;
+    mpz_init(want);mpz_init(term);
+    const size_t windows[3]={1,3,5};
+    for(unsigned int w=0;w<3 && ok;w++){
+        window_aggregator agg(len,windows[w],p);
+        cipher_text_FE out(len);
+        for(size_t n=0;n<cts.size() && ok;n++){
+            agg.Push(cts[n]);
+            size_t first=n+1>windows[w]?n+1-windows[w]:0;
+            ok=agg.Size()==n+1-first;
+            if(n%3==1 && n+1<cts.size()){
+                continue;//several expirations pile up before the next Aggregate
+            }
+            agg.Aggregate(out);
+            for(unsigned int i=0;i<=len && ok;i++){
+                mpz_set_ui(want,1);
+                for(size_t k=first;k<=n;k++){
+                    mpz_mul(want,want,i==0?cts[k].c0:cts[k].c1[i-1]);
+                    mpz_mod(want,want,p);
+                }
+                ok=mpz_cmp(want,i==0?out.c0:out.c1[i-1])==0;
+            }
+            plain_text pt=fe.Decrypt(out,*plan);
+            mpz_set_ui(want,1);
+            for(size_t k=first;k<=n;k++){
+                Inner_Product_Power(term,msgs[k],y,len);
+                mpz_mul(want,want,term);
+                mpz_mod(want,want,p);
+            }
+            ok=ok && mpz_cmp(pt.msg,want)==0;
+            mpz_clear(pt.msg);
+        }
+    }
+    mpz_clear(want);mpz_clear(term);
+    for(unsigned int i=0;i<len;i++){
+        mpz_clear(y[i]);
+    }
+    free(y);
+    Free_Messages(msgs.data(),msgs.size(),len);
+    return ok;
+}
+
+//tiered_dlog and sorted_dlog_table against dlog_table::Lookup over the whole range and past it, in the demo group and in a 127-bit group
+static bool Check_Dlog_Variants(){
+    mpz_t p,g,k,want,h;
+    mpz_init(p);mpz_init(g);mpz_init(k);mpz_init(want);mpz_init(h);
+    bool ok=true;
+    for(unsigned int group=0;group<2 && ok;group++){
+        unsigned long baby=5,giant=4,past=72;//exponents 0..19 are in range, 20..71 are not
+        if(group==0){
+            mpz_set(p,ElGamal_Client::param.p);
+            mpz_set(g,ElGamal_Client::param.g);
+        }else{
+            mpz_ui_pow_ui(p,2,127);
+            mpz_sub_ui(p,p,1);//a Mersenne prime; 3 has an order far beyond the exponents tried
+            mpz_set_ui(g,3);
+            baby=100;giant=30;past=3300;
+        }
+        unsigned long bound=baby*giant;
+        dlog_table full;
+        full.Build(g,p,baby,giant);
+        tiered_dlog tiered(full,g,1024);//a hot table of a few dozen slots, so most lookups fall through
+        tiered.learning=false;
+        sorted_dlog_table sorted;
+        sorted.Build(g,p,baby,giant,3);
+        for(unsigned int pass=0;pass<2 && ok;pass++){
+            tiered.Configure(pass==0?0:bound/2);
+            mpz_set_ui(h,1);
+            for(unsigned long e=0;e<past && ok;e++){
+                bool in=full.Lookup(want,h);
+                ok=in==(e<bound) && (!in || mpz_cmp_ui(want,e)==0);
+                ok=ok && tiered.Lookup(k,h)==in && (!in || mpz_cmp(k,want)==0);
+                ok=ok && sorted.Lookup(k,h)==in && (!in || mpz_cmp(k,want)==0);
+                mpz_mul(h,h,g);
+                mpz_mod(h,h,p);
+            }
+        }
+        ok=ok && tiered.hits>0 && tiered.misses>0;
+        if(group==1){//an element that is no small power of g, whose truncated hash may still collide
+            for(unsigned long e=2;e<200 && ok;e++){
+                mpz_set_ui(h,e*e+1);
+                ok=!full.Lookup(k,h) && !tiered.Lookup(k,h) && !sorted.Lookup(k,h);
+            }
+        }
+    }
+    mpz_clear(p);mpz_clear(g);mpz_clear(k);mpz_clear(want);mpz_clear(h);
+    return ok;
+}
+
+//Lookup_Batch against Lookup, for elements in and out of range and a count that ends in a partial group
+static bool Check_Lookup_Batch(){
+    mpz_t& p=ElGamal_Client::param.p;
+    dlog_table dlog;
+    dlog.Build(ElGamal_Client::param.g,p,5,4);//exponents 0..19 of the 72 are found
+    size_t count=2*dlog_table::batch_group+5;
+    mpz_t* k=(mpz_t *) malloc(count * sizeof(mpz_t));
+    mpz_t* h=(mpz_t *) malloc(count * sizeof(mpz_t));
+    bool* found=(bool *) malloc(count * sizeof(bool));
+    for(size_t a=0;a<count;a++){
+        mpz_init(k[a]);mpz_init(h[a]);
+        mpz_powm_ui(h[a],ElGamal_Client::param.g,(unsigned long)(a*7%72),p);
+    }
+    dlog.Lookup_Batch(k,h,count,found);
+    bool ok=true;
+    mpz_t one;
+    mpz_init(one);
+    for(size_t a=0;a<count;a++){
+        bool hit=dlog.Lookup(one,h[a]);
+        ok=ok && found[a]==hit && (!hit || mpz_cmp(k[a],one)==0) && hit==(a*7%72<20);
+    }
+    mpz_clear(one);
+    for(size_t a=0;a<count;a++){
+        mpz_clear(k[a]);mpz_clear(h[a]);
+    }
+    free(k);free(h);free(found);
+    return ok;
+}
+
+//Evaluate against Decrypt and Lookup for every key and cipher text, with partial blocks of both and results out of range
+static bool Check_Evaluate(){
+    unsigned int len=4;
+    size_t n_keys=5,n_cts=11;
+    FE_inner_product_DDH fe(len);
+    dlog_table dlog;
+    dlog.Build(ElGamal_Client::param.g,ElGamal_Client::param.p,4,3);//inner products from 12 on are missed
+    std::vector<std::shared_ptr<const decrypt_plan>> keys;
+    mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+    for(size_t k=0;k<n_keys;k++){
+        for(unsigned int i=0;i<len;i++){
+            mpz_init_set_ui(y[i],(k+i)%3==0?0:(k*2+i)%5);
+        }
+        keys.push_back(fe.Plan(y));
+        for(unsigned int i=0;i<len;i++){
+            mpz_clear(y[i]);
+        }
+    }
+    free(y);
+    std::vector<mpz_t*> msgs(n_cts);
+    Fill_Messages(msgs.data(),n_cts,len,1);
+    std::vector<cipher_text_FE> cts=fe.Encrypt_Batch(msgs.data(),n_cts);
+    Free_Messages(msgs.data(),n_cts,len);
+    evaluation_kernel kernel(ElGamal_Client::param.p,ElGamal_Client::param.q,1,2);//one cipher text and two keys per block
+    std::vector<int64_t> out(n_keys*n_cts);
+    size_t missed=kernel.Evaluate(keys,cts,dlog,out.data(),2);
+    bool ok=true;
+    size_t expected=0;
+    mpz_t log;
+    mpz_init(log);
+    for(size_t k=0;k<n_keys;k++){
+        for(size_t n=0;n<n_cts;n++){
+            plain_text pt=fe.Decrypt(cts[n],*keys[k]);
+            int64_t value=dlog.Lookup(log,pt.msg)?(int64_t)mpz_get_si(log):-1;
+            mpz_clear(pt.msg);
+            expected+=value<0;
+            ok=ok && out[k*n_cts+n]==value;
+        }
+    }
+    mpz_clear(log);
+    return ok && missed==expected && expected>0;
+}
+
+//Search against Decrypt and Lookup of every record: a threshold at or past the dlog bound, k = 0, and ties cut by k
+static bool Check_Search(){
+    unsigned int len=3;
+    size_t count=20;
+    FE_inner_product_DDH fe(len);
+    dlog_table dlog;
+    dlog.Build(ElGamal_Client::param.g,ElGamal_Client::param.p,9,8);
+    mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+    for(unsigned int i=0;i<len;i++){
+        mpz_init_set_ui(y[i],1);
+    }
+    std::shared_ptr<decrypt_plan> plan=fe.Plan(y);//scores are sums of 3 values below 4, so many tie
+    for(unsigned int i=0;i<len;i++){
+        mpz_clear(y[i]);
+    }
+    free(y);
+    std::vector<mpz_t*> msgs(count);
+    Fill_Messages(msgs.data(),count,len,2);
+    std::vector<cipher_text_FE> cts=fe.Encrypt_Batch(msgs.data(),count);
+    Free_Messages(msgs.data(),count,len);
+    std::vector<similarity_search::match> all;//every record, best first
+    mpz_t log;
+    mpz_init(log);
+    for(size_t n=0;n<count;n++){
+        plain_text pt=fe.Decrypt(cts[n],*plan);
+        if(dlog.Lookup(log,pt.msg)){
+            similarity_search::match m={(int64_t)mpz_get_si(log),n};
+            all.push_back(m);
+        }
+        mpz_clear(pt.msg);
+    }
+    mpz_clear(log);
+    std::stable_sort(all.begin(),all.end(),[](const similarity_search::match& a, const similarity_search::match& b){return a.score>b.score;});
+    bool ok=true;
+    const unsigned long thresholds[]={72,100,5,0};
+    const size_t ks[]={0,3,4};
+    for(unsigned long threshold: thresholds){
+        similarity_search search(fe,dlog,ElGamal_Client::param.g,threshold);
+        for(size_t k: ks){
+            std::vector<similarity_search::match> expected;
+            for(size_t a=0;a<all.size() && (k==0 || expected.size()<k);a++){
+                if(all[a].score>=(int64_t)threshold){
+                    expected.push_back(all[a]);
+                }
+            }
+            std::vector<similarity_search::match> got=search.Search(cts,*plan,k,2);
+            ok=ok && got.size()==expected.size() && (threshold<72 || got.empty());
+            for(size_t a=0;ok && a<got.size();a++){
+                ok=got[a].score==expected[a].score && got[a].id==expected[a].id;
+            }
+        }
+    }
+    return ok;
+}
+
+/*lane_kernel against the GMP path for l = 1..8, on counts that leave the last lanes empty and on
+negative x_{i} and y_{i}: its cipher texts must decrypt to <x,y> (mod q) with the GMP Decrypt, and
+its Decrypt must agree with the GMP Decrypt on cipher texts of the GMP Encrypt.
+*/
+static bool Check_Lane_Kernel(){
+    mpz_t& p=ElGamal_Client::param.p;
+    mpz_t& q=ElGamal_Client::param.q;
+    std::shared_ptr<const group_precomputation> group=std::make_shared<const group_precomputation>(ElGamal_Client::param,72,4);
+    gmp_randstate_t state;
+    gmp_randinit_mt(state);
+    gmp_randseed_ui(state,1);
+    bool ok=true;
+    mpz_t log;
+    mpz_init(log);
+    for(unsigned int len=1;len<=lane_kernel::max_len;len++){
+        tenant owner(group,len,4);
+        lane_kernel lanes(group->g_table,owner.h_tables,p,q);
+        size_t count=2*lane_kernel::lanes+len;//the last len records share a partial set of lanes
+        std::vector<int64_t> x(count*len);
+        mpz_t* y=(mpz_t *) malloc(len * sizeof(mpz_t));
+        for(unsigned int i=0;i<len;i++){
+            mpz_init_set_si(y[i],(long)(i%4)-1);
+        }
+        for(size_t k=0;k<x.size();k++){
+            x[k]=(int64_t)(k*5%11)-5;
+        }
+        std::shared_ptr<decrypt_plan> plan=owner.scheme->Plan(y);
+        std::vector<uint64_t> words(count*(len+1)),elements(count);
+        lanes.Encrypt(x.data(),count,words.data(),state);
+        std::vector<mpz_t*> msgs(count);
+        std::vector<uint64_t> gmp_words(count*(len+1));
+        cipher_text_FE ct(len);
+        for(size_t n=0;n<count;n++){
+            mpz_set_ui(ct.c0,(unsigned long)words[n*(len+1)]);
+            for(unsigned int i=0;i<len;i++){
+                mpz_set_ui(ct.c1[i],(unsigned long)words[n*(len+1)+i+1]);
+            }
+            long inner=0;
+            for(unsigned int i=0;i<len;i++){
+                inner+=(long)x[n*len+i]*((long)(i%4)-1);
+            }
+            inner=(inner%72+72)%72;
+            ok=ok && owner.Decrypt(log,ct,*plan) && mpz_cmp_si(log,inner)==0;
+            msgs[n]=(mpz_t *) malloc(len * sizeof(mpz_t));
+            for(unsigned int i=0;i<len;i++){
+                mpz_init_set_si(msgs[n][i],(long)x[n*len+i]);
+            }
+            cipher_text_FE gmp_ct=owner.Encrypt(msgs[n]);
+            gmp_words[n*(len+1)]=mpz_get_ui(gmp_ct.c0);
+            for(unsigned int i=0;i<len;i++){
+                gmp_words[n*(len+1)+i+1]=mpz_get_ui(gmp_ct.c1[i]);
+            }
+            free(gmp_ct.c1);
+        }
+        lanes.Decrypt(*plan,gmp_words.data(),count,elements.data());
+        for(size_t n=0;n<count;n++){
+            mpz_set_ui(ct.c0,(unsigned long)gmp_words[n*(len+1)]);
+            for(unsigned int i=0;i<len;i++){
+                mpz_set_ui(ct.c1[i],(unsigned long)gmp_words[n*(len+1)+i+1]);
+            }
+            plain_text pt=owner.scheme->Decrypt(ct,*plan);
+            ok=ok && mpz_cmp_ui(pt.msg,(unsigned long)elements[n])==0;
+            mpz_clear(pt.msg);
+        }
+        Free_Messages(msgs.data(),count,len);
+        for(unsigned int i=0;i<len;i++){
+            mpz_clear(y[i]);
+        }
+        free(y);
+        free(ct.c1);
+    }
+    mpz_clear(log);
+    gmp_randclear(state);
+    return ok;
+}
 
 int main(){
     unsigned int num_clients=2;
@@ -366,6 +7569,30 @@ int main(){
     }
     mpz_powm(result,ElGamal_Client::param.g,result,ElGamal_Client::param.p);
     gmp_printf("Desired result: %Zd\n", result);
+    //check the batched paths against the scalar ones
+    bool passed=true;
+    passed=Report("gmp_arena",Check_Arena()) && passed;
+    passed=Report("adaptive_precomputation",Check_Precomputation()) && passed;
+    passed=Report("functional_key_cache",Check_Key_Cache()) && passed;
+    passed=Report("key_registry",Check_Key_Registry()) && passed;
+    passed=Report("tenant",Check_Tenants()) && passed;
+    passed=Report("tenant_batch",Check_Batch_Engine()) && passed;
+    passed=Report("sharded_decryptor",Check_Shards()) && passed;
+    passed=Report("Update_Plan",Check_Update_Plan()) && passed;
+    passed=Report("batch_encrypt_coordinator",Check_Batch_Encrypt()) && passed;
+    passed=Report("Multi_Multiply",Check_Curve_MSM()) && passed;
+    passed=Report("point encoding",Check_Point_Encoding()) && passed;
+    passed=Report("GLV",Check_GLV()) && passed;
+    passed=Report("fe_setup",Check_Setup_Bounds()) && passed;
+    passed=Report("cipher text container",Check_Container()) && passed;
+    passed=Report("joint_base_table",Check_Joint_Base()) && passed;
+    passed=Report("record_packer",Check_Record_Packer()) && passed;
+    passed=Report("window_aggregator",Check_Window_Aggregator()) && passed;
+    passed=Report("tiered_dlog and sorted_dlog_table",Check_Dlog_Variants()) && passed;
+    passed=Report("Lookup_Batch",Check_Lookup_Batch()) && passed;
+    passed=Report("Evaluate",Check_Evaluate()) && passed;
+    passed=Report("Search",Check_Search()) && passed;
+    passed=Report("lane_kernel",Check_Lane_Kernel()) && passed;
     /*Test Code for ElGamal*/
 
     /*d.Info();
@@ -388,5 +7615,6 @@ int main(){
     gmp_printf("%Zd %Zd\n",ct.c0, ct.c1);
     plain_text pt=d.Decrypt(ct);
     gmp_printf("%Zd\n",pt.msg);*/
-    return 0;
-}
\ No newline at end of file
+    return passed?0:1;
+}
+#endif
@@ -0,0 +1,70 @@
+/*C interface to the inner product functional encryption of FE.cpp.
+
+Build the shared library with
+    g++ -O2 -shared -fPIC -fvisibility=hidden -DFE_LIBRARY -o libfe.so FE.cpp -lgmp -pthread
+
+Group elements cross the interface as fixed-width big-endian byte strings of fe_element_bytes()
+bytes. A cipher text is fe_ciphertext_bytes() bytes: Ct_{0} followed by Ct_{1}, ..., Ct_{l}.
+Vectors are arrays of l int64_t; a batch of count vectors is count * l int64_t, row after row.
+All buffers are owned by the caller. Every function that can fail returns FE_OK or a negative
+FE_ERROR_* code.
+
+A scheme may be shared between threads, except that fe_scheme_free must not race with any other
+call. The batch functions spread their work over the library's own worker threads; batch calls on
+the same scheme from several threads are serialized, each one waiting for the previous to finish.
+*/
+#ifndef FE_H
+#define FE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define FE_API __attribute__((visibility("default")))
+#else
+#define FE_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fe_scheme fe_scheme;/*master key, public keys and precomputed tables*/
+typedef struct fe_key fe_key;/*functional key for one vector y*/
+
+enum{
+    FE_OK=0,
+    FE_ERROR_ARGUMENT=-1,/*a null pointer, a length of 0, or a key derived for a different length*/
+    FE_ERROR_MEMORY=-2,
+    FE_ERROR_RANGE=-3/*<x,y> is outside [0, dlog_bound): the result is set to -1*/
+};
+
+/*Setup for vectors of length l. Inner products in [0, dlog_bound) can be decoded by decryption.
+Inner products are only defined modulo the group order q (72 for the demo group), so dlog_bound
+must be at most q. Returns NULL on failure: a length of 0, a dlog_bound of 0 or above q, or no memory.*/
+FE_API fe_scheme* fe_setup(uint32_t length, uint64_t dlog_bound);
+FE_API void fe_scheme_free(fe_scheme* scheme);
+FE_API uint32_t fe_length(const fe_scheme* scheme);
+FE_API size_t fe_element_bytes(const fe_scheme* scheme);
+FE_API size_t fe_ciphertext_bytes(const fe_scheme* scheme);
+
+/*KeyDer for the vector y. Returns NULL on failure.*/
+FE_API fe_key* fe_keyder(fe_scheme* scheme, const int64_t* y);
+FE_API void fe_key_free(fe_key* key);
+
+/*encrypt the vector x into ct, which has room for fe_ciphertext_bytes() bytes*/
+FE_API int fe_encrypt(fe_scheme* scheme, const int64_t* x, uint8_t* ct);
+/*decrypt ct with key into *value = <x,y>*/
+FE_API int fe_decrypt(fe_scheme* scheme, const fe_key* key, const uint8_t* ct, int64_t* value);
+
+/*encrypt count vectors from x into count consecutive cipher texts in cts*/
+FE_API int fe_encrypt_batch(fe_scheme* scheme, const int64_t* x, size_t count, uint8_t* cts);
+/*decrypt count consecutive cipher texts of cts into values; a value that is out of range is
+set to -1 and makes the call return FE_ERROR_RANGE after all others are done*/
+FE_API int fe_decrypt_batch(fe_scheme* scheme, const fe_key* key, const uint8_t* cts, size_t count, int64_t* values);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+"""Python bindings for the inner product functional encryption of FE.cpp.
+
+The bindings call the C interface of fe.h in libfe.so (see the README for the build line).
+Messages and weight vectors are NumPy int64 arrays, or anything that exposes an integer buffer;
+arrays that already are C-contiguous int64 are passed without a copy. Cipher texts come back as
+NumPy uint8 arrays with one row of ciphertext_bytes per record, which are written by the library
+in place. ctypes releases the GIL for the duration of every call into the library, so other Python
+threads keep running during a batch call; batch calls on the same Scheme from several threads are
+serialized by the library, each one spread over its worker threads in turn.
+
+    import numpy as np, fe
+    scheme = fe.Scheme(length=4, dlog_bound=72)
+    key = scheme.keyder(np.array([1, 2, 0, 1]))
+    cts = scheme.encrypt_batch(np.random.randint(0, 5, size=(10000, 4)))
+    values = scheme.decrypt_batch(key, cts)
+"""
+import ctypes
+import os
+
+import numpy as np
+
+FE_OK = 0
+FE_ERROR_ARGUMENT = -1
+FE_ERROR_MEMORY = -2
+FE_ERROR_RANGE = -3
+
+
+def _load():
+    path = os.environ.get("FE_LIBRARY", os.path.join(os.path.dirname(os.path.abspath(__file__)), "libfe.so"))
+    lib = ctypes.CDLL(path)
+    scheme_p, key_p = ctypes.c_void_p, ctypes.c_void_p
+    i64_p, u8_p = ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_uint8)
+    signatures = {
+        "fe_setup": (scheme_p, [ctypes.c_uint32, ctypes.c_uint64]),
+        "fe_scheme_free": (None, [scheme_p]),
+        "fe_length": (ctypes.c_uint32, [scheme_p]),
+        "fe_element_bytes": (ctypes.c_size_t, [scheme_p]),
+        "fe_ciphertext_bytes": (ctypes.c_size_t, [scheme_p]),
+        "fe_keyder": (key_p, [scheme_p, i64_p]),
+        "fe_key_free": (None, [key_p]),
+        "fe_encrypt_batch": (ctypes.c_int, [scheme_p, i64_p, ctypes.c_size_t, u8_p]),
+        "fe_decrypt_batch": (ctypes.c_int, [scheme_p, key_p, u8_p, ctypes.c_size_t, i64_p]),
+    }
+    for name, (restype, argtypes) in signatures.items():
+        function = getattr(lib, name)
+        function.restype = restype
+        function.argtypes = argtypes
+    return lib
+
+
+_lib = _load()
+
+
+def _int64_rows(values, length):
+    """view values as a C-contiguous (count, length) int64 array, copying only if it has to"""
+    array = np.ascontiguousarray(values, dtype=np.int64)
+    if array.ndim == 1:
+        array = array.reshape(1, -1)
+    if array.ndim != 2 or array.shape[1] != length:
+        raise ValueError("expected rows of %d components, got shape %s" % (length, array.shape))
+    return array
+
+
+def _pointer(array, ctype):
+    return array.ctypes.data_as(ctypes.POINTER(ctype))
+
+
+class Key:
+    """functional key for one weight vector y"""
+
+    def __init__(self, handle):
+        self._handle = handle
+
+    def __del__(self):
+        if getattr(self, "_handle", None):
+            _lib.fe_key_free(self._handle)
+            self._handle = None
+
+
+class Scheme:
+    """master key, public keys and precomputed tables for vectors of a fixed length"""
+
+    def __init__(self, length, dlog_bound):
+        self._handle = _lib.fe_setup(length, dlog_bound)
+        if not self._handle:
+            raise ValueError("fe_setup failed for length %d and dlog_bound %d (dlog_bound must be in [1, q])" % (length, dlog_bound))
+        self.length = _lib.fe_length(self._handle)
+        self.element_bytes = _lib.fe_element_bytes(self._handle)
+        self.ciphertext_bytes = _lib.fe_ciphertext_bytes(self._handle)
+
+    def __del__(self):
+        if getattr(self, "_handle", None):
+            _lib.fe_scheme_free(self._handle)
+            self._handle = None
+
+    def keyder(self, y):
+        y = _int64_rows(y, self.length)
+        if y.shape[0] != 1:
+            raise ValueError("keyder takes a single weight vector")
+        handle = _lib.fe_keyder(self._handle, _pointer(y, ctypes.c_int64))
+        if not handle:
+            raise MemoryError("fe_keyder failed")
+        return Key(handle)
+
+    def encrypt_batch(self, x):
+        """encrypt every row of x; returns a (count, ciphertext_bytes) uint8 array"""
+        x = _int64_rows(x, self.length)
+        cts = np.empty((x.shape[0], self.ciphertext_bytes), dtype=np.uint8)
+        if x.shape[0] > 0:
+            _check(_lib.fe_encrypt_batch(self._handle, _pointer(x, ctypes.c_int64), x.shape[0], _pointer(cts, ctypes.c_uint8)))
+        return cts
+
+    def decrypt_batch(self, key, cts):
+        """decrypt every row of cts, which may be any buffer of whole cipher texts; returns an int64
+        array of inner products, with -1 for those outside [0, dlog_bound)"""
+        if not isinstance(cts, np.ndarray):
+            cts = np.frombuffer(cts, dtype=np.uint8)
+        cts = np.ascontiguousarray(cts, dtype=np.uint8)
+        if cts.size % self.ciphertext_bytes != 0:
+            raise ValueError("buffer of %d bytes does not hold whole cipher texts of %d bytes" % (cts.size, self.ciphertext_bytes))
+        count = cts.size // self.ciphertext_bytes
+        values = np.empty(count, dtype=np.int64)
+        if count > 0:
+            status = _lib.fe_decrypt_batch(self._handle, key._handle, _pointer(cts, ctypes.c_uint8), count, _pointer(values, ctypes.c_int64))
+            if status != FE_ERROR_RANGE:
+                _check(status)
+        return values
+
+    def encrypt(self, x):
+        """encrypt one vector; returns a ciphertext_bytes uint8 array"""
+        return self.encrypt_batch(x)[0]
+
+    def decrypt(self, key, ct):
+        """decrypt one cipher text; returns <x,y>, or -1 if it is outside [0, dlog_bound)"""
+        return int(self.decrypt_batch(key, ct)[0])
+
+
+def _check(status):
+    if status == FE_ERROR_ARGUMENT:
+        raise ValueError("invalid argument")
+    if status == FE_ERROR_MEMORY:
+        raise MemoryError("out of memory")
+    if status != FE_OK:
+        raise RuntimeError("fe error %d" % status)